@@ -31,140 +31,1099 @@
 
 #include "helper.h"
 
-static const __u32 crc32_tab[] = {
-	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
-	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
-	0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91, 0x1db71064, 0x6ab020f2,
-	0xf3b97148, 0x84be41de,	0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
-	0x136c9856, 0x646ba8c0, 0xfd62f97a, 0x8a65c9ec,	0x14015c4f, 0x63066cd9,
-	0xfa0f3d63, 0x8d080df5,	0x3b6e20c8, 0x4c69105e, 0xd56041e4, 0xa2677172,
-	0x3c03e4d1, 0x4b04d447, 0xd20d85fd, 0xa50ab56b,	0x35b5a8fa, 0x42b2986c,
-	0xdbbbc9d6, 0xacbcf940,	0x32d86ce3, 0x45df5c75, 0xdcd60dcf, 0xabd13d59,
-	0x26d930ac, 0x51de003a, 0xc8d75180, 0xbfd06116, 0x21b4f4b5, 0x56b3c423,
-	0xcfba9599, 0xb8bda50f, 0x2802b89e, 0x5f058808, 0xc60cd9b2, 0xb10be924,
-	0x2f6f7c87, 0x58684c11, 0xc1611dab, 0xb6662d3d,	0x76dc4190, 0x01db7106,
-	0x98d220bc, 0xefd5102a, 0x71b18589, 0x06b6b51f, 0x9fbfe4a5, 0xe8b8d433,
-	0x7807c9a2, 0x0f00f934, 0x9609a88e, 0xe10e9818, 0x7f6a0dbb, 0x086d3d2d,
-	0x91646c97, 0xe6635c01, 0x6b6b51f4, 0x1c6c6162, 0x856530d8, 0xf262004e,
-	0x6c0695ed, 0x1b01a57b, 0x8208f4c1, 0xf50fc457, 0x65b0d9c6, 0x12b7e950,
-	0x8bbeb8ea, 0xfcb9887c, 0x62dd1ddf, 0x15da2d49, 0x8cd37cf3, 0xfbd44c65,
-	0x4db26158, 0x3ab551ce, 0xa3bc0074, 0xd4bb30e2, 0x4adfa541, 0x3dd895d7,
-	0xa4d1c46d, 0xd3d6f4fb, 0x4369e96a, 0x346ed9fc, 0xad678846, 0xda60b8d0,
-	0x44042d73, 0x33031de5, 0xaa0a4c5f, 0xdd0d7cc9, 0x5005713c, 0x270241aa,
-	0xbe0b1010, 0xc90c2086, 0x5768b525, 0x206f85b3, 0xb966d409, 0xce61e49f,
-	0x5edef90e, 0x29d9c998, 0xb0d09822, 0xc7d7a8b4, 0x59b33d17, 0x2eb40d81,
-	0xb7bd5c3b, 0xc0ba6cad, 0xedb88320, 0x9abfb3b6, 0x03b6e20c, 0x74b1d29a,
-	0xead54739, 0x9dd277af, 0x04db2615, 0x73dc1683, 0xe3630b12, 0x94643b84,
-	0x0d6d6a3e, 0x7a6a5aa8, 0xe40ecf0b, 0x9309ff9d, 0x0a00ae27, 0x7d079eb1,
-	0xf00f9344, 0x8708a3d2, 0x1e01f268, 0x6906c2fe, 0xf762575d, 0x806567cb,
-	0x196c3671, 0x6e6b06e7, 0xfed41b76, 0x89d32be0, 0x10da7a5a, 0x67dd4acc,
-	0xf9b9df6f, 0x8ebeeff9, 0x17b7be43, 0x60b08ed5, 0xd6d6a3e8, 0xa1d1937e,
-	0x38d8c2c4, 0x4fdff252, 0xd1bb67f1, 0xa6bc5767, 0x3fb506dd, 0x48b2364b,
-	0xd80d2bda, 0xaf0a1b4c, 0x36034af6, 0x41047a60, 0xdf60efc3, 0xa867df55,
-	0x316e8eef, 0x4669be79, 0xcb61b38c, 0xbc66831a, 0x256fd2a0, 0x5268e236,
-	0xcc0c7795, 0xbb0b4703, 0x220216b9, 0x5505262f, 0xc5ba3bbe, 0xb2bd0b28,
-	0x2bb45a92, 0x5cb36a04, 0xc2d7ffa7, 0xb5d0cf31, 0x2cd99e8b, 0x5bdeae1d,
-	0x9b64c2b0, 0xec63f226, 0x756aa39c, 0x026d930a, 0x9c0906a9, 0xeb0e363f,
-	0x72076785, 0x05005713, 0x95bf4a82, 0xe2b87a14, 0x7bb12bae, 0x0cb61b38,
-	0x92d28e9b, 0xe5d5be0d, 0x7cdcefb7, 0x0bdbdf21, 0x86d3d2d4, 0xf1d4e242,
-	0x68ddb3f8, 0x1fda836e, 0x81be16cd, 0xf6b9265b, 0x6fb077e1, 0x18b74777,
-	0x88085ae6, 0xff0f6a70, 0x66063bca, 0x11010b5c, 0x8f659eff, 0xf862ae69,
-	0x616bffd3, 0x166ccf45, 0xa00ae278, 0xd70dd2ee, 0x4e048354, 0x3903b3c2,
-	0xa7672661, 0xd06016f7, 0x4969474d, 0x3e6e77db, 0xaed16a4a, 0xd9d65adc,
-	0x40df0b66, 0x37d83bf0, 0xa9bcae53, 0xdebb9ec5, 0x47b2cf7f, 0x30b5ffe9,
-	0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693,
-	0x54de5729, 0x23d967bf, 0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94,
-	0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d
-};
-
-/* */
-/* CRC LOOKUP TABLE */
-/* ================ */
-/* The following CRC lookup table was generated automagically */
-/* by the Rocksoft^tm Model CRC Algorithm Table Generation */
-/* Program V1.0 using the following model parameters: */
-/* */
-/* Width : 4 bytes. */
-/* Poly : 0x1EDC6F41L */
-/* Reverse : TRUE. */
-/* */
-/* For more information on the Rocksoft^tm Model CRC Algorithm, */
-/* see the document titled "A Painless Guide to CRC Error */
-/* Detection Algorithms" by Ross Williams */
-/* (ross@guest.adelaide.edu.au.). This document is likely to be */
-/* in the FTP archive "ftp.adelaide.edu.au/pub/rocksoft". */
-/* */
-static const __u32 crc32c_tab[256] = {
-    0x00000000L, 0xF26B8303L, 0xE13B70F7L, 0x1350F3F4L, 0xC79A971FL,
-    0x35F1141CL, 0x26A1E7E8L, 0xD4CA64EBL, 0x8AD958CFL, 0x78B2DBCCL,
-    0x6BE22838L, 0x9989AB3BL, 0x4D43CFD0L, 0xBF284CD3L, 0xAC78BF27L,
-    0x5E133C24L, 0x105EC76FL, 0xE235446CL, 0xF165B798L, 0x030E349BL,
-    0xD7C45070L, 0x25AFD373L, 0x36FF2087L, 0xC494A384L, 0x9A879FA0L,
-    0x68EC1CA3L, 0x7BBCEF57L, 0x89D76C54L, 0x5D1D08BFL, 0xAF768BBCL,
-    0xBC267848L, 0x4E4DFB4BL, 0x20BD8EDEL, 0xD2D60DDDL, 0xC186FE29L,
-    0x33ED7D2AL, 0xE72719C1L, 0x154C9AC2L, 0x061C6936L, 0xF477EA35L,
-    0xAA64D611L, 0x580F5512L, 0x4B5FA6E6L, 0xB93425E5L, 0x6DFE410EL,
-    0x9F95C20DL, 0x8CC531F9L, 0x7EAEB2FAL, 0x30E349B1L, 0xC288CAB2L,
-    0xD1D83946L, 0x23B3BA45L, 0xF779DEAEL, 0x05125DADL, 0x1642AE59L,
-    0xE4292D5AL, 0xBA3A117EL, 0x4851927DL, 0x5B016189L, 0xA96AE28AL,
-    0x7DA08661L, 0x8FCB0562L, 0x9C9BF696L, 0x6EF07595L, 0x417B1DBCL,
-    0xB3109EBFL, 0xA0406D4BL, 0x522BEE48L, 0x86E18AA3L, 0x748A09A0L,
-    0x67DAFA54L, 0x95B17957L, 0xCBA24573L, 0x39C9C670L, 0x2A993584L,
-    0xD8F2B687L, 0x0C38D26CL, 0xFE53516FL, 0xED03A29BL, 0x1F682198L,
-    0x5125DAD3L, 0xA34E59D0L, 0xB01EAA24L, 0x42752927L, 0x96BF4DCCL,
-    0x64D4CECFL, 0x77843D3BL, 0x85EFBE38L, 0xDBFC821CL, 0x2997011FL,
-    0x3AC7F2EBL, 0xC8AC71E8L, 0x1C661503L, 0xEE0D9600L, 0xFD5D65F4L,
-    0x0F36E6F7L, 0x61C69362L, 0x93AD1061L, 0x80FDE395L, 0x72966096L,
-    0xA65C047DL, 0x5437877EL, 0x4767748AL, 0xB50CF789L, 0xEB1FCBADL,
-    0x197448AEL, 0x0A24BB5AL, 0xF84F3859L, 0x2C855CB2L, 0xDEEEDFB1L,
-    0xCDBE2C45L, 0x3FD5AF46L, 0x7198540DL, 0x83F3D70EL, 0x90A324FAL,
-    0x62C8A7F9L, 0xB602C312L, 0x44694011L, 0x5739B3E5L, 0xA55230E6L,
-    0xFB410CC2L, 0x092A8FC1L, 0x1A7A7C35L, 0xE811FF36L, 0x3CDB9BDDL,
-    0xCEB018DEL, 0xDDE0EB2AL, 0x2F8B6829L, 0x82F63B78L, 0x709DB87BL,
-    0x63CD4B8FL, 0x91A6C88CL, 0x456CAC67L, 0xB7072F64L, 0xA457DC90L,
-    0x563C5F93L, 0x082F63B7L, 0xFA44E0B4L, 0xE9141340L, 0x1B7F9043L,
-    0xCFB5F4A8L, 0x3DDE77ABL, 0x2E8E845FL, 0xDCE5075CL, 0x92A8FC17L,
-    0x60C37F14L, 0x73938CE0L, 0x81F80FE3L, 0x55326B08L, 0xA759E80BL,
-    0xB4091BFFL, 0x466298FCL, 0x1871A4D8L, 0xEA1A27DBL, 0xF94AD42FL,
-    0x0B21572CL, 0xDFEB33C7L, 0x2D80B0C4L, 0x3ED04330L, 0xCCBBC033L,
-    0xA24BB5A6L, 0x502036A5L, 0x4370C551L, 0xB11B4652L, 0x65D122B9L,
-    0x97BAA1BAL, 0x84EA524EL, 0x7681D14DL, 0x2892ED69L, 0xDAF96E6AL,
-    0xC9A99D9EL, 0x3BC21E9DL, 0xEF087A76L, 0x1D63F975L, 0x0E330A81L,
-    0xFC588982L, 0xB21572C9L, 0x407EF1CAL, 0x532E023EL, 0xA145813DL,
-    0x758FE5D6L, 0x87E466D5L, 0x94B49521L, 0x66DF1622L, 0x38CC2A06L,
-    0xCAA7A905L, 0xD9F75AF1L, 0x2B9CD9F2L, 0xFF56BD19L, 0x0D3D3E1AL,
-    0x1E6DCDEEL, 0xEC064EEDL, 0xC38D26C4L, 0x31E6A5C7L, 0x22B65633L,
-    0xD0DDD530L, 0x0417B1DBL, 0xF67C32D8L, 0xE52CC12CL, 0x1747422FL,
-    0x49547E0BL, 0xBB3FFD08L, 0xA86F0EFCL, 0x5A048DFFL, 0x8ECEE914L,
-    0x7CA56A17L, 0x6FF599E3L, 0x9D9E1AE0L, 0xD3D3E1ABL, 0x21B862A8L,
-    0x32E8915CL, 0xC083125FL, 0x144976B4L, 0xE622F5B7L, 0xF5720643L,
-    0x07198540L, 0x590AB964L, 0xAB613A67L, 0xB831C993L, 0x4A5A4A90L,
-    0x9E902E7BL, 0x6CFBAD78L, 0x7FAB5E8CL, 0x8DC0DD8FL, 0xE330A81AL,
-    0x115B2B19L, 0x020BD8EDL, 0xF0605BEEL, 0x24AA3F05L, 0xD6C1BC06L,
-    0xC5914FF2L, 0x37FACCF1L, 0x69E9F0D5L, 0x9B8273D6L, 0x88D28022L,
-    0x7AB90321L, 0xAE7367CAL, 0x5C18E4C9L, 0x4F48173DL, 0xBD23943EL,
-    0xF36E6F75L, 0x0105EC76L, 0x12551F82L, 0xE03E9C81L, 0x34F4F86AL,
-    0xC69F7B69L, 0xD5CF889DL, 0x27A40B9EL, 0x79B737BAL, 0x8BDCB4B9L,
-    0x988C474DL, 0x6AE7C44EL, 0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L,
-    0xAD7D5351L};
+#if defined(_M_X64) || defined(_M_AMD64) || defined(_M_IX86)
+ #include <intrin.h>
+ #include <nmmintrin.h>
+ #define CRC32_X86
+#endif
+
+/*
+ * The folding kernel keeps its state in XMM registers.  x64 kernel code
+ * may use them freely, but 32-bit drivers would have to save the
+ * floating point state first, so only build it for x64.
+ */
+#if defined(_M_X64) || defined(_M_AMD64)
+ #include <wmmintrin.h>
+ #include <smmintrin.h>
+ #define CRC32_PCLMUL
+#endif
+
+#define CRC32_POLY		0xEDB88320
+#define CRC32C_POLY		0x82F63B78
+
+/*
+ * Lookup tables, generated from the polynomials by drv_crc32_init().
+ * Slice 0 is the classic byte-wise table; slice @k maps a byte to its
+ * CRC contribution after @k further zero bytes have been shifted
+ * through the register, so 8 (or 16) input bytes can be folded with
+ * independent lookups.  Each slice is 1KB, so aligning the tables to
+ * a cache line keeps every slice on whole lines.
+ */
+#define CRC32_SLICES	16
+#define CRC32_CACHE_ALIGN	__declspec(align(64))
+
+static CRC32_CACHE_ALIGN __u32 crc32_slice_tab[CRC32_SLICES][256];
+static CRC32_CACHE_ALIGN __u32 crc32c_slice_tab[CRC32_SLICES][256];
+
+static __bool crc32_slice_inited = FALSE;
+
+/*
+ * Buffers smaller than this are not worth the extra table footprint
+ * of slice-by-16; slice-by-8 is used for them instead.
+ */
+#define CRC32_SLICE16_THRESHOLD	256
+
+/**
+ * @brief	Bit-at-a-time reference implementation.  Used to generate
+ *			the tables, to check the other engines, and before the
+ *			tables are built.
+ */
+static __u32
+crc32_bits(__u32 crc, const __u8 *p, size_t size, __u32 poly)
+{
+	int k;
+
+	while (size--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (poly & (0 - (crc & 1)));
+	}
+
+	return crc;
+}
+
+static void
+crc32_slice_init(__u32 slice_tab[CRC32_SLICES][256], __u32 poly)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		__u8 byte = (__u8)i;
+		slice_tab[0][i] = crc32_bits(0, &byte, 1, poly);
+	}
+
+	for (k = 1; k < CRC32_SLICES; k++) {
+		for (i = 0; i < 256; i++) {
+			__u32 crc = slice_tab[k - 1][i];
+			slice_tab[k][i] = (crc >> 8) ^ slice_tab[0][crc & 0xFF];
+		}
+	}
+}
 
 static inline __u32
-crc32(__u32 crc, const void *buf, __u32 size, const size_t *tab)
+crc32_load_le32(const __u8 *p)
 {
-	const __u8 *p = (const __u8 *)buf;
+	return le32_to_cpu(*(const __le32 UNALIGNED *)p);
+}
 
+static inline __u32
+crc32_bytes(__u32 crc, const __u8 *p, size_t size, const __u32 *tab)
+{
 	while (size--)
 		crc = tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
 
-	return (crc);
+	return crc;
+}
+
+static __u32
+crc32_slice8(__u32 crc, const __u8 *p, size_t size,
+		__u32 tab[CRC32_SLICES][256])
+{
+	/* Align the input so that the word loads below are natural */
+	while (size && ((ULONG_PTR)p & 3)) {
+		crc = tab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+
+	while (size >= 8) {
+		__u32 one = crc32_load_le32(p) ^ crc;
+		__u32 two = crc32_load_le32(p + 4);
+
+		crc = tab[7][one & 0xFF] ^
+		      tab[6][(one >> 8) & 0xFF] ^
+		      tab[5][(one >> 16) & 0xFF] ^
+		      tab[4][one >> 24] ^
+		      tab[3][two & 0xFF] ^
+		      tab[2][(two >> 8) & 0xFF] ^
+		      tab[1][(two >> 16) & 0xFF] ^
+		      tab[0][two >> 24];
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32_bytes(crc, p, size, tab[0]);
+}
+
+static __u32
+crc32_slice16(__u32 crc, const __u8 *p, size_t size,
+		__u32 tab[CRC32_SLICES][256])
+{
+	while (size && ((ULONG_PTR)p & 3)) {
+		crc = tab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		size--;
+	}
+
+	while (size >= 16) {
+		__u32 one = crc32_load_le32(p) ^ crc;
+		__u32 two = crc32_load_le32(p + 4);
+		__u32 three = crc32_load_le32(p + 8);
+		__u32 four = crc32_load_le32(p + 12);
+
+		crc = tab[15][one & 0xFF] ^
+		      tab[14][(one >> 8) & 0xFF] ^
+		      tab[13][(one >> 16) & 0xFF] ^
+		      tab[12][one >> 24] ^
+		      tab[11][two & 0xFF] ^
+		      tab[10][(two >> 8) & 0xFF] ^
+		      tab[9][(two >> 16) & 0xFF] ^
+		      tab[8][two >> 24] ^
+		      tab[7][three & 0xFF] ^
+		      tab[6][(three >> 8) & 0xFF] ^
+		      tab[5][(three >> 16) & 0xFF] ^
+		      tab[4][three >> 24] ^
+		      tab[3][four & 0xFF] ^
+		      tab[2][(four >> 8) & 0xFF] ^
+		      tab[1][(four >> 16) & 0xFF] ^
+		      tab[0][four >> 24];
+		p += 16;
+		size -= 16;
+	}
+
+	return crc32_slice8(crc, p, size, tab);
+}
+
+static inline __u32
+crc32(__u32 crc, const void *buf, size_t size,
+	__u32 slice_tab[CRC32_SLICES][256], __u32 poly)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+	if (!crc32_slice_inited)
+		return crc32_bits(crc, p, size, poly);
+
+	if (size < 8)
+		return crc32_bytes(crc, p, size, slice_tab[0]);
+
+	if (size >= CRC32_SLICE16_THRESHOLD)
+		return crc32_slice16(crc, p, size, slice_tab);
+
+	return crc32_slice8(crc, p, size, slice_tab);
+}
+
+/*
+ * MSB-first CRC32, crc32_be() in Linux.  jbd2 checksum v1 runs it over
+ * every descriptor and data block of a transaction, both at commit and
+ * at replay, so block-sized buffers go to the folding kernel below when
+ * the processor has one.
+ */
+#define CRC32_BE_POLY	0x04C11DB7
+
+/*
+ * Slice @k of the MSB-first tables maps a byte to its contribution
+ * after @k further zero bytes, as for the bit-reflected ones.  Shorter
+ * buffers than the folding kernel takes, and processors without it,
+ * go through slice-by-8.
+ */
+#define CRC32_BE_SLICES	8
+
+static CRC32_CACHE_ALIGN __u32 crc32_be_slice_tab[CRC32_BE_SLICES][256];
+static __bool crc32_be_inited = FALSE;
+
+static __u32
+crc32_be_bits(__u32 crc, const __u8 *p, size_t size)
+{
+	int k;
+
+	while (size--) {
+		crc ^= (__u32)*p++ << 24;
+		for (k = 0; k < 8; k++)
+			crc = (crc << 1) ^ (CRC32_BE_POLY & (0 - (crc >> 31)));
+	}
+
+	return crc;
+}
+
+static void crc32_be_init(void)
+{
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		__u8 byte = (__u8)i;
+		crc32_be_slice_tab[0][i] = crc32_be_bits(0, &byte, 1);
+	}
+
+	for (k = 1; k < CRC32_BE_SLICES; k++) {
+		for (i = 0; i < 256; i++) {
+			__u32 crc = crc32_be_slice_tab[k - 1][i];
+			crc32_be_slice_tab[k][i] = (crc << 8) ^
+					crc32_be_slice_tab[0][crc >> 24];
+		}
+	}
+}
+
+static inline __u32
+crc32_be_bytes(__u32 crc, const __u8 *p, size_t size)
+{
+	while (size--)
+		crc = (crc << 8) ^ crc32_be_slice_tab[0][(crc >> 24) ^ *p++];
+
+	return crc;
+}
+
+static __u32
+crc32_be_slice8(__u32 crc, const __u8 *p, size_t size)
+{
+	__u32 (*tab)[256] = crc32_be_slice_tab;
+
+	while (size && ((ULONG_PTR)p & 3)) {
+		crc = (crc << 8) ^ tab[0][(crc >> 24) ^ *p++];
+		size--;
+	}
+
+	while (size >= 8) {
+		__u32 one = be32_to_cpu(*(const __be32 UNALIGNED *)p) ^ crc;
+		__u32 two = be32_to_cpu(*(const __be32 UNALIGNED *)(p + 4));
+
+		crc = tab[7][one >> 24] ^
+		      tab[6][(one >> 16) & 0xFF] ^
+		      tab[5][(one >> 8) & 0xFF] ^
+		      tab[4][one & 0xFF] ^
+		      tab[3][two >> 24] ^
+		      tab[2][(two >> 16) & 0xFF] ^
+		      tab[1][(two >> 8) & 0xFF] ^
+		      tab[0][two & 0xFF];
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32_be_bytes(crc, p, size);
+}
+
+/*
+ * GF(2) arithmetic on bit-reflected CRC values, used to move a CRC
+ * state across a run of zero bytes.
+ */
+
+/**
+ * @brief	Multiply @p a by @p b modulo the polynomial @p poly
+ */
+static __u32 crc32_multmodp(__u32 a, __u32 b, __u32 poly)
+{
+	__u32 m = (__u32)1 << 31;
+	__u32 p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ poly : b >> 1;
+	}
+	return p;
+}
+
+/**
+ * @brief	Calculate x^(8 * @p len) modulo the polynomial @p poly
+ */
+static __u32 crc32_x8nmodp(__u64 len, __u32 poly)
+{
+	__u32 sq = (__u32)1 << 30;	/* x^1 */
+	__u32 p = (__u32)1 << 31;	/* x^0 */
+	int k;
+
+	/* Square up to x^8, as @p len counts bytes */
+	for (k = 0; k < 3; k++)
+		sq = crc32_multmodp(sq, sq, poly);
+
+	while (len) {
+		if (len & 1)
+			p = crc32_multmodp(sq, p, poly);
+		sq = crc32_multmodp(sq, sq, poly);
+		len >>= 1;
+	}
+	return p;
+}
+
+/*
+ * x^(8 * 2^k) modulo each polynomial, so that shifting a CRC state by
+ * n bytes takes one multiplication per bit set in n.
+ */
+#define CRC32_X8N_BITS	64
+
+static CRC32_CACHE_ALIGN __u32 crc32_x8n_tab[CRC32_X8N_BITS];
+static CRC32_CACHE_ALIGN __u32 crc32c_x8n_tab[CRC32_X8N_BITS];
+
+static __bool crc32_x8n_inited = FALSE;
+
+static void crc32_x8n_init(__u32 *x8n_tab, __u32 poly)
+{
+	int k;
+
+	x8n_tab[0] = crc32_x8nmodp(1, poly);
+	for (k = 1; k < CRC32_X8N_BITS; k++)
+		x8n_tab[k] = crc32_multmodp(x8n_tab[k - 1], x8n_tab[k - 1], poly);
+}
+
+/**
+ * @brief	Advance the CRC state @p crc across @p len zero bytes
+ */
+static __u32
+crc32_shift(__u32 crc, __u64 len, const __u32 *x8n_tab, __u32 poly)
+{
+	int k;
+
+	if (!crc32_x8n_inited)
+		return crc32_multmodp(crc32_x8nmodp(len, poly), crc, poly);
+
+	for (k = 0; len; k++, len >>= 1) {
+		if (len & 1)
+			crc = crc32_multmodp(x8n_tab[k], crc, poly);
+	}
+	return crc;
+}
+
+#ifdef CRC32_X86
+
+/*
+ * Buffers of at least 3 * CRC32C_HW_LONG (or 3 * CRC32C_HW_SHORT) bytes
+ * are split into three interleaved streams.  The crc32 instruction has
+ * a latency of 3 cycles but a throughput of 1, so independent streams
+ * keep the unit busy; the partial results are shifted across the
+ * following streams with the tables below and XORed together.
+ */
+#define CRC32C_HW_LONG		1024
+#define CRC32C_HW_SHORT		256
+
+static CRC32_CACHE_ALIGN __u32 crc32c_shift_long_tab[4][256];
+static CRC32_CACHE_ALIGN __u32 crc32c_shift_short_tab[4][256];
+
+static __bool crc32c_hw_available = FALSE;
+
+static void
+crc32c_shift_init(__u32 shift_tab[4][256], size_t len)
+{
+	__u32 op = crc32_x8nmodp(len, CRC32C_POLY);
+	int i, j;
+
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 256; i++)
+			shift_tab[j][i] = crc32_multmodp(op,
+						(__u32)i << (8 * j), CRC32C_POLY);
+	}
+}
+
+static inline __u32
+crc32c_shift(__u32 shift_tab[4][256], __u32 crc)
+{
+	return shift_tab[0][crc & 0xFF] ^
+	       shift_tab[1][(crc >> 8) & 0xFF] ^
+	       shift_tab[2][(crc >> 16) & 0xFF] ^
+	       shift_tab[3][crc >> 24];
+}
+
+#if defined(_M_X64) || defined(_M_AMD64)
+ typedef __u64 crc32c_hw_word_t;
+ #define crc32c_hw_word(crc, p) \
+	((__u32)_mm_crc32_u64((crc), *(const __u64 UNALIGNED *)(p)))
+#else
+ typedef __u32 crc32c_hw_word_t;
+ #define crc32c_hw_word(crc, p) \
+	_mm_crc32_u32((crc), *(const __u32 UNALIGNED *)(p))
+#endif
+
+static __u32
+crc32c_hw_stream(__u32 crc, const __u8 *p, size_t size)
+{
+	while (size >= sizeof(crc32c_hw_word_t)) {
+		crc = crc32c_hw_word(crc, p);
+		p += sizeof(crc32c_hw_word_t);
+		size -= sizeof(crc32c_hw_word_t);
+	}
+	while (size--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static __u32
+crc32c_hw_3way(__u32 crc, const __u8 *p, size_t len,
+		__u32 shift_tab[4][256])
+{
+	const __u8 *end = p + len;
+	__u32 crc1 = 0, crc2 = 0;
+
+	while (p < end) {
+		crc = crc32c_hw_word(crc, p);
+		crc1 = crc32c_hw_word(crc1, p + len);
+		crc2 = crc32c_hw_word(crc2, p + 2 * len);
+		p += sizeof(crc32c_hw_word_t);
+	}
+
+	crc = crc32c_shift(shift_tab, crc) ^ crc1;
+	return crc32c_shift(shift_tab, crc) ^ crc2;
+}
+
+static __u32
+crc32c_hw(__u32 crc, const void *buf, size_t size)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+	while (size && ((ULONG_PTR)p & (sizeof(crc32c_hw_word_t) - 1))) {
+		crc = _mm_crc32_u8(crc, *p++);
+		size--;
+	}
+
+	while (size >= 3 * CRC32C_HW_LONG) {
+		crc = crc32c_hw_3way(crc, p, CRC32C_HW_LONG,
+					crc32c_shift_long_tab);
+		p += 3 * CRC32C_HW_LONG;
+		size -= 3 * CRC32C_HW_LONG;
+	}
+	while (size >= 3 * CRC32C_HW_SHORT) {
+		crc = crc32c_hw_3way(crc, p, CRC32C_HW_SHORT,
+					crc32c_shift_short_tab);
+		p += 3 * CRC32C_HW_SHORT;
+		size -= 3 * CRC32C_HW_SHORT;
+	}
+
+	return crc32c_hw_stream(crc, p, size);
+}
+
+/*
+ * Batched requests are walked three at a time.  Each buffer is a
+ * dependency chain of its own, so the words of three buffers are fed
+ * to the crc32 unit alternately over their common length, and the
+ * tails are finished one by one.
+ */
+#define CRC32C_HW_LANES		3
+
+static void
+crc32c_hw_multi(struct drv_crc32_req *reqs, int nr)
+{
+	int i, j;
+
+	for (i = 0; i + CRC32C_HW_LANES <= nr; i += CRC32C_HW_LANES) {
+		const __u8 *p[CRC32C_HW_LANES];
+		__u32 crc[CRC32C_HW_LANES];
+		size_t len = reqs[i].cr_len, off;
+
+		for (j = 0; j < CRC32C_HW_LANES; j++) {
+			p[j] = (const __u8 *)reqs[i + j].cr_buf;
+			crc[j] = reqs[i + j].cr_seed;
+			if (reqs[i + j].cr_len < len)
+				len = reqs[i + j].cr_len;
+		}
+		len &= ~(sizeof(crc32c_hw_word_t) - 1);
+
+		for (off = 0; off < len; off += sizeof(crc32c_hw_word_t)) {
+			crc[0] = crc32c_hw_word(crc[0], p[0] + off);
+			crc[1] = crc32c_hw_word(crc[1], p[1] + off);
+			crc[2] = crc32c_hw_word(crc[2], p[2] + off);
+		}
+
+		for (j = 0; j < CRC32C_HW_LANES; j++)
+			reqs[i + j].cr_crc = crc32c_hw(crc[j], p[j] + len,
+						reqs[i + j].cr_len - len);
+	}
+
+	for (; i < nr; i++)
+		reqs[i].cr_crc = crc32c_hw(reqs[i].cr_seed, reqs[i].cr_buf,
+					reqs[i].cr_len);
+}
+
+/**
+ * @brief	Probe CPUID for the crc32 instruction (SSE4.2)
+ */
+static __bool crc32c_hw_probe(void)
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 1)
+		return FALSE;
+
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) ? TRUE : FALSE;
+}
+
+#endif /* CRC32_X86 */
+
+#ifdef CRC32_PCLMUL
+
+/*
+ * Folding constants for the bit-reflected CRC32 polynomial, taken from
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction" (Intel, 2009):
+ *	k1 = x^(4*128+32) mod P, k2 = x^(4*128-32) mod P,
+ *	k3 = x^(128+32) mod P, k4 = x^(128-32) mod P,
+ *	k5 = x^64 mod P, and P'/mu for the final Barrett reduction.
+ */
+static const __declspec(align(16)) __u64 crc32_k1k2[] = { 0x0154442bd4, 0x01c6e41596 };
+static const __declspec(align(16)) __u64 crc32_k3k4[] = { 0x01751997d0, 0x00ccaa009e };
+static const __declspec(align(16)) __u64 crc32_k5k0[] = { 0x0163cd6124, 0x0000000000 };
+static const __declspec(align(16)) __u64 crc32_poly[] = { 0x01db710641, 0x01f7011641 };
+
+/*
+ * Buffers shorter than this do not amortize the reduction at the end
+ * of the folding kernel.
+ */
+#define CRC32_PCLMUL_THRESHOLD	64
+
+static __bool crc32_pclmul_available = FALSE;
+
+/**
+ * @brief	Fold @p len bytes into @p crc with carry-less multiplication
+ * @remarks	@p len must be a multiple of 16 and at least 64.
+ */
+static __u32
+crc32_pclmul_fold(__u32 crc, const __u8 *buf, size_t len)
+{
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)crc32_k1k2);
+
+	buf += 64;
+	len -= 64;
+
+	/* Fold four 128-bit lanes in parallel, 64 bytes per round */
+	while (len >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		y5 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)crc32_k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold the remaining 16-byte blocks, if any */
+	while (len >= 16) {
+		x2 = _mm_loadu_si128((const __m128i *)buf);
+
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+		buf += 16;
+		len -= 16;
+	}
+
+	/* Fold 128 bits down to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)crc32_k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction down to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)crc32_poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return (__u32)_mm_extract_epi32(x1, 1);
+}
+
+static __u32
+crc32_pclmul(__u32 crc, const void *buf, size_t size)
+{
+	const __u8 *p = (const __u8 *)buf;
+	size_t fold_len = size & ~(size_t)15;
+
+	crc = crc32_pclmul_fold(crc, p, fold_len);
+	return crc32(crc, p + fold_len, size - fold_len,
+			crc32_slice_tab, CRC32_POLY);
+}
+
+/**
+ * @brief	Probe CPUID for PCLMULQDQ and SSE4.1
+ */
+static __bool crc32_pclmul_probe(void)
+{
+	int info[4];
+
+	__cpuid(info, 0);
+	if (info[0] < 1)
+		return FALSE;
+
+	__cpuid(info, 1);
+	return ((info[2] & (1 << 1)) && (info[2] & (1 << 19))) ?
+			TRUE : FALSE;
+}
+
+/*
+ * Folding constants of the MSB-first polynomial, generated by
+ * crc32_be_pclmul_init().  Without bit reflection a 128-bit lane is
+ * H * x^64 + L, so moving it n bits forward multiplies L by
+ * x^n mod P and H by x^(n+64) mod P.
+ */
+static __declspec(align(16)) __u64 crc32_be_k512[2];	/* x^512, x^576 mod P */
+static __declspec(align(16)) __u64 crc32_be_k128[2];	/* x^128, x^192 mod P */
+
+static __bool crc32_be_pclmul_available = FALSE;
+
+/**
+ * @brief	Return x^@p n modulo the MSB-first polynomial
+ */
+static __u32 crc32_be_xpow(unsigned int n)
+{
+	__u32 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ (CRC32_BE_POLY & (0 - (r >> 31)));
+
+	return r;
+}
+
+static void crc32_be_pclmul_init(void)
+{
+	crc32_be_k512[0] = crc32_be_xpow(512);
+	crc32_be_k512[1] = crc32_be_xpow(512 + 64);
+	crc32_be_k128[0] = crc32_be_xpow(128);
+	crc32_be_k128[1] = crc32_be_xpow(128 + 64);
+}
+
+static inline __m128i
+crc32_be_fold(__m128i x, __m128i k, __m128i y)
+{
+	return _mm_xor_si128(_mm_xor_si128(
+			_mm_clmulepi64_si128(x, k, 0x00),
+			_mm_clmulepi64_si128(x, k, 0x11)), y);
+}
+
+/**
+ * @brief	Calculate the MSB-first CRC32 with carry-less multiplication
+ * @remarks	@p size must be at least CRC32_PCLMUL_THRESHOLD.  The lanes
+ *			are byte-swapped so that the first bit of the buffer is the
+ *			highest bit of the lane.  The lane left after folding has the
+ *			same remainder as the buffer, so it is run through the table
+ *			instead of a Barrett reduction.
+ */
+static __u32
+crc32_be_pclmul(__u32 crc, const void *buf, size_t size)
+{
+	const __m128i bswap = _mm_set_epi8(
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	const __u8 *p = (const __u8 *)buf;
+	__declspec(align(16)) __u8 lane[16];
+	__m128i x0, x1, x2, x3, x4;
+
+#define CRC32_BE_LOAD(off) \
+	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + (off))), bswap)
+
+	x1 = CRC32_BE_LOAD(0x00);
+	x2 = CRC32_BE_LOAD(0x10);
+	x3 = CRC32_BE_LOAD(0x20);
+	x4 = CRC32_BE_LOAD(0x30);
+
+	x1 = _mm_xor_si128(x1, _mm_set_epi32((int)crc, 0, 0, 0));
+	x0 = _mm_load_si128((const __m128i *)crc32_be_k512);
+
+	p += 64;
+	size -= 64;
+
+	/* Fold four lanes in parallel, 64 bytes per round */
+	while (size >= 64) {
+		x1 = crc32_be_fold(x1, x0, CRC32_BE_LOAD(0x00));
+		x2 = crc32_be_fold(x2, x0, CRC32_BE_LOAD(0x10));
+		x3 = crc32_be_fold(x3, x0, CRC32_BE_LOAD(0x20));
+		x4 = crc32_be_fold(x4, x0, CRC32_BE_LOAD(0x30));
+		p += 64;
+		size -= 64;
+	}
+
+	/* Fold the four lanes into one, then the remaining 16-byte blocks */
+	x0 = _mm_load_si128((const __m128i *)crc32_be_k128);
+	x1 = crc32_be_fold(x1, x0, x2);
+	x1 = crc32_be_fold(x1, x0, x3);
+	x1 = crc32_be_fold(x1, x0, x4);
+	while (size >= 16) {
+		x1 = crc32_be_fold(x1, x0, CRC32_BE_LOAD(0x00));
+		p += 16;
+		size -= 16;
+	}
+
+#undef CRC32_BE_LOAD
+
+	_mm_store_si128((__m128i *)lane, _mm_shuffle_epi8(x1, bswap));
+	crc = crc32_be_bytes(0, lane, sizeof(lane));
+	return crc32_be_bytes(crc, p, size);
+}
+
+#endif /* CRC32_PCLMUL */
+
+static enum drv_crc32_engine crc32_engine = DRV_CRC32_ENGINE_BITWISE;
+static enum drv_crc32_engine crc32c_engine = DRV_CRC32_ENGINE_BITWISE;
+static enum drv_crc32_engine crc32_be_engine = DRV_CRC32_ENGINE_BITWISE;
+
+/*
+ * Self-test pattern.  Long enough to run through the 3-way interleaved
+ * crc32 loops, the PCLMULQDQ folding kernel and every tail path.
+ */
+#define CRC32_SELFTEST_LEN	4096
+
+static __u8 crc32_selftest_buf[CRC32_SELFTEST_LEN + 8];
+
+static void crc32_selftest_init(void)
+{
+	__u32 x = 0x12345678;
+	size_t i;
+
+	for (i = 0; i < sizeof(crc32_selftest_buf); i++) {
+		x = x * 1103515245 + 12345;
+		crc32_selftest_buf[i] = (__u8)(x >> 16);
+	}
+}
+
+/**
+ * @brief	Check a checksum routine against known answers
+ * @param fn	drv_crc32() or drv_crc32c(), with the engine under test
+ *				selected
+ * @param poly	Polynomial of @p fn
+ * @param check	Check value of "123456789", with the customary pre and
+ *				post inversion
+ * @return	TRUE if @p fn agrees with the bitwise reference on every
+ *			vector
+ */
+static __bool
+crc32_selftest(__u32 (*fn)(__u32, const void *, size_t),
+		__u32 poly, __u32 check)
+{
+	static const char vec[] = "123456789";
+	size_t len, off;
+
+	if ((fn(~0U, vec, 9) ^ ~0U) != check)
+		return FALSE;
+
+	for (off = 0; off < 8; off += 3) {
+		for (len = 0; len <= CRC32_SELFTEST_LEN;
+				len += len < 64 ? 1 : 61) {
+			const __u8 *p = crc32_selftest_buf + off;
+			__u32 seed = (__u32)len * 0x9E3779B9;
+
+			if (fn(seed, p, len) != crc32_bits(seed, p, len, poly))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief	Check drv_crc32_be() against known answers, with the engine
+ *			under test selected
+ * @return	TRUE if it agrees with the bitwise reference on every vector
+ */
+static __bool crc32_be_selftest(void)
+{
+	static const char vec[] = "123456789";
+	size_t len, off;
+
+	if ((drv_crc32_be(~0U, vec, 9) ^ ~0U) != 0xFC891918)
+		return FALSE;
+
+	for (off = 0; off < 8; off += 3) {
+		for (len = 0; len <= CRC32_SELFTEST_LEN;
+				len += len < 64 ? 1 : 61) {
+			const __u8 *p = crc32_selftest_buf + off;
+			__u32 seed = (__u32)len * 0x9E3779B9;
+
+			if (drv_crc32_be(seed, p, len) != crc32_be_bits(seed, p, len))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/**
+ * @brief	Generate the lookup tables used by drv_crc32(),
+ *			drv_crc32c() and drv_crc32_be(), and select the fastest engines the processor
+ *			supports.  Every engine is checked against the bitwise
+ *			reference before it is selected; one that disagrees is
+ *			left disabled.
+ *			Must be called once at driver initialization; until then
+ *			both routines fall back to the bitwise loop.
+ */
+void drv_crc32_init(void)
+{
+	crc32_selftest_init();
+
+	crc32_be_init();
+	crc32_be_inited = TRUE;
+	if (crc32_be_selftest()) {
+		crc32_be_engine = DRV_CRC32_ENGINE_SLICE;
+	} else {
+		dbg_print("crc32_be slicing tables failed self-test\n");
+		crc32_be_inited = FALSE;
+	}
+
+	crc32_x8n_init(crc32_x8n_tab, CRC32_POLY);
+	crc32_x8n_init(crc32c_x8n_tab, CRC32C_POLY);
+	crc32_x8n_inited = TRUE;
+
+	crc32_slice_init(crc32_slice_tab, CRC32_POLY);
+	crc32_slice_init(crc32c_slice_tab, CRC32C_POLY);
+	crc32_slice_inited = TRUE;
+	if (!crc32_selftest(drv_crc32, CRC32_POLY, 0xCBF43926) ||
+	    !crc32_selftest(drv_crc32c, CRC32C_POLY, 0xE3069283)) {
+		dbg_print("slicing tables failed self-test\n");
+		crc32_slice_inited = FALSE;
+		return;
+	}
+	crc32_engine = DRV_CRC32_ENGINE_SLICE;
+	crc32c_engine = DRV_CRC32_ENGINE_SLICE;
+
+#ifdef CRC32_PCLMUL
+	if (crc32_pclmul_probe()) {
+		crc32_pclmul_available = TRUE;
+		if (crc32_selftest(drv_crc32, CRC32_POLY, 0xCBF43926)) {
+			crc32_engine = DRV_CRC32_ENGINE_PCLMUL;
+		} else {
+			dbg_print("pclmulqdq failed self-test\n");
+			crc32_pclmul_available = FALSE;
+		}
+	}
+
+	if (crc32_be_inited && crc32_pclmul_probe()) {
+		crc32_be_pclmul_init();
+		crc32_be_pclmul_available = TRUE;
+		if (crc32_be_selftest()) {
+			crc32_be_engine = DRV_CRC32_ENGINE_PCLMUL;
+		} else {
+			dbg_print("pclmulqdq failed crc32_be self-test\n");
+			crc32_be_pclmul_available = FALSE;
+		}
+	}
+#endif
+
+#ifdef CRC32_X86
+	if (crc32c_hw_probe()) {
+		crc32c_shift_init(crc32c_shift_long_tab, CRC32C_HW_LONG);
+		crc32c_shift_init(crc32c_shift_short_tab, CRC32C_HW_SHORT);
+		crc32c_hw_available = TRUE;
+		if (crc32_selftest(drv_crc32c, CRC32C_POLY, 0xE3069283)) {
+			crc32c_engine = DRV_CRC32_ENGINE_SSE42;
+		} else {
+			dbg_print("sse4.2 failed self-test\n");
+			crc32c_hw_available = FALSE;
+		}
+	}
+#endif
+}
+
+/**
+ * @brief	Return the engine drv_crc32() dispatches to for block-sized
+ *			buffers
+ */
+enum drv_crc32_engine drv_crc32_engine(void)
+{
+	return crc32_engine;
+}
+
+/**
+ * @brief	Return the engine drv_crc32c() dispatches to
+ */
+enum drv_crc32_engine drv_crc32c_engine(void)
+{
+	return crc32c_engine;
+}
+
+/**
+ * @brief	Return the engine drv_crc32_be() dispatches to for
+ *			block-sized buffers
+ */
+enum drv_crc32_engine drv_crc32_be_engine(void)
+{
+	return crc32_be_engine;
+}
+
+/**
+ * @brief	Return a printable name of a CRC engine
+ */
+const char *drv_crc32_engine_name(enum drv_crc32_engine engine)
+{
+	switch (engine) {
+	case DRV_CRC32_ENGINE_BITWISE:
+		return "bitwise";
+	case DRV_CRC32_ENGINE_SLICE:
+		return "slice-by-8/16";
+	case DRV_CRC32_ENGINE_SSE42:
+		return "sse4.2";
+	case DRV_CRC32_ENGINE_PCLMUL:
+		return "pclmulqdq";
+	}
+	return "unknown";
 }
 
 __u32 drv_crc32(__u32 crc, const void *buf, size_t size)
 {
-	return crc32(crc, buf, size, crc32_tab);
+#ifdef CRC32_PCLMUL
+	if (crc32_pclmul_available && size >= CRC32_PCLMUL_THRESHOLD)
+		return crc32_pclmul(crc, buf, size);
+#endif
+	return crc32(crc, buf, size, crc32_slice_tab, CRC32_POLY);
 }
 
 __u32 drv_crc32c(__u32 crc, const void *buf, size_t size)
 {
-	return crc32(crc, buf, size, crc32c_tab);
+#ifdef CRC32_X86
+	if (crc32c_hw_available)
+		return crc32c_hw(crc, buf, size);
+#endif
+	return crc32(crc, buf, size, crc32c_slice_tab, CRC32C_POLY);
+}
+
+/**
+ * @brief	Calculate the MSB-first CRC32 of a buffer
+ * @remarks	No inversion is applied; callers seed it with ~0 like
+ *			crc32_be() users in Linux do.
+ */
+__u32 drv_crc32_be(__u32 crc, const void *buf, size_t size)
+{
+	const __u8 *p = (const __u8 *)buf;
+
+#ifdef CRC32_PCLMUL
+	if (crc32_be_pclmul_available && size >= CRC32_PCLMUL_THRESHOLD)
+		return crc32_be_pclmul(crc, p, size);
+#endif
+	if (!crc32_be_inited)
+		return crc32_be_bits(crc, p, size);
+
+	return crc32_be_slice8(crc, p, size);
+}
+
+/**
+ * @brief	Calculate the CRC32 of several buffers in one call
+ * @param reqs	Array of requests; cr_crc receives the CRC32 of
+ *				cr_buf seeded with cr_seed
+ * @param nr	Nr. of requests in @p reqs
+ */
+void drv_crc32_multi(struct drv_crc32_req *reqs, int nr)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		reqs[i].cr_crc = drv_crc32(reqs[i].cr_seed, reqs[i].cr_buf,
+					reqs[i].cr_len);
+}
+
+/**
+ * @brief	Calculate the CRC32C of several buffers in one call
+ *
+ * With SSE4.2 the buffers are checksummed interleaved, which keeps the
+ * crc32 unit busy without splitting and recombining each buffer.
+ *
+ * @see drv_crc32_multi()
+ */
+void drv_crc32c_multi(struct drv_crc32_req *reqs, int nr)
+{
+	int i;
+
+#ifdef CRC32_X86
+	if (crc32c_hw_available) {
+		crc32c_hw_multi(reqs, nr);
+		return;
+	}
+#endif
+	for (i = 0; i < nr; i++)
+		reqs[i].cr_crc = crc32(reqs[i].cr_seed, reqs[i].cr_buf,
+					reqs[i].cr_len, crc32c_slice_tab,
+					CRC32C_POLY);
+}
+
+/**
+ * @brief	Advance a CRC32 state across @p len zero bytes
+ *
+ * drv_crc32(seed, buf, len) equals
+ * drv_crc32_shift(seed, len) ^ drv_crc32(0, buf, len), so the
+ * contribution of a seed can be computed once and reused for every
+ * buffer of the same length.
+ *
+ * @param crc	CRC state
+ * @param len	Nr. of bytes to shift over
+ * @return The shifted CRC state
+ */
+__u32 drv_crc32_shift(__u32 crc, __u64 len)
+{
+	return crc32_shift(crc, len, crc32_x8n_tab, CRC32_POLY);
+}
+
+/**
+ * @brief	Advance a CRC32C state across @p len zero bytes
+ * @see drv_crc32_shift()
+ */
+__u32 drv_crc32c_shift(__u32 crc, __u64 len)
+{
+	return crc32_shift(crc, len, crc32c_x8n_tab, CRC32C_POLY);
+}
+
+/**
+ * @brief	Merge the CRC32 of two adjacent buffers
+ *
+ * @param crc_a	CRC32 of the first buffer, with any seed
+ * @param crc_b	CRC32 of the second buffer, calculated with a zero seed
+ * @param len_b	Length of the second buffer in bytes
+ * @return	CRC32 of the two buffers concatenated, as if calculated
+ *			with the seed of @p crc_a
+ */
+__u32 drv_crc32_combine(__u32 crc_a, __u32 crc_b, __u64 len_b)
+{
+	return drv_crc32_shift(crc_a, len_b) ^ crc_b;
+}
+
+/**
+ * @brief	Merge the CRC32C of two adjacent buffers
+ * @see drv_crc32_combine()
+ */
+__u32 drv_crc32c_combine(__u32 crc_a, __u32 crc_b, __u64 len_b)
+{
+	return drv_crc32c_shift(crc_a, len_b) ^ crc_b;
 }
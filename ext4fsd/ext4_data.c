@@ -13,4 +13,6 @@ FAST_IO_DISPATCH ext4_fast_io_dispatch;
 FS_FILTER_CALLBACKS ext4_fs_filter_callbacks;
 
 CACHE_MANAGER_CALLBACKS ext4_cache_manager_callbacks;
-CACHE_MANAGER_CALLBACKS ext4_cache_manager_noop_callbacks;
\ No newline at end of file
+CACHE_MANAGER_CALLBACKS ext4_cache_manager_noop_callbacks;
+
+NPAGED_LOOKASIDE_LIST ext4_ext_path_cache;
\ No newline at end of file
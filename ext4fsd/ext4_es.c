@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+#include "ext4.h"
+#include "ext4_data.h"
+
+/*
+ * NOTES:
+ *	1. The extent status tree of an inode caches the ranges the extent
+ *	    tree mapped, unwritten ranges and holes included.  The ranges
+ *	    never overlap.
+ *	2. The tree is only a cache.  Whenever it cannot keep a range, e.g.
+ *	    the memory for splitting a range runs out, the range is dropped.
+ *	3. A lookup which misses returns the sequence nr. of the tree; the
+ *	    range read from the extent tree afterwards is only inserted if
+ *	    no invalidation came in between, so that a mapping changed by a
+ *	    concurrent request cannot be cached stale.
+ *	4. Delayed ranges are the exception to 2: they record blocks written
+ *	    to the cache but not allocated yet, which no other place knows
+ *	    about.  They are only removed by ext4_es_remove(), i.e. when the
+ *	    blocks get allocated or truncated, and cached ranges never
+ *	    replace them.  If a delayed range would have to be split without
+ *	    memory for it, it is removed whole; the blocks it loses are then
+ *	    allocated when they are flushed, without a reservation.
+ */
+
+/**
+ * @brief	Compare the first logical blocks of two ranges
+ * @param es_a	Range a
+ * @param es_b	Range b
+ * @return	-1, 0 or 1 as es_a starts before, at or after es_b
+ */
+static int
+ext4_es_table_cmp(
+	struct ext4_es *es_a,
+	struct ext4_es *es_b
+)
+{
+	if (es_a->es_lblk < es_b->es_lblk)
+		return -1;
+	if (es_a->es_lblk > es_b->es_lblk)
+		return 1;
+	return 0;
+}
+
+RB_GENERATE(ext4_es_table, ext4_es, es_node, ext4_es_table_cmp);
+
+/**
+ * @brief	Return the logical block following a range
+ * @param es	The range
+ * @return	The end of the range, which may be past EXT_MAX_BLOCKS
+ */
+static __u64 ext4_es_end(struct ext4_es *es)
+{
+	return (__u64)es->es_lblk + es->es_len;
+}
+
+/**
+ * @brief	Return the range which starts at or before @p lblk
+ * @remarks	The lock of the tree must be held.
+ * @param tree	Extent status tree
+ * @param lblk	Logical block
+ * @return	The range, or NULL if all of them start after @p lblk
+ */
+static struct ext4_es *
+ext4_es_find_prev(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk)
+{
+	struct ext4_es key, *es;
+
+	key.es_lblk = lblk;
+	es = RB_NFIND(ext4_es_table, &tree->et_table, &key);
+	if (es && es->es_lblk == lblk)
+		return es;
+
+	return es ? RB_PREV(ext4_es_table, &tree->et_table, es) :
+			RB_MAX(ext4_es_table, &tree->et_table);
+}
+
+/**
+ * @brief	Unlink a range from the tree and free it
+ * @remarks	The lock of the tree must be held.
+ * @param tree	Extent status tree
+ * @param es	The range
+ */
+static void
+ext4_es_free(
+	struct ext4_es_tree *tree,
+	struct ext4_es *es)
+{
+	RB_REMOVE(ext4_es_table, &tree->et_table, es);
+	if (tree->et_cache == es)
+		tree->et_cache = NULL;
+	if (es->es_status & EXT4_ES_DELAYED)
+		tree->et_nr_delayed -= es->es_len;
+	tree->et_nr_ranges--;
+	ExFreePoolWithTag(es, EXT4_ES_POOL_TAG);
+}
+
+/**
+ * @brief	Free the ranges of the tree
+ * @remarks	The lock of the tree must be held.
+ * @param tree			Extent status tree
+ * @param keep_delayed	Whether delayed ranges are kept
+ */
+static void
+ext4_es_clear(
+	struct ext4_es_tree *tree,
+	__bool keep_delayed)
+{
+	struct ext4_es *es, *next;
+
+	RB_FOREACH_SAFE(es, ext4_es_table, &tree->et_table, next) {
+		if (!keep_delayed || !(es->es_status & EXT4_ES_DELAYED))
+			ext4_es_free(tree, es);
+	}
+}
+
+/**
+ * @brief	Move the start of a range to @p lblk
+ * @param es	The range
+ * @param lblk	New start of the range, within the range
+ */
+static void
+ext4_es_trim_front(
+	struct ext4_es *es,
+	ext4_lblk_t lblk)
+{
+	ext4_lblk_t delta = lblk - es->es_lblk;
+
+	es->es_lblk = lblk;
+	es->es_len -= delta;
+	if (es->es_status & (EXT4_ES_WRITTEN | EXT4_ES_UNWRITTEN))
+		es->es_pblk += delta;
+}
+
+/**
+ * @brief	Shorten a range to @p len blocks
+ * @param tree	Extent status tree
+ * @param es	The range
+ * @param len	New length of the range
+ */
+static void
+ext4_es_trim_back(
+	struct ext4_es_tree *tree,
+	struct ext4_es *es,
+	ext4_lblk_t len)
+{
+	if (es->es_status & EXT4_ES_DELAYED)
+		tree->et_nr_delayed -= es->es_len - len;
+	es->es_len = len;
+}
+
+/**
+ * @brief	Remove the part of the ranges covering [@p lblk, @p end)
+ * @remarks	The lock of the tree must be held.
+ * @param tree	Extent status tree
+ * @param lblk	First logical block
+ * @param end	Logical block following the last one
+ * @return	Nr. of delayed blocks removed
+ */
+static ext4_lblk_t
+ext4_es_remove_locked(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	__u64 end)
+{
+	struct ext4_es *es, *right, *next;
+	__u32 nr_delayed = tree->et_nr_delayed;
+
+	es = ext4_es_find_prev(tree, lblk);
+	if (es && es->es_lblk < lblk && ext4_es_end(es) > lblk) {
+		if (ext4_es_end(es) > end) {
+			/* The range spans over both sides */
+			right = ExAllocatePoolWithTag(NonPagedPool,
+						sizeof(struct ext4_es),
+						EXT4_ES_POOL_TAG);
+			if (!right) {
+				ext4_es_free(tree, es);
+				return nr_delayed - tree->et_nr_delayed;
+			}
+			*right = *es;
+			ext4_es_trim_front(right, (ext4_lblk_t)end);
+			ext4_es_trim_back(tree, es, lblk - es->es_lblk);
+			RB_INSERT(ext4_es_table, &tree->et_table, right);
+			tree->et_nr_ranges++;
+			if (right->es_status & EXT4_ES_DELAYED)
+				tree->et_nr_delayed += right->es_len;
+			return nr_delayed - tree->et_nr_delayed;
+		}
+		ext4_es_trim_back(tree, es, lblk - es->es_lblk);
+		es = RB_NEXT(ext4_es_table, &tree->et_table, es);
+	} else if (!es || es->es_lblk < lblk) {
+		es = es ? RB_NEXT(ext4_es_table, &tree->et_table, es) :
+				RB_MIN(ext4_es_table, &tree->et_table);
+	}
+
+	while (es && es->es_lblk < end) {
+		next = RB_NEXT(ext4_es_table, &tree->et_table, es);
+		if (ext4_es_end(es) > end) {
+			/* Keys keep their order as the ranges do not overlap */
+			if (es->es_status & EXT4_ES_DELAYED)
+				tree->et_nr_delayed -= (ext4_lblk_t)end - es->es_lblk;
+			ext4_es_trim_front(es, (ext4_lblk_t)end);
+			break;
+		}
+		ext4_es_free(tree, es);
+		es = next;
+	}
+	return nr_delayed - tree->et_nr_delayed;
+}
+
+/**
+ * @brief	Initialize an extent status tree
+ * @param tree	Extent status tree
+ */
+void ext4_es_init(struct ext4_es_tree *tree)
+{
+	RtlZeroMemory(tree, sizeof(struct ext4_es_tree));
+	drv_mutex_init(&tree->et_lock);
+	RB_INIT(&tree->et_table);
+}
+
+/**
+ * @brief	Free all the ranges of an extent status tree
+ * @remarks	The delayed ranges must have been allocated already.
+ * @param tree	Extent status tree
+ */
+void ext4_es_release(struct ext4_es_tree *tree)
+{
+	drv_mutex_acquire(&tree->et_lock, TRUE);
+	NT_ASSERT(!tree->et_nr_delayed);
+	ext4_es_clear(tree, FALSE);
+	tree->et_seq++;
+	drv_mutex_release(&tree->et_lock);
+	drv_mutex_destroy(&tree->et_lock);
+}
+
+/**
+ * @brief	Look up the range covering a logical block
+ * @param tree	Extent status tree
+ * @param lblk	Logical block
+ * @param es	Copy of the range returned, its es_node is undefined
+ * @param seq	Sequence nr. of the tree returned, to be passed to
+ *				ext4_es_insert() after a miss
+ * @return	TRUE if the tree has a range covering @p lblk
+ */
+__bool ext4_es_lookup(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	struct ext4_es *es,
+	__u32 *seq)
+{
+	struct ext4_es *found = NULL;
+
+	drv_mutex_acquire(&tree->et_lock, TRUE);
+	*seq = tree->et_seq;
+
+	/* Sequential lookups mostly land in the same range */
+	if (tree->et_cache && tree->et_cache->es_lblk <= lblk &&
+	    ext4_es_end(tree->et_cache) > lblk) {
+		found = tree->et_cache;
+	} else {
+		found = ext4_es_find_prev(tree, lblk);
+		if (found && ext4_es_end(found) <= lblk)
+			found = NULL;
+	}
+
+	if (found) {
+		*es = *found;
+		tree->et_cache = found;
+		tree->et_nr_hits++;
+	} else {
+		tree->et_nr_misses++;
+	}
+	drv_mutex_release(&tree->et_lock);
+	return found != NULL;
+}
+
+/**
+ * @brief	Cache the mapping of a range of logical blocks
+ * @remarks	The range replaces the part of the ranges it overlaps, and
+ *			is cut short before the first delayed range it meets.
+ *			Nothing is cached if the tree was invalidated since @p seq
+ *			was returned, or the memory runs out.
+ * @param tree		Extent status tree
+ * @param lblk		First logical block
+ * @param len		Nr. of blocks
+ * @param pblk		Physical block of @p lblk, 0 for a hole
+ * @param status	EXT4_ES_*
+ * @param seq		Sequence nr. returned by ext4_es_lookup()
+ */
+void ext4_es_insert(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len,
+	ext4_fsblk_t pblk,
+	__u32 status,
+	__u32 seq)
+{
+	struct ext4_es key, *es;
+
+	drv_mutex_acquire(&tree->et_lock, TRUE);
+	if (seq != tree->et_seq)
+		goto out;
+
+	key.es_lblk = lblk;
+	for (es = RB_NFIND(ext4_es_table, &tree->et_table, &key);
+	     es && es->es_lblk < (__u64)lblk + len;
+	     es = RB_NEXT(ext4_es_table, &tree->et_table, es)) {
+		if (es->es_status & EXT4_ES_DELAYED) {
+			len = es->es_lblk - lblk;
+			break;
+		}
+	}
+	if (!len)
+		goto out;
+
+	ext4_es_remove_locked(tree, lblk, (__u64)lblk + len);
+	if (tree->et_nr_ranges >= EXT4_ES_MAX_RANGES)
+		ext4_es_clear(tree, TRUE);
+
+	es = ExAllocatePoolWithTag(NonPagedPool,
+				sizeof(struct ext4_es),
+				EXT4_ES_POOL_TAG);
+	if (!es)
+		goto out;
+
+	es->es_lblk = lblk;
+	es->es_len = len;
+	es->es_pblk = (status & EXT4_ES_HOLE) ? 0 : pblk;
+	es->es_status = status;
+	RB_INSERT(ext4_es_table, &tree->et_table, es);
+	tree->et_nr_ranges++;
+	tree->et_cache = es;
+out:
+	drv_mutex_release(&tree->et_lock);
+}
+
+/**
+ * @brief	Record a range of blocks written to the cache before they
+ *			are allocated
+ * @remarks	The range must be a hole of the extent tree.  It is merged
+ *			with the delayed ranges adjacent to it.  Blocks of the range
+ *			a racing writer recorded first stay delayed once.
+ * @param tree	Extent status tree
+ * @param lblk	First logical block
+ * @param len	Nr. of blocks
+ * @param nr_delayed	Nr. of blocks of the range which were delayed
+ *						already, whose reservation the caller releases
+ * @return	STATUS_SUCCESS if the range is recorded,
+ *			STATUS_INSUFFICIENT_RESOURCES otherwise.
+ */
+NTSTATUS ext4_es_insert_delayed(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len,
+	ext4_lblk_t *nr_delayed)
+{
+	struct ext4_es *es, *left, *right, *new_es;
+
+	/* Allocated first, so that nothing fails once the tree changes */
+	new_es = ExAllocatePoolWithTag(NonPagedPool,
+				sizeof(struct ext4_es),
+				EXT4_ES_POOL_TAG);
+	if (!new_es)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	drv_mutex_acquire(&tree->et_lock, TRUE);
+	es = ext4_es_find_prev(tree, lblk);
+	if (es && (es->es_status & EXT4_ES_DELAYED) &&
+	    ext4_es_end(es) >= (__u64)lblk + len) {
+		*nr_delayed = len;
+		goto out;
+	}
+	*nr_delayed = ext4_es_remove_locked(tree, lblk, (__u64)lblk + len);
+
+	/* Lookups which missed must not cache the hole any more */
+	tree->et_seq++;
+
+	left = ext4_es_find_prev(tree, lblk);
+	if (left && (!(left->es_status & EXT4_ES_DELAYED) ||
+		     ext4_es_end(left) != lblk))
+		left = NULL;
+
+	right = left ? RB_NEXT(ext4_es_table, &tree->et_table, left) :
+			ext4_es_find_prev(tree, lblk + len);
+	if (right && (!(right->es_status & EXT4_ES_DELAYED) ||
+		      right->es_lblk != (__u64)lblk + len))
+		right = NULL;
+
+	if (left) {
+		left->es_len += len;
+		if (right) {
+			/* Freeing right takes its blocks off et_nr_delayed */
+			left->es_len += right->es_len;
+			tree->et_nr_delayed += right->es_len;
+			ext4_es_free(tree, right);
+		}
+		es = left;
+	} else if (right) {
+		right->es_lblk = lblk;
+		right->es_len += len;
+		es = right;
+	} else {
+		es = new_es;
+		new_es = NULL;
+		es->es_lblk = lblk;
+		es->es_len = len;
+		es->es_pblk = 0;
+		es->es_status = EXT4_ES_DELAYED;
+		RB_INSERT(ext4_es_table, &tree->et_table, es);
+		tree->et_nr_ranges++;
+	}
+	tree->et_nr_delayed += len;
+	tree->et_cache = es;
+out:
+	drv_mutex_release(&tree->et_lock);
+	if (new_es)
+		ExFreePoolWithTag(new_es, EXT4_ES_POOL_TAG);
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Invalidate the mapping of a range of logical blocks
+ * @remarks	Must be called whenever the extent tree changes the mapping
+ *			of the range.
+ * @param tree	Extent status tree
+ * @param lblk	First logical block
+ * @param len	Nr. of blocks
+ * @return	Nr. of delayed blocks the range held, whose reservation
+ *			the caller has to release
+ */
+ext4_lblk_t ext4_es_remove(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len)
+{
+	ext4_lblk_t nr_delayed;
+
+	drv_mutex_acquire(&tree->et_lock, TRUE);
+	nr_delayed = ext4_es_remove_locked(tree, lblk, (__u64)lblk + len);
+	tree->et_seq++;
+	drv_mutex_release(&tree->et_lock);
+	return nr_delayed;
+}
@@ -21,6 +21,13 @@ struct ext4_extent_path {
 
 };
 
+/*
+ * Deepest extent tree we accept.  A path holds one more entry than the
+ * levels, for the tree to grow while the path is in use.
+ */
+#define EXT4_EXT_MAX_DEPTH		5
+#define EXT4_EXT_PATH_ENTRIES	(EXT4_EXT_MAX_DEPTH + 2)
+
 /*
  * used by extent splitting.
  */
@@ -30,6 +37,92 @@ struct ext4_extent_path {
 #define EXT4_EXT_DATA_VALID2			0x10		/* second half contains valid data */
 #define EXT4_EXT_NO_COMBINE			0x20		/* do not combine two extents */
 
+/*
+ * used by block allocation.
+ */
+#define EXT4_EXT_DELALLOC			0x40		/* allocating a delayed range */
+
+/*
+ * Free blocks only the allocation of delayed ranges may use, for the
+ * tree blocks they need on top of the blocks reserved: 2% of the
+ * volume, at most EXT4_EXT_RESV_MAX blocks, as Linux keeps.
+ */
+#define EXT4_EXT_RESV_MAX			4096
+
+/*
+ * Extent status tree of the inode
+ */
+static inline struct ext4_es_tree *ext4_ext_es_tree(struct ext4_inode_ref *inode_ref)
+{
+	return &inode_ref->icb->i_es;
+}
+
+static ext4_fsblk_t ext4_ext_resv_blocks(struct ext4_inode_ref *inode_ref)
+{
+	ext4_fsblk_t resv = ext4_sb_get_blocks_cnt(&inode_ref->fs->sb) / 50;
+
+	return resv > EXT4_EXT_RESV_MAX ? EXT4_EXT_RESV_MAX : resv;
+}
+
+/*
+ * Reserve free blocks for blocks written before they are allocated
+ */
+static int ext4_ext_reserve_blocks(struct ext4_inode_ref *inode_ref,
+				   __u32 count)
+{
+	drv_atomic_t *dirty = &inode_ref->icb->i_vcb->v_dirty_blocks;
+	ext4_fsblk_t free_blocks = ext4_sb_get_free_blocks_cnt(&inode_ref->fs->sb);
+	ext4_fsblk_t resv = ext4_ext_resv_blocks(inode_ref);
+	int old;
+
+	do {
+		old = drv_atomic_read(dirty);
+		if ((ext4_fsblk_t)(__u32)old + count + resv > free_blocks)
+			return ENOSPC;
+	} while (drv_atomic_cmpxchg(dirty, old, old + count) != old);
+
+	return EOK;
+}
+
+/*
+ * Nr. of free blocks an allocation may take.  Other allocations must
+ * leave the blocks reserved for delayed ranges, as Linux's
+ * ext4_has_free_clusters() does, or flushing those could fail.
+ */
+static ext4_fsblk_t ext4_ext_avail_blocks(struct ext4_inode_ref *inode_ref,
+					  __u32 flags)
+{
+	ext4_fsblk_t free_blocks = ext4_sb_get_free_blocks_cnt(&inode_ref->fs->sb);
+	ext4_fsblk_t kept;
+
+	/* the reservation of a delayed range covers its own blocks */
+	if (flags & EXT4_EXT_DELALLOC)
+		return free_blocks;
+
+	kept = (__u32)drv_atomic_read(&inode_ref->icb->i_vcb->v_dirty_blocks) +
+	       ext4_ext_resv_blocks(inode_ref);
+	return free_blocks > kept ? free_blocks - kept : 0;
+}
+
+static void ext4_ext_release_blocks(struct ext4_inode_ref *inode_ref,
+				    __u32 count)
+{
+	if (count)
+		drv_atomic_sub(&inode_ref->icb->i_vcb->v_dirty_blocks, count);
+}
+
+/*
+ * Invalidate the cached mapping of a range whose mapping changed.
+ * Delayed blocks in the range are allocated or gone now, so their
+ * reservation is released.
+ */
+static void ext4_ext_es_invalidate(struct ext4_inode_ref *inode_ref,
+				   ext4_lblk_t lblk, ext4_lblk_t len)
+{
+	ext4_ext_release_blocks(inode_ref,
+		ext4_es_remove(ext4_ext_es_tree(inode_ref), lblk, len));
+}
+
 static int ext4_allocate_single_block(
 			struct ext4_inode_ref *inode_ref,
 			ext4_fsblk_t goal,
@@ -38,12 +131,66 @@ static int ext4_allocate_single_block(
 	return ext4_balloc_alloc_block(inode_ref, goal, blockp);
 }
 
+/*
+ * Allocate a run of contiguous blocks near goal.
+ * On entry *count holds the most blocks wanted, on return the blocks
+ * allocated, which start at *blockp.  The run does not cross the end of
+ * the block group of its first block, nor the end of the volume.
+ */
+static int ext4_allocate_blocks(struct ext4_inode_ref *inode_ref,
+				ext4_fsblk_t goal,
+				__u32 *count,
+				ext4_fsblk_t *blockp)
+{
+	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	ext4_fsblk_t block, end;
+	__u32 nr = 1;
+	__bool is_free;
+	int err;
+
+	err = ext4_allocate_single_block(inode_ref, goal, &block);
+	if (err != EOK)
+		return err;
+
+	end = ext4_balloc_get_block_of_bgid(sb,
+			ext4_balloc_get_bgid_of_block(sb, block) + 1);
+	if (end > ext4_sb_get_blocks_cnt(sb))
+		end = ext4_sb_get_blocks_cnt(sb);
+	if (*count > end - block)
+		*count = (__u32)(end - block);
+
+	/* extend the run as long as the following blocks are free */
+	while (nr < *count) {
+		if (ext4_balloc_try_alloc_block(inode_ref, block + nr,
+						&is_free) != EOK || !is_free)
+			break;
+		nr++;
+	}
+
+	*count = nr;
+	*blockp = block;
+	return EOK;
+}
+
 static ext4_fsblk_t ext4_new_meta_blocks(struct ext4_inode_ref *inode_ref,
 					 ext4_fsblk_t goal,
 					 __u32 flags,
 					 __u32 *count, int *errp)
 {
 	ext4_fsblk_t block = 0;
+	ext4_fsblk_t avail = ext4_ext_avail_blocks(inode_ref, flags);
+
+	if (!avail) {
+		*errp = ENOSPC;
+		return 0;
+	}
+	if (count && *count > avail)
+		*count = (__u32)avail;
+
+	if (count && *count > 1) {
+		*errp = ext4_allocate_blocks(inode_ref, goal, count, &block);
+		return block;
+	}
 
 	*errp = ext4_allocate_single_block(inode_ref, goal, &block);
 	if (count)
@@ -268,16 +415,118 @@ static void ext4_ext_drop_refs(struct ext4_inode_ref *inode_ref,
 	}
 }
 
+/*
+ * Paths come from ext4_ext_path_cache, all of them sized for the
+ * deepest tree, so that a path never has to be reallocated.
+ */
+void ext4_extent_init_path_cache(void)
+{
+	ExInitializeNPagedLookasideList(&ext4_ext_path_cache,
+					NULL,
+					NULL,
+					0,
+					sizeof(struct ext4_extent_path) *
+						EXT4_EXT_PATH_ENTRIES,
+					EXT4_EXT_PATH_POOL_TAG,
+					0);
+}
+
+void ext4_extent_destroy_path_cache(void)
+{
+	ExDeleteNPagedLookasideList(&ext4_ext_path_cache);
+}
+
+static struct ext4_extent_path *ext4_ext_path_alloc(void)
+{
+	struct ext4_extent_path *path;
+
+	path = ExAllocateFromNPagedLookasideList(&ext4_ext_path_cache);
+	if (!path)
+		return NULL;
+
+	RtlZeroMemory(path,
+		      sizeof(struct ext4_extent_path) * EXT4_EXT_PATH_ENTRIES);
+	path[0].maxdepth = EXT4_EXT_PATH_ENTRIES - 1;
+	return path;
+}
+
+/*
+ * Release the blocks a path holds at any level and free it
+ */
+static void ext4_ext_path_free(struct ext4_inode_ref *inode_ref,
+			       struct ext4_extent_path *path)
+{
+	int32_t i;
+
+	if (!path)
+		return;
+
+	for (i = 0; i < EXT4_EXT_PATH_ENTRIES; i++)
+		ext4_ext_drop_refs(inode_ref, path + i, TRUE);
+
+	ExFreeToNPagedLookasideList(&ext4_ext_path_cache, path);
+}
+
+/*
+ * Take the path the inode kept from its last lookup, or a new one.
+ * A path kept holds the tree blocks it went through, which the next
+ * lookup reuses as long as the tree still leads through them.
+ */
+static struct ext4_extent_path *ext4_ext_path_get(struct ext4_inode_ref *inode_ref)
+{
+	struct ext4_extent_path *path;
+
+	path = InterlockedExchangePointer((PVOID *)&inode_ref->icb->i_ext_path,
+					  NULL);
+	if (path)
+		return path;
+
+	return ext4_ext_path_alloc();
+}
+
+/*
+ * Give a path back to the inode for the next lookup.  Only dropping a
+ * block sets its checksum and hands it back to the block cache to be
+ * written, so the blocks changed through the path are dropped first.
+ */
+static void ext4_ext_path_put(struct ext4_inode_ref *inode_ref,
+			      struct ext4_extent_path *path)
+{
+	int32_t i;
+
+	if (!path)
+		return;
+
+	for (i = 0; i < EXT4_EXT_PATH_ENTRIES; i++) {
+		if (path[i].block.lb_id &&
+		    ext4_bcache_test_flag(path[i].block.buf, BC_DIRTY))
+			ext4_ext_drop_refs(inode_ref, path + i, TRUE);
+	}
+
+	/* keep the newest path, another request may have put one meanwhile */
+	path = InterlockedExchangePointer((PVOID *)&inode_ref->icb->i_ext_path,
+					  path);
+	ext4_ext_path_free(inode_ref, path);
+}
+
+/*
+ * Release the path an inode kept.  The destructor of the ICB has to
+ * call this, or the path and the tree blocks it holds are leaked.
+ */
+void ext4_extent_release_path(struct ext4_inode_ref *inode_ref)
+{
+	ext4_ext_path_free(inode_ref,
+		InterlockedExchangePointer((PVOID *)&inode_ref->icb->i_ext_path,
+					   NULL));
+}
+
 /*
  * Check that whether the basic information inside the extent header
- * is correct or not.
+ * is correct or not.  The checksum is left to ext4_ext_check().
  */
-static int ext4_ext_check(struct ext4_inode_ref *inode_ref,
-			  struct ext4_extent_header *eh, __u16 depth,
-			  ext4_fsblk_t pblk)
+static int ext4_ext_check_header(struct ext4_extent_header *eh, __u16 depth,
+				 ext4_fsblk_t pblk)
 {
-	struct ext4_extent_tail *tail;
-	struct ext4_sblock *sb = &inode_ref->fs->sb;
 	const char *error_msg;
 	(void)error_msg;
 
@@ -298,6 +547,27 @@ static int ext4_ext_check(struct ext4_inode_ref *inode_ref,
 		goto corrupted;
 	}
 
+	return EOK;
+
+corrupted:
+	ext4_dbg(DEBUG_EXTENT, "Bad extents B+ tree block: %s. "
+			       "Blocknr: %" PRId64 "\n",
+		 error_msg, pblk);
+	return EIO;
+}
+
+static int ext4_ext_check(struct ext4_inode_ref *inode_ref,
+			  struct ext4_extent_header *eh, __u16 depth,
+			  ext4_fsblk_t pblk)
+{
+	struct ext4_extent_tail *tail;
+	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	int err;
+
+	err = ext4_ext_check_header(eh, depth, pblk);
+	if (err != EOK)
+		return err;
+
 	tail = find_ext4_extent_tail(eh);
 	if (ext4_sb_feature_ro_com(sb, EXT4_FRO_COM_METADATA_CSUM)) {
 		if (tail->et_checksum !=
@@ -310,12 +580,6 @@ static int ext4_ext_check(struct ext4_inode_ref *inode_ref,
 	}
 
 	return EOK;
-
-corrupted:
-	ext4_dbg(DEBUG_EXTENT, "Bad extents B+ tree block: %s. "
-			       "Blocknr: %" PRId64 "\n",
-		 error_msg, pblk);
-	return EIO;
 }
 
 static int read_extent_tree_block(struct ext4_inode_ref *inode_ref,
@@ -410,25 +674,20 @@ static int ext4_find_extent(struct ext4_inode_ref *inode_ref, ext4_lblk_t block,
 
 	eh = ext_inode_hdr(inode_ref->inode);
 	depth = ext_depth(inode_ref->inode);
+	if (depth >= EXT4_EXT_PATH_ENTRIES - 1)
+		return EIO;
 
-	if (path) {
-		ext4_ext_drop_refs(inode_ref, path, 0);
-		if (depth > path[0].maxdepth) {
-			free(path);
-			*orig_path = path = NULL;
-		}
-	}
+	/*
+	 * the blocks a path already holds are kept: the walk below
+	 * reuses those the tree still leads through
+	 */
 	if (!path) {
-		int32_t path_depth = depth + 1;
-		/* account possible depth increase */
-		path = calloc(1, sizeof(struct ext4_extent_path) *
-				     (path_depth + 1));
+		path = ext4_ext_path_get(inode_ref);
 		if (!path)
 			return ENOMEM;
-		path[0].maxdepth = path_depth;
 	}
+	ext4_ext_drop_refs(inode_ref, path, 1);
 	path[0].header = eh;
-	path[0].block = bh;
 
 	i = depth;
 	/* walk through the tree */
@@ -441,8 +700,19 @@ static int ext4_find_extent(struct ext4_inode_ref *inode_ref, ext4_lblk_t block,
 
 		i--;
 		ppos++;
-		if (!path[ppos].block.lb_id ||
-		    path[ppos].block.lb_id != buf_block) {
+
+		/*
+		 * a parked block the index still points at may have been
+		 * freed and reused since, or changed depth: check it again
+		 */
+		if (path[ppos].block.lb_id &&
+		    path[ppos].block.lb_id == buf_block &&
+		    ext4_ext_check_header(ext_block_hdr(&path[ppos].block),
+					  i, buf_block) == EOK) {
+			eh = ext_block_hdr(&path[ppos].block);
+			path[ppos].header = eh;
+		} else {
+			ext4_ext_drop_refs(inode_ref, path + ppos, 1);
 			ret = read_extent_tree_block(inode_ref, buf_block, i,
 						     &bh, flags);
 			if (ret != EOK) {
@@ -464,6 +734,10 @@ static int ext4_find_extent(struct ext4_inode_ref *inode_ref, ext4_lblk_t block,
 	path[ppos].extent = NULL;
 	path[ppos].index = NULL;
 
+	/* the tree may have been shallower than the path */
+	for (i = ppos + 1; i < EXT4_EXT_PATH_ENTRIES; i++)
+		ext4_ext_drop_refs(inode_ref, path + i, 1);
+
 	/* find extent */
 	ext4_ext_binsearch(path + ppos, block);
 	/* if not an empty leaf */
@@ -476,8 +750,7 @@ static int ext4_find_extent(struct ext4_inode_ref *inode_ref, ext4_lblk_t block,
 	return ret;
 
 err:
-	ext4_ext_drop_refs(inode_ref, path, 0);
-	free(path);
+	ext4_ext_path_free(inode_ref, path);
 	if (orig_path)
 		*orig_path = NULL;
 	return ret;
@@ -552,7 +825,7 @@ static int ext4_ext_split_node(struct ext4_inode_ref *inode_ref,
 			       struct ext4_extent_path *path, int at,
 			       struct ext4_extent *newext,
 			       struct ext4_extent_path *npath,
-			       __bool *ins_right_leaf)
+			       __bool *ins_right_leaf, __u32 flags)
 {
 	int i, npath_at, ret;
 	ext4_lblk_t insert_index;
@@ -573,7 +846,7 @@ static int ext4_ext_split_node(struct ext4_inode_ref *inode_ref,
 		/* FIXME: currently we split at the point after the current
 		 * extent. */
 		newblock =
-		    ext4_ext_new_meta_block(inode_ref, path, newext, &ret, 0);
+		    ext4_ext_new_meta_block(inode_ref, path, newext, &ret, flags);
 		if (ret != EOK)
 			goto cleanup;
 
@@ -994,7 +1267,7 @@ again:
 
 		/* Do we need to grow the tree? */
 		if (i < 0) {
-			ret = ext4_ext_grow_indepth(inode_ref, 0);
+			ret = ext4_ext_grow_indepth(inode_ref, flags);
 			if (ret != EOK)
 				goto out;
 
@@ -1015,14 +1288,13 @@ again:
 		i = depth - (level - 1);
 		/* We split from leaf to the i-th node */
 		if (level > 0) {
-			npath = calloc(1, sizeof(struct ext4_extent_path) *
-					      (level));
+			npath = ext4_ext_path_alloc();
 			if (!npath) {
 				ret = ENOMEM;
 				goto out;
 			}
 			ret = ext4_ext_split_node(inode_ref, path, i, newext,
-						  npath, &ins_right_leaf);
+						  npath, &ins_right_leaf, flags);
 			if (ret != EOK)
 				goto out;
 
@@ -1053,8 +1325,11 @@ out:
 		}
 	}
 	if (npath)
-		free(npath);
+		ExFreeToNPagedLookasideList(&ext4_ext_path_cache, npath);
 
+	/* Also after a failure, the tree may have been changed halfway */
+	ext4_ext_es_invalidate(inode_ref, to_le32(newext->first_block),
+			       ext4_ext_get_actual_len(newext));
 	return ret;
 }
 
@@ -1382,9 +1657,11 @@ int ext4_extent_remove_space(struct ext4_inode_ref *inode_ref, ext4_lblk_t from,
 	}
 
 out:
-	ext4_ext_drop_refs(inode_ref, path, 0);
-	free(path);
+	ext4_ext_path_free(inode_ref, path);
 	path = NULL;
+	/* EXT_MAX_BLOCKS itself is never mapped */
+	ext4_ext_es_invalidate(inode_ref, from,
+			       to - from + (to != EXT_MAX_BLOCKS));
 	return ret;
 }
 
@@ -1561,11 +1838,16 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 {
 	struct ext4_extent_path *path = NULL;
 	struct ext4_extent newex, *ex;
+	struct ext4_es_tree *es_tree = ext4_ext_es_tree(inode_ref);
+	struct ext4_es es;
+	__u32 es_seq;
 	ext4_fsblk_t goal;
 	int err = EOK;
 	int32_t depth;
 	__u32 allocated = 0;
+	__u32 flags = 0;
 	ext4_lblk_t next;
+	ext4_lblk_t delayed_end = 0;
 	ext4_fsblk_t newblock;
 
 	if (result)
@@ -1574,6 +1856,28 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	if (blocks_count)
 		*blocks_count = 0;
 
+	/* the extent status tree answers without reading the tree blocks */
+	if (ext4_es_lookup(es_tree, iblock, &es, &es_seq)) {
+		allocated = es.es_len - (iblock - es.es_lblk);
+		if (es.es_status & EXT4_ES_WRITTEN) {
+			newblock = iblock - es.es_lblk + es.es_pblk;
+			goto out;
+		}
+		if (!create) {
+			/* delayed blocks are only in the cache so far */
+			if (es.es_status & (EXT4_ES_HOLE | EXT4_ES_DELAYED))
+				return EOK;
+
+			newblock = 0;
+			goto out;
+		}
+		if (es.es_status & EXT4_ES_DELAYED) {
+			flags = EXT4_EXT_DELALLOC;
+			delayed_end = es.es_lblk + es.es_len;
+		}
+		allocated = 0;
+	}
+
 	/* find extent for this block */
 	err = ext4_find_extent(inode_ref, iblock, &path, 0);
 	if (err != EOK) {
@@ -1598,6 +1902,11 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 			/* number of remain blocks in the extent */
 			allocated = ee_len - (iblock - ee_block);
 
+			ext4_es_insert(es_tree, ee_block, ee_len, ee_start,
+				       ext4_ext_is_unwritten(ex) ?
+					   EXT4_ES_UNWRITTEN : EXT4_ES_WRITTEN,
+				       es_seq);
+
 			if (!ext4_ext_is_unwritten(ex)) {
 				newblock = iblock - ee_block + ee_start;
 				goto out;
@@ -1621,6 +1930,7 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 
 			err = ext4_ext_convert_to_initialized(
 			    inode_ref, &path, iblock, zero_range);
+			ext4_ext_es_invalidate(inode_ref, iblock, zero_range);
 			if (err != EOK)
 				goto out2;
 
@@ -1628,24 +1938,36 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 		}
 	}
 
+	/* find next allocated block so that we know how many
+	 * blocks we can allocate without ovelapping next extent */
+	next = ext4_ext_next_allocated_block(path);
+	/* the leaf search returns the first extent for blocks before it */
+	if (ex && iblock < to_le32(ex->first_block))
+		next = to_le32(ex->first_block);
+
 	/*
 	 * requested block isn't allocated yet
 	 * we couldn't try to create block if create flag is zero
 	 */
 	if (!create) {
+		ext4_es_insert(es_tree, iblock, next - iblock, 0,
+			       EXT4_ES_HOLE, es_seq);
 		goto out2;
 	}
 
-	/* find next allocated block so that we know how many
-	 * blocks we can allocate without ovelapping next extent */
-	next = ext4_ext_next_allocated_block(path);
 	allocated = next - iblock;
 	if (allocated > max_blocks)
 		allocated = max_blocks;
-
-	/* allocate new block */
+	/* the whole run has to fit in one initialized extent */
+	if (allocated > EXT_INIT_MAX_LEN)
+		allocated = EXT_INIT_MAX_LEN;
+	/* only the delayed blocks are covered by their reservation */
+	if ((flags & EXT4_EXT_DELALLOC) && allocated > delayed_end - iblock)
+		allocated = delayed_end - iblock;
+
+	/* allocate as many contiguous blocks as possible */
 	goal = ext4_ext_find_goal(inode_ref, path, iblock);
-	newblock = ext4_new_meta_blocks(inode_ref, goal, 0, &allocated, &err);
+	newblock = ext4_new_meta_blocks(inode_ref, goal, flags, &allocated, &err);
 	if (!newblock)
 		goto out2;
 
@@ -1653,7 +1975,7 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	newex.first_block = to_le32(iblock);
 	ext4_ext_store_pblock(&newex, newblock);
 	newex.block_count = to_le16(allocated);
-	err = ext4_ext_insert_extent(inode_ref, &path, &newex, 0);
+	err = ext4_ext_insert_extent(inode_ref, &path, &newex, flags);
 	if (err != EOK) {
 		/* free data blocks we just allocated */
 		ext4_ext_free_blocks(inode_ref, ext4_ext_pblock(&newex),
@@ -1675,10 +1997,241 @@ out:
 		*blocks_count = allocated;
 
 out2:
-	if (path) {
-		ext4_ext_drop_refs(inode_ref, path, 0);
-		free(path);
-	}
+	/* the inode keeps the path and its blocks for the next lookup */
+	ext4_ext_path_put(inode_ref, path);
 
 	return err;
 }
+
+/*
+ * Move the path to the leaf following the one it points to, by
+ * stepping the lowest index level which has an entry left and reading
+ * the blocks below it.  *found is FALSE if the path was at the last
+ * leaf already, or the next leaf starts at or after end.
+ */
+static int ext4_ext_next_leaf(struct ext4_inode_ref *inode_ref,
+			      struct ext4_extent_path *path, int32_t depth,
+			      __u64 end, __bool *found)
+{
+	struct ext4_block bh = EXT4_BLOCK_ZERO();
+	int32_t i;
+	int err;
+
+	*found = FALSE;
+	for (i = depth - 1; i >= 0; i--)
+		if (path[i].index != EXT_LAST_INDEX(path[i].header))
+			break;
+
+	if (i < 0 || to_le32(path[i].index[1].first_block) >= end)
+		return EOK;
+
+	path[i].index++;
+	for (; i < depth; i++) {
+		path[i].p_block = ext4_idx_pblock(path[i].index);
+		ext4_ext_drop_refs(inode_ref, path + i + 1, 1);
+		err = read_extent_tree_block(inode_ref, path[i].p_block,
+					     depth - i - 1, &bh, 0);
+		if (err != EOK)
+			return err;
+
+		path[i + 1].block = bh;
+		path[i + 1].header = ext_block_hdr(&bh);
+		path[i + 1].depth = depth - i - 1;
+		if (i + 1 == depth) {
+			path[i + 1].index = NULL;
+			path[i + 1].extent = EXT_FIRST_EXTENT(path[i + 1].header);
+		} else {
+			path[i + 1].extent = NULL;
+			path[i + 1].index = EXT_FIRST_INDEX(path[i + 1].header);
+		}
+	}
+
+	*found = TRUE;
+	return EOK;
+}
+
+/*
+ * Return the mappings of the range [lblk, lblk + len) in one pass over
+ * the leaves: the tree is walked from the root once, then the path
+ * moves on to the following leaves.  Holes are left out, and extents
+ * which continue each other on disk are returned as one mapping.
+ * At most max_maps mappings are returned in *nr_maps; *next_lblk
+ * returns the block to continue from if maps ran out, or the end of
+ * the range otherwise.
+ */
+int ext4_extent_map_range(struct ext4_inode_ref *inode_ref,
+			  ext4_lblk_t lblk, ext4_lblk_t len,
+			  struct ext4_extent_map *maps, __u32 max_maps,
+			  __u32 *nr_maps, ext4_lblk_t *next_lblk)
+{
+	struct ext4_extent_path *path = NULL;
+	struct ext4_extent_map *map;
+	struct ext4_extent *ex;
+	__u64 end = (__u64)lblk + len, ee_end;
+	ext4_lblk_t ee_block, start;
+	__u32 n = 0;
+	int32_t depth;
+	__bool found;
+	int err;
+
+	if (end > EXT_MAX_BLOCKS)
+		end = EXT_MAX_BLOCKS;
+
+	*nr_maps = 0;
+	*next_lblk = (ext4_lblk_t)end;
+
+	err = ext4_find_extent(inode_ref, lblk, &path, 0);
+	if (err != EOK)
+		return err;
+
+	depth = ext_depth(inode_ref->inode);
+	ex = path[depth].extent;
+	if (!ex)
+		ex = EXT_FIRST_EXTENT(path[depth].header);
+
+	for (;;) {
+		for (; ex <= EXT_LAST_EXTENT(path[depth].header); ex++) {
+			ee_block = to_le32(ex->first_block);
+			ee_end = (__u64)ee_block + ext4_ext_get_actual_len(ex);
+			if (ee_block >= end)
+				goto out;
+			if (ee_end <= lblk)
+				continue;
+
+			start = ee_block > lblk ? ee_block : lblk;
+			if (ee_end > end)
+				ee_end = end;
+
+			map = n ? &maps[n - 1] : NULL;
+			if (map && map->em_lblk + map->em_len == start &&
+			    map->em_pblk + map->em_len ==
+				ext4_ext_pblock(ex) + (start - ee_block) &&
+			    map->em_unwritten == !!ext4_ext_is_unwritten(ex)) {
+				map->em_len += (ext4_lblk_t)ee_end - start;
+				continue;
+			}
+
+			if (n == max_maps) {
+				*next_lblk = start;
+				goto out;
+			}
+
+			map = &maps[n++];
+			map->em_lblk = start;
+			map->em_len = (ext4_lblk_t)ee_end - start;
+			map->em_pblk = ext4_ext_pblock(ex) + (start - ee_block);
+			map->em_unwritten = !!ext4_ext_is_unwritten(ex);
+		}
+
+		err = ext4_ext_next_leaf(inode_ref, path, depth, end, &found);
+		if (err != EOK || !found)
+			break;
+
+		ex = EXT_FIRST_EXTENT(path[depth].header);
+	}
+
+out:
+	*nr_maps = n;
+	if (err != EOK) {
+		ext4_ext_path_free(inode_ref, path);
+		return err;
+	}
+
+	ext4_ext_path_put(inode_ref, path);
+	return EOK;
+}
+
+/*
+ * Prepare blocks for a buffered write without allocating them.
+ * Blocks in a hole are reserved and recorded as delayed in the extent
+ * status tree; they get allocated by ext4_extent_alloc_delayed() when
+ * the cache flushes them.  *blocks_count returns the nr. of blocks from
+ * iblock which are prepared, mapped or delayed already.
+ */
+int ext4_extent_delay_blocks(struct ext4_inode_ref *inode_ref,
+			     ext4_lblk_t iblock, __u32 max_blocks,
+			     __u32 *blocks_count)
+{
+	struct ext4_es_tree *es_tree = ext4_ext_es_tree(inode_ref);
+	ext4_lblk_t nr_delayed;
+	struct ext4_es es;
+	__u32 es_seq, len;
+	int err;
+
+	*blocks_count = 0;
+	if (!ext4_es_lookup(es_tree, iblock, &es, &es_seq)) {
+		/* the lookup caches the extent or hole covering iblock */
+		err = ext4_extent_get_blocks(inode_ref, iblock, max_blocks,
+					     NULL, FALSE, &len);
+		if (err != EOK)
+			return err;
+
+		if (len) {
+			*blocks_count = len;
+			return EOK;
+		}
+
+		if (!ext4_es_lookup(es_tree, iblock, &es, &es_seq)) {
+			es.es_lblk = iblock;
+			es.es_len = 1;
+			es.es_status = EXT4_ES_HOLE;
+		}
+	}
+
+	len = es.es_len - (iblock - es.es_lblk);
+	if (len > max_blocks)
+		len = max_blocks;
+
+	if (es.es_status & EXT4_ES_HOLE) {
+		err = ext4_ext_reserve_blocks(inode_ref, len);
+		if (err != EOK)
+			return err;
+
+		if (!NT_SUCCESS(ext4_es_insert_delayed(es_tree, iblock, len,
+						       &nr_delayed))) {
+			ext4_ext_release_blocks(inode_ref, len);
+			return ENOMEM;
+		}
+
+		/* a racing writer reserved those blocks already */
+		ext4_ext_release_blocks(inode_ref, nr_delayed);
+	}
+
+	*blocks_count = len;
+	return EOK;
+}
+
+/*
+ * Map blocks for the cache to flush them.  If iblock is delayed, the
+ * whole delayed range around it is allocated first, so that the range
+ * written in many small pieces ends up in as few extents as possible.
+ */
+int ext4_extent_alloc_delayed(struct ext4_inode_ref *inode_ref,
+			      ext4_lblk_t iblock, __u32 max_blocks,
+			      ext4_fsblk_t *result, __u32 *blocks_count)
+{
+	struct ext4_es es;
+	__u32 es_seq, count;
+	ext4_lblk_t lblk, end;
+	int err;
+
+	if (ext4_es_lookup(ext4_ext_es_tree(inode_ref), iblock, &es, &es_seq) &&
+	    (es.es_status & EXT4_ES_DELAYED)) {
+		lblk = es.es_lblk;
+		end = es.es_lblk + es.es_len;
+		while (lblk < end) {
+			err = ext4_extent_get_blocks(inode_ref, lblk,
+						     end - lblk, NULL, TRUE,
+						     &count);
+			if (err != EOK)
+				return err;
+			if (!count)
+				return EIO;
+
+			lblk += count;
+		}
+	}
+
+	return ext4_extent_get_blocks(inode_ref, iblock, max_blocks, result,
+				      TRUE, blocks_count);
+}
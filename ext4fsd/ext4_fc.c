@@ -0,0 +1,426 @@
+/*
+ * Copyright (c) 2015 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+#include "ext4.h"
+#include "ext4_data.h"
+
+/*
+ * Fast commit records use the layout of the Linux ext4 driver, so that
+ * the fast commits of either driver can be replayed by the other one
+ * and by e2fsck.  A fast commit is a run of records ended by a tail,
+ * whose checksum covers the records since the previous tail.  Records
+ * never straddle blocks; the end of a block which cannot hold the next
+ * record is covered by a pad record.  Only the first fast commit after
+ * a full commit starts with a head.
+ */
+
+#define EXT4_FC_TL_LEN		((__u32)sizeof(struct ext4_fc_tl))
+
+/**
+ * @brief	Reserve room for a record in the fast commit being written
+ * @remarks	A block is left either full or with room for a pad record,
+ *			so the records of every block end exactly at its end.
+ * @param fw	Fast commit writer
+ * @param len	Length of the value of the record
+ * @param dst	Where the record goes
+ * @return	STATUS_SUCCESS, otherwise the fast commit has failed.
+ */
+static NTSTATUS
+ext4_fc_reserve(
+	struct ext4_fc_writer *fw,
+	__u32 len,
+	__u8 **dst)
+{
+	__u32 bsize = fw->fw_journal->jh_blocksize;
+	__u32 need = EXT4_FC_TL_LEN + len;
+	struct ext4_fc_tl *tl;
+
+	if (!NT_SUCCESS(fw->fw_status))
+		return fw->fw_status;
+	if (need > bsize - EXT4_FC_TL_LEN) {
+		fw->fw_status = STATUS_INVALID_PARAMETER;
+		return fw->fw_status;
+	}
+
+	if (fw->fw_buf &&
+		(fw->fw_off + need == bsize ||
+		 fw->fw_off + need + EXT4_FC_TL_LEN <= bsize)) {
+		*dst = fw->fw_buf + fw->fw_off;
+		return STATUS_SUCCESS;
+	}
+
+	/* The block is zeroed, so the value of the pad already is */
+	if (fw->fw_buf) {
+		tl = (struct ext4_fc_tl *)(fw->fw_buf + fw->fw_off);
+		tl->fc_tag = cpu_to_le16(EXT4_FC_TAG_PAD);
+		tl->fc_len = cpu_to_le16((__u16)(bsize - fw->fw_off - EXT4_FC_TL_LEN));
+		fw->fw_crc = drv_crc32c(fw->fw_crc, tl, bsize - fw->fw_off);
+	}
+
+	fw->fw_status = jbd2_fc_get_block(fw->fw_journal, (void **)&fw->fw_buf);
+	if (!NT_SUCCESS(fw->fw_status))
+		return fw->fw_status;
+
+	fw->fw_off = 0;
+	*dst = fw->fw_buf;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Append a record made of a tag, a fixed part and an optional
+ *			trailing part to the fast commit being written
+ * @param fw		Fast commit writer
+ * @param tag		EXT4_FC_TAG_*
+ * @param val		Fixed part of the value
+ * @param len		Length of @p val
+ * @param extra		Trailing part of the value, may be NULL
+ * @param extra_len	Length of @p extra
+ * @return	STATUS_SUCCESS, otherwise the fast commit has failed.
+ */
+static NTSTATUS
+ext4_fc_add_record(
+	struct ext4_fc_writer *fw,
+	__u16 tag,
+	const void *val,
+	__u32 len,
+	const void *extra,
+	__u32 extra_len)
+{
+	struct ext4_fc_tl *tl;
+	__u8 *dst;
+
+	if (!NT_SUCCESS(ext4_fc_reserve(fw, len + extra_len, &dst)))
+		return fw->fw_status;
+
+	tl = (struct ext4_fc_tl *)dst;
+	tl->fc_tag = cpu_to_le16(tag);
+	tl->fc_len = cpu_to_le16((__u16)(len + extra_len));
+	RtlCopyMemory(dst + EXT4_FC_TL_LEN, val, len);
+	if (extra_len)
+		RtlCopyMemory(dst + EXT4_FC_TL_LEN + len, extra, extra_len);
+
+	fw->fw_crc = drv_crc32c(fw->fw_crc, dst, EXT4_FC_TL_LEN + len + extra_len);
+	fw->fw_off += EXT4_FC_TL_LEN + len + extra_len;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Start a fast commit of the running transaction of @p journal
+ * @remarks	The records added describe changes already logged in the
+ *			running transaction.  If this fails, ext4_fc_end() must not
+ *			be called; on STATUS_ALREADY_COMMITTED the changes are
+ *			durable, on any other error the caller falls back to a full
+ *			commit.
+ * @param fw		Fast commit writer
+ * @param journal	Journal of the volume
+ * @return	STATUS_SUCCESS if the fast commit has started, otherwise the
+ *			status from jbd2_fc_begin().
+ */
+NTSTATUS ext4_fc_begin(
+	struct ext4_fc_writer *fw,
+	jbd2_handle_t *journal)
+{
+	struct ext4_fc_head head;
+	jbd2_logblk_t blk_off;
+	NTSTATUS status;
+
+	RtlZeroMemory(fw, sizeof(struct ext4_fc_writer));
+	fw->fw_journal = journal;
+	status = jbd2_fc_begin(journal, &fw->fw_tid, &blk_off);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (blk_off)
+		return STATUS_SUCCESS;
+
+	head.fc_features = cpu_to_le32(EXT4_FC_SUPPORTED_FEATURES);
+	head.fc_tid = cpu_to_le32(fw->fw_tid);
+	return ext4_fc_add_record(
+			fw,
+			EXT4_FC_TAG_HEAD,
+			&head,
+			sizeof(head),
+			NULL,
+			0);
+}
+
+/**
+ * @brief	Record that an extent was mapped by an inode
+ * @param fw	Fast commit writer
+ * @param ino	Inode nr.
+ * @param ex	The extent, as stored in the extent tree
+ * @return	STATUS_SUCCESS, otherwise the fast commit has failed.
+ */
+NTSTATUS ext4_fc_add_range(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	struct ext4_extent *ex)
+{
+	struct ext4_fc_add_range range;
+
+	range.fc_ino = cpu_to_le32(ino);
+	RtlCopyMemory(range.fc_ex, ex, sizeof(range.fc_ex));
+	return ext4_fc_add_record(
+			fw,
+			EXT4_FC_TAG_ADD_RANGE,
+			&range,
+			sizeof(range),
+			NULL,
+			0);
+}
+
+/**
+ * @brief	Record that a range of blocks was unmapped from an inode
+ * @param fw	Fast commit writer
+ * @param ino	Inode nr.
+ * @param lblk	First logical block unmapped
+ * @param len	Nr. of blocks unmapped
+ * @return	STATUS_SUCCESS, otherwise the fast commit has failed.
+ */
+NTSTATUS ext4_fc_del_range(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len)
+{
+	struct ext4_fc_del_range range;
+
+	range.fc_ino = cpu_to_le32(ino);
+	range.fc_lblk = cpu_to_le32(lblk);
+	range.fc_len = cpu_to_le32(len);
+	return ext4_fc_add_record(
+			fw,
+			EXT4_FC_TAG_DEL_RANGE,
+			&range,
+			sizeof(range),
+			NULL,
+			0);
+}
+
+/**
+ * @brief	Record the new state of an on-disk inode
+ * @remarks	The ranges of the inode must be added first, since replay
+ *			applies the inode after them.
+ * @param fw			Fast commit writer
+ * @param ino			Inode nr.
+ * @param raw_inode		The on-disk inode
+ * @param inode_size	Size of the on-disk inode
+ * @return	STATUS_SUCCESS, otherwise the fast commit has failed.
+ */
+NTSTATUS ext4_fc_add_inode(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	struct ext4_inode *raw_inode,
+	__u32 inode_size)
+{
+	struct ext4_fc_inode fc_inode;
+
+	fc_inode.fc_ino = cpu_to_le32(ino);
+	return ext4_fc_add_record(
+			fw,
+			EXT4_FC_TAG_INODE,
+			&fc_inode,
+			sizeof(fc_inode),
+			raw_inode,
+			inode_size);
+}
+
+/**
+ * @brief	End a fast commit with its tail and write it to disk
+ * @remarks	If anything failed since ext4_fc_begin(), the records are
+ *			dropped and the caller falls back to a full commit.
+ * @param fw	Fast commit writer
+ * @return	STATUS_SUCCESS if the records are durable, otherwise the
+ *			fast commit has failed.
+ */
+NTSTATUS ext4_fc_end(struct ext4_fc_writer *fw)
+{
+	__u32 bsize = fw->fw_journal->jh_blocksize;
+	struct ext4_fc_tail *tail;
+	struct ext4_fc_tl *tl;
+	NTSTATUS status;
+	__u8 *dst;
+
+	/* The tail covers the rest of its block */
+	if (NT_SUCCESS(ext4_fc_reserve(fw, sizeof(struct ext4_fc_tail), &dst))) {
+		tl = (struct ext4_fc_tl *)dst;
+		tail = (struct ext4_fc_tail *)(dst + EXT4_FC_TL_LEN);
+		tl->fc_tag = cpu_to_le16(EXT4_FC_TAG_TAIL);
+		tl->fc_len = cpu_to_le16((__u16)(bsize - fw->fw_off - EXT4_FC_TL_LEN));
+		tail->fc_tid = cpu_to_le32(fw->fw_tid);
+		fw->fw_crc = drv_crc32c(
+				fw->fw_crc,
+				dst,
+				EXT4_FC_TL_LEN + FIELD_OFFSET(struct ext4_fc_tail, fc_crc));
+		tail->fc_crc = cpu_to_le32(fw->fw_crc);
+		fw->fw_off = bsize;
+	}
+
+	status = jbd2_fc_end(fw->fw_journal, NT_SUCCESS(fw->fw_status));
+	if (NT_SUCCESS(fw->fw_status))
+		fw->fw_status = status;
+	return fw->fw_status;
+}
+
+/**
+ * @brief	Initialize the state of a fast commit replay
+ * @param state		Replay state, passed to ext4_fc_replay_scan()
+ * @param blocksize	Block size of the journal
+ */
+void ext4_fc_replay_init(
+	struct ext4_fc_replay_state *state,
+	__u32 blocksize)
+{
+	RtlZeroMemory(state, sizeof(struct ext4_fc_replay_state));
+	state->rs_blocksize = blocksize;
+}
+
+/**
+ * @brief	Keep a record found by the replay
+ * @param state	Replay state
+ * @param rec	The record, tag and value
+ * @param len	Length of the record
+ * @return	STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES
+ */
+static NTSTATUS
+ext4_fc_replay_keep(
+	struct ext4_fc_replay_state *state,
+	const void *rec,
+	__u32 len)
+{
+	__u8 *tags;
+	__u32 max;
+
+	if (state->rs_len + len > state->rs_max) {
+		max = state->rs_max ? state->rs_max * 2 : state->rs_blocksize;
+		while (max < state->rs_len + len)
+			max *= 2;
+
+		tags = ExAllocatePoolWithTag(PagedPool, max, EXT4_FC_POOL_TAG);
+		if (!tags)
+			return STATUS_INSUFFICIENT_RESOURCES;
+		if (state->rs_tags) {
+			RtlCopyMemory(tags, state->rs_tags, state->rs_len);
+			ExFreePoolWithTag(state->rs_tags, EXT4_FC_POOL_TAG);
+		}
+		state->rs_tags = tags;
+		state->rs_max = max;
+	}
+
+	RtlCopyMemory(state->rs_tags + state->rs_len, rec, len);
+	state->rs_len += len;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Scan a block of the fast commit area during the replay of
+ *			the journal (jbd2_fc_replay_t)
+ * @remarks	Records are kept once the tail of their fast commit checks
+ *			out; the first fast commit which does not ends the scan.
+ *			This only collects the records.  A replay callback given to
+ *			jbd2_fc_set_replay() must apply them before it returns
+ *			STATUS_NO_MORE_ENTRIES, which takes loading inodes by
+ *			number; until the volume can, none is set and fast commits
+ *			stay disabled.
+ * @param context		struct ext4_fc_replay_state
+ * @param expected_tid	ID the fast commits to be replayed carry
+ * @param blk_off		Offset of the block in the fast commit area
+ * @param buf			Buffer of the block
+ * @return	STATUS_SUCCESS to be given the next block,
+ *			STATUS_NO_MORE_ENTRIES once the fast commits end,
+ *			STATUS_NOT_SUPPORTED if they use unknown features,
+ *			STATUS_INSUFFICIENT_RESOURCES if the records cannot be kept.
+ */
+NTSTATUS ext4_fc_replay_scan(
+	void *context,
+	jbd2_tid_t expected_tid,
+	jbd2_logblk_t blk_off,
+	void *buf)
+{
+	struct ext4_fc_replay_state *state = context;
+	__u8 *start = buf;
+	struct ext4_fc_head head;
+	struct ext4_fc_tail tail;
+	struct ext4_fc_tl tl;
+	NTSTATUS status;
+	__u32 off, len;
+
+	for (off = 0;
+		off + EXT4_FC_TL_LEN <= state->rs_blocksize;
+		off += EXT4_FC_TL_LEN + len) {
+
+		RtlCopyMemory(&tl, start + off, EXT4_FC_TL_LEN);
+		len = le16_to_cpu(tl.fc_len);
+		if (off + EXT4_FC_TL_LEN + len > state->rs_blocksize)
+			goto end;
+
+		switch (le16_to_cpu(tl.fc_tag)) {
+		case EXT4_FC_TAG_HEAD:
+			if (blk_off || off || len < sizeof(head))
+				goto end;
+			RtlCopyMemory(&head, start + off + EXT4_FC_TL_LEN, sizeof(head));
+			if (le32_to_cpu(head.fc_features) & ~EXT4_FC_SUPPORTED_FEATURES)
+				return STATUS_NOT_SUPPORTED;
+			if (le32_to_cpu(head.fc_tid) != expected_tid)
+				goto end;
+			break;
+		case EXT4_FC_TAG_ADD_RANGE:
+		case EXT4_FC_TAG_DEL_RANGE:
+		case EXT4_FC_TAG_CREAT:
+		case EXT4_FC_TAG_LINK:
+		case EXT4_FC_TAG_UNLINK:
+		case EXT4_FC_TAG_INODE:
+			status = ext4_fc_replay_keep(
+					state,
+					start + off,
+					EXT4_FC_TL_LEN + len);
+			if (!NT_SUCCESS(status))
+				return status;
+			break;
+		case EXT4_FC_TAG_PAD:
+			break;
+		case EXT4_FC_TAG_TAIL:
+			if (len < sizeof(tail))
+				goto end;
+			RtlCopyMemory(&tail, start + off + EXT4_FC_TL_LEN, sizeof(tail));
+			state->rs_crc = drv_crc32c(
+						state->rs_crc,
+						start + off,
+						EXT4_FC_TL_LEN +
+							FIELD_OFFSET(struct ext4_fc_tail, fc_crc));
+			if (le32_to_cpu(tail.fc_tid) != expected_tid ||
+				le32_to_cpu(tail.fc_crc) != state->rs_crc)
+				goto end;
+
+			state->rs_valid = state->rs_len;
+			state->rs_nr_commits++;
+			state->rs_crc = 0;
+			continue;
+		default:
+			goto end;
+		}
+		state->rs_crc = drv_crc32c(
+					state->rs_crc,
+					start + off,
+					EXT4_FC_TL_LEN + len);
+	}
+	return STATUS_SUCCESS;
+
+end:
+	/* Records of a fast commit without a valid tail are dropped */
+	state->rs_len = state->rs_valid;
+	return STATUS_NO_MORE_ENTRIES;
+}
+
+/**
+ * @brief	Free the records kept by a fast commit replay
+ * @param state	Replay state
+ */
+void ext4_fc_replay_release(struct ext4_fc_replay_state *state)
+{
+	if (state->rs_tags)
+		ExFreePoolWithTag(state->rs_tags, EXT4_FC_POOL_TAG);
+	state->rs_tags = NULL;
+	state->rs_len = state->rs_max = state->rs_valid = 0;
+}
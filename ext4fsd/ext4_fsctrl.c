@@ -0,0 +1,156 @@
+/*++
+
+Copyright (c) 2016 Kaho Ng <ngkaho1234@gmail.com>
+
+Module Name:
+
+ext4_fsctrl.c
+
+Abstract:
+
+This module implements IRP_MJ_FILE_SYSTEM_CONTROL for Ext4Fsd
+
+
+--*/
+
+#include "ext4.h"
+#include "ext4_data.h"
+
+/**
+ * @brief	Return the journal statistics of a volume
+ * @param irp_ctx	Request context
+ * @return	STATUS_SUCCESS if the statistics are returned,
+ *			STATUS_BUFFER_TOO_SMALL if the output buffer cannot hold them,
+ *			STATUS_INVALID_DEVICE_REQUEST if the request does not go to
+ *				a volume or the volume has no journal.
+ */
+static NTSTATUS ext4_query_journal_stats(struct ext4_irp_ctx *irp_ctx)
+{
+	PIRP irp = irp_ctx->ic_irp;
+	PIO_STACK_LOCATION irp_sp = IoGetCurrentIrpStackLocation(irp);
+	struct ext4_journal_stats *out;
+	jbd2_replay_stats_t replay;
+	jbd2_commit_stats_t commit;
+	jbd2_handle_t *journal;
+
+	/* Requests to the file system device object have no volume */
+	if (!irp_ctx->ic_vcb)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	journal = irp_ctx->ic_vcb->v_journal;
+	if (!journal)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	if (irp_sp->Parameters.FileSystemControl.OutputBufferLength <
+			sizeof(struct ext4_journal_stats))
+		return STATUS_BUFFER_TOO_SMALL;
+
+	jbd2_query_replay_stats(journal, &replay);
+	jbd2_query_commit_stats(journal, &commit);
+
+	out = irp->AssociatedIrp.SystemBuffer;
+	RtlZeroMemory(out, sizeof(struct ext4_journal_stats));
+	out->js_version = EXT4_JOURNAL_STATS_VERSION;
+	out->js_size = sizeof(struct ext4_journal_stats);
+
+	out->js_replay_status = replay.rs_status;
+	out->js_replay_nr_txns = replay.rs_nr_txns;
+	out->js_replay_nr_log_blocks = replay.rs_nr_log_blocks;
+	out->js_replay_nr_recs = replay.rs_nr_recs;
+	out->js_replay_nr_replayed = replay.rs_nr_replayed;
+	out->js_replay_nr_superseded = replay.rs_nr_superseded;
+	out->js_replay_nr_revoked = replay.rs_nr_revoked;
+	out->js_replay_nr_fc_blocks = replay.rs_nr_fc_blocks;
+	out->js_replay_bytes_read = replay.rs_bytes_read;
+	out->js_replay_scan_us = replay.rs_scan_us;
+	out->js_replay_dedup_us = replay.rs_dedup_us;
+	out->js_replay_write_us = replay.rs_replay_us;
+	out->js_replay_fc_us = replay.rs_fc_us;
+
+	out->js_commit_nr_commits = commit.cs_nr_commits;
+	out->js_commit_nr_blocks = commit.cs_nr_blocks;
+	out->js_commit_us = commit.cs_commit_us;
+	out->js_commit_nr_fc_commits = commit.cs_nr_fc_commits;
+	out->js_commit_nr_log_wraps = commit.cs_nr_log_wraps;
+	out->js_commit_log_blocks = commit.cs_log_blocks;
+	out->js_commit_log_used = commit.cs_log_used_blocks;
+
+	irp->IoStatus.Information = sizeof(struct ext4_journal_stats);
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Dispatch a FSCTL issued by user
+ * @param irp_ctx	Request context
+ * @return	Status of the request
+ */
+static NTSTATUS ext4_user_fs_request(struct ext4_irp_ctx *irp_ctx)
+{
+	PIO_STACK_LOCATION irp_sp = IoGetCurrentIrpStackLocation(irp_ctx->ic_irp);
+
+	switch (irp_sp->Parameters.FileSystemControl.FsControlCode) {
+	case FSCTL_EXT4_QUERY_JOURNAL_STATS:
+		return ext4_query_journal_stats(irp_ctx);
+	default:
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+}
+
+/**
+ * @brief	Handle IRP_MJ_FILE_SYSTEM_CONTROL
+ * @remarks	The IRP is not completed here, the caller completes it with
+ *			the status returned.
+ * @param irp_ctx	Request context
+ * @return	Status of the request
+ */
+NTSTATUS ext4_fsctrl(struct ext4_irp_ctx *irp_ctx)
+{
+	switch (irp_ctx->ic_minor_func) {
+	case IRP_MN_USER_FS_REQUEST:
+		return ext4_user_fs_request(irp_ctx);
+	case IRP_MN_MOUNT_VOLUME:
+		return STATUS_UNRECOGNIZED_VOLUME;
+	default:
+		return STATUS_INVALID_DEVICE_REQUEST;
+	}
+}
+
+/**
+ * @brief	Dispatch routine of IRP_MJ_FILE_SYSTEM_CONTROL
+ * @remarks	Requests to the file system device objects go out with no
+ *			VCB.  A volume device object carries the VCB of its volume
+ *			as its device extension.
+ * @param device_object	Device object the request goes to
+ * @param irp			The request
+ * @return	Status of the request, which is completed here
+ */
+NTSTATUS ext4_fsd_fsctrl(PDEVICE_OBJECT device_object, PIRP irp)
+{
+	PIO_STACK_LOCATION irp_sp = IoGetCurrentIrpStackLocation(irp);
+	struct ext4_irp_ctx irp_ctx;
+	NTSTATUS status;
+
+	RtlZeroMemory(&irp_ctx, sizeof(irp_ctx));
+	irp_ctx.ic_nid = EXT4_NID_IRP_CTX;
+	irp_ctx.ic_irp = irp;
+	irp_ctx.ic_major_func = irp_sp->MajorFunction;
+	irp_ctx.ic_minor_func = irp_sp->MinorFunction;
+	irp_ctx.ic_device_object = device_object;
+	irp_ctx.ic_file_object = irp_sp->FileObject;
+	irp_ctx.ic_top_level = IoGetTopLevelIrp() == NULL;
+	if (device_object != ext4_disk_fsd_object &&
+		device_object != ext4_cdrom_fsd_object)
+		irp_ctx.ic_vcb = device_object->DeviceExtension;
+
+	FsRtlEnterFileSystem();
+	if (irp_ctx.ic_top_level)
+		IoSetTopLevelIrp(irp);
+	status = ext4_fsctrl(&irp_ctx);
+	if (irp_ctx.ic_top_level)
+		IoSetTopLevelIrp(NULL);
+	FsRtlExitFileSystem();
+
+	irp->IoStatus.Status = status;
+	IoCompleteRequest(irp, IO_NO_INCREMENT);
+	return status;
+}
@@ -60,6 +60,15 @@ DriverEntry(
 
 	driver_object->DriverUnload = ext4_unload;
 
+	/*
+	 * Build the checksum tables before anything can touch metadata
+	 */
+	drv_crc32_init();
+	dbg_print("crc32 engine: %s, crc32c engine: %s, crc32_be engine: %s\n",
+		drv_crc32_engine_name(drv_crc32_engine()),
+		drv_crc32_engine_name(drv_crc32c_engine()),
+		drv_crc32_engine_name(drv_crc32_be_engine()));
+
 	/*
 	 * Create Ext4Fsd cdrom fs deivce
 	 */
@@ -100,6 +109,8 @@ DriverEntry(
 	 * Initialize the driver object with this driver's entry points.
 	 */
 
+	driver_object->MajorFunction[IRP_MJ_FILE_SYSTEM_CONTROL] = ext4_fsd_fsctrl;
+
 #if 0
 	driver_object->MajorFunction[IRP_MJ_CREATE] = (PDRIVER_DISPATCH)FatFsdCreate;
 	driver_object->MajorFunction[IRP_MJ_CLOSE] = (PDRIVER_DISPATCH)FatFsdClose;
@@ -114,7 +125,6 @@ DriverEntry(
 	driver_object->MajorFunction[IRP_MJ_SET_VOLUME_INFORMATION] = (PDRIVER_DISPATCH)FatFsdSetVolumeInformation;
 	driver_object->MajorFunction[IRP_MJ_CLEANUP] = (PDRIVER_DISPATCH)FatFsdCleanup;
 	driver_object->MajorFunction[IRP_MJ_DIRECTORY_CONTROL] = (PDRIVER_DISPATCH)FatFsdDirectoryControl;
-	driver_object->MajorFunction[IRP_MJ_FILE_SYSTEM_CONTROL] = (PDRIVER_DISPATCH)FatFsdFileSystemControl;
 	driver_object->MajorFunction[IRP_MJ_LOCK_CONTROL] = (PDRIVER_DISPATCH)FatFsdLockControl;
 	driver_object->MajorFunction[IRP_MJ_DEVICE_CONTROL] = (PDRIVER_DISPATCH)FatFsdDeviceControl;
 	driver_object->MajorFunction[IRP_MJ_SHUTDOWN] = (PDRIVER_DISPATCH)FatFsdShutdown;
@@ -178,6 +188,11 @@ DriverEntry(
 	}
 #endif /* #if 0 */
 
+	/*
+	 * Lookaside list of extent paths
+	 */
+	ext4_extent_init_path_cache();
+
 	/*
 	 * Register the file system with the I/O system
 	 */
@@ -212,4 +227,6 @@ ext4_unload(
 	 */
 	IoDeleteDevice(ext4_disk_fsd_object);
 	IoDeleteDevice(ext4_cdrom_fsd_object);
+
+	ext4_extent_destroy_path_cache();
 }
\ No newline at end of file
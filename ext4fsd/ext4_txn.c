@@ -8,16 +8,104 @@
 /*
  * NOTES:
  *	1. If a transaction does not have definite amount of blocks to be preserved,
- *	    that transaction will be committed (flushed) immediately when it is closed.
+ *	    it reserves EXT4_TXN_DEFAULT_BLOCKS, and as many more each time it runs
+ *	    out.  Stopping it does not wait for a commit; the commit thread commits
+ *	    the running transaction once its interval elapses or it fills up.
+ *	2. A request holds one transaction handle from its first ext4_txn_start() to
+ *	    its last ext4_txn_stop().  The metadata blocks it changes meanwhile join the
+ *	    running transaction of the journal, together with those of the requests
+ *	    running concurrently, and are committed as one batch.
  */
 
-
-void ext4_txn_start(
+/**
+ * @brief	Start the transaction of a request
+ * @remarks	Nested calls join the transaction already started by the
+ *			request, whose reservation has to cover them.
+ * @param irp_ctx	Request context
+ * @param blk_cnt	Nr. of metadata blocks the request may change, or 0
+ *					if unknown
+ * @return	STATUS_SUCCESS if the transaction is started, otherwise the
+ *			status from jbd2_txn_handle_start().
+ */
+NTSTATUS ext4_txn_start(
 		struct ext4_irp_ctx *irp_ctx,
 		ext4_lblk_t blk_cnt)
 {
+	jbd2_handle_t *journal = irp_ctx->ic_vcb->v_journal;
+	NTSTATUS status;
+
+	if (irp_ctx->ic_txn_depth++)
+		return STATUS_SUCCESS;
+
+	irp_ctx->ic_txn_grow = !blk_cnt;
+	if (!journal)
+		return STATUS_SUCCESS;
+
+	if (!blk_cnt)
+		blk_cnt = EXT4_TXN_DEFAULT_BLOCKS;
+
+	status = jbd2_txn_handle_start(journal, blk_cnt, &irp_ctx->ic_txn);
+	if (!NT_SUCCESS(status)) {
+		irp_ctx->ic_txn = NULL;
+		irp_ctx->ic_txn_depth = 0;
+	}
+	return status;
 }
 
-void ext4_txn_stop(struct ext4_irp_ctx *irp_ctx)
+/**
+ * @brief	Add a metadata block to the transaction of a request
+ * @remarks	Must be called before the block is changed.  Adding a block
+ *			twice is harmless.  A request started without a block count
+ *			reserves more blocks when it runs out.
+ * @param irp_ctx	Request context
+ * @param blocknr	Block nr. on the volume
+ * @param bcb		Bcb pinning the block
+ * @param buf		Buffer of the block
+ * @return	STATUS_SUCCESS if the block may be changed,
+ *			STATUS_LOG_FILE_FULL if the request changes more blocks than
+ *				it reserved and no more can be reserved,
+ *			otherwise the operation fails.
+ */
+NTSTATUS ext4_txn_get_write_access(
+		struct ext4_irp_ctx *irp_ctx,
+		ext4_fsblk_t blocknr,
+		void *bcb,
+		void *buf)
 {
-}
\ No newline at end of file
+	NTSTATUS status;
+
+	NT_ASSERT(irp_ctx->ic_txn_depth);
+	if (!irp_ctx->ic_txn)
+		return STATUS_SUCCESS;
+
+	status = jbd2_txn_handle_log(irp_ctx->ic_txn, blocknr, bcb, buf);
+	if (status != STATUS_LOG_FILE_FULL || !irp_ctx->ic_txn_grow)
+		return status;
+
+	status = jbd2_txn_handle_extend(irp_ctx->ic_txn, EXT4_TXN_DEFAULT_BLOCKS);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	return jbd2_txn_handle_log(irp_ctx->ic_txn, blocknr, bcb, buf);
+}
+
+/**
+ * @brief	Stop the transaction of a request
+ * @remarks	The last call closes the transaction handle and gives back
+ *			the blocks reserved but not logged.  The blocks logged are
+ *			committed by the commit thread.
+ * @param irp_ctx	Request context
+ * @return	STATUS_SUCCESS, or the error the journal was aborted with
+ */
+NTSTATUS ext4_txn_stop(struct ext4_irp_ctx *irp_ctx)
+{
+	NTSTATUS status;
+
+	NT_ASSERT(irp_ctx->ic_txn_depth);
+	if (--irp_ctx->ic_txn_depth || !irp_ctx->ic_txn)
+		return STATUS_SUCCESS;
+
+	status = jbd2_txn_handle_stop(irp_ctx->ic_txn);
+	irp_ctx->ic_txn = NULL;
+	return status;
+}
@@ -112,6 +112,40 @@ static inline void drv_atomic_dec(volatile drv_atomic_t *v)
 	InterlockedDecrement((PLONG)(&v->counter));
 }
 
+/**
+ * @brief	Decrement atomic variable and return the result
+ *
+ * @param v	pointer of type drv_atomic_t
+ *
+ * Atomically decrements @p v by 1.
+ *
+ * @return	The new value of @p v
+ */
+static inline int drv_atomic_dec_return(volatile drv_atomic_t *v)
+{
+	return InterlockedDecrement((PLONG)(&v->counter));
+}
+
+/**
+ * @brief	Compare and exchange atomic variable
+ *
+ * @param v		pointer of type drv_atomic_t
+ * @param old	value expected in @p v
+ * @param new	value to store
+ *
+ * Atomically sets @p v to @p new if it equals @p old.
+ *
+ * @return	The value of @p v before the operation, which equals
+ *			@p old if the exchange took place
+ */
+static inline int drv_atomic_cmpxchg(volatile drv_atomic_t *v, int old, int new)
+{
+	return InterlockedCompareExchange(
+				(PLONG)(&v->counter),
+				(LONG)new,
+				(LONG)old);
+}
+
 /**
 * @brief	Decrement and test
 *
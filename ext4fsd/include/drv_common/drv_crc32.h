@@ -6,5 +6,40 @@
 
 #include "drv_types.h"
 
+/**
+ * @brief	Checksum engines drv_crc32()/drv_crc32c()/drv_crc32_be() may
+ *			dispatch to
+ */
+enum drv_crc32_engine {
+	DRV_CRC32_ENGINE_BITWISE,	/* Bit-at-a-time reference loop */
+	DRV_CRC32_ENGINE_SLICE,		/* Slice-by-8/16 table lookup */
+	DRV_CRC32_ENGINE_SSE42,		/* SSE4.2 crc32 instruction */
+	DRV_CRC32_ENGINE_PCLMUL,	/* PCLMULQDQ folding */
+};
+
+/**
+ * @brief	One buffer of a batched checksum request
+ */
+struct drv_crc32_req {
+	__u32		cr_seed;	/* Initial CRC state */
+	const void	*cr_buf;	/* Buffer to checksum */
+	size_t		cr_len;		/* Length of cr_buf in bytes */
+	__u32		cr_crc;		/* Resulting CRC state */
+};
+
+void drv_crc32_init(void);
 __u32 drv_crc32(__u32 crc, const void *buf, size_t size);
 __u32 drv_crc32c(__u32 crc, const void *buf, size_t size);
+__u32 drv_crc32_be(__u32 crc, const void *buf, size_t size);
+void drv_crc32_multi(struct drv_crc32_req *reqs, int nr);
+void drv_crc32c_multi(struct drv_crc32_req *reqs, int nr);
+
+__u32 drv_crc32_shift(__u32 crc, __u64 len);
+__u32 drv_crc32c_shift(__u32 crc, __u64 len);
+__u32 drv_crc32_combine(__u32 crc_a, __u32 crc_b, __u64 len_b);
+__u32 drv_crc32c_combine(__u32 crc_a, __u32 crc_b, __u64 len_b);
+
+enum drv_crc32_engine drv_crc32_engine(void);
+enum drv_crc32_engine drv_crc32c_engine(void);
+enum drv_crc32_engine drv_crc32_be_engine(void);
+const char *drv_crc32_engine_name(enum drv_crc32_engine engine);
@@ -17,6 +17,11 @@ typedef __u32				ext4_gid_t;
 typedef __u32				ext4_umode_t;
 
 #include "ext4_fs.h"
+#include "jbd2\jbd2.h"
+#include "ext4_fsctl.h"
+
+struct ext4_inode_ref;
+struct ext4_extent_path;
 
 /*
  * In-core structure node ID
@@ -28,15 +33,75 @@ enum ext4_nid {
 };
 
 /*
-* Volume control block
+* Volume control block, the device extension of the volume device object
 */
 struct ext4_vcb {
 	enum ext4_nid			v_nid;		/* Identifier for this structure */
 	drv_atomic_t			v_refcount;	/* Reference counter */
 
 	struct ext4_super_block	v_sb;
+	jbd2_handle_t *			v_journal;	/* Journal of the volume, NULL if none */
+	drv_atomic_t			v_dirty_blocks;	/* Blocks reserved for delayed allocation */
+};
+
+/*
+ * Status of a range in the extent status tree
+ */
+#define EXT4_ES_WRITTEN		0x01	/* Mapped to written blocks */
+#define EXT4_ES_UNWRITTEN	0x02	/* Mapped to unwritten blocks */
+#define EXT4_ES_HOLE		0x04	/* Not mapped */
+#define EXT4_ES_DELAYED		0x08	/* Written to the cache, not allocated yet */
+
+/*
+ * Range of logical blocks cached by the extent status tree
+ */
+struct ext4_es {
+	ext4_lblk_t			es_lblk;	/* First logical block of the range */
+	ext4_lblk_t			es_len;		/* Nr. of blocks in the range */
+	ext4_fsblk_t		es_pblk;	/* Physical block of es_lblk, 0 for a hole */
+	__u32				es_status;	/* EXT4_ES_* */
+
+	RB_ENTRY(ext4_es)	es_node;	/* Tree node */
 };
 
+typedef RB_HEAD(ext4_es_table, ext4_es) ext4_es_table_t;
+
+/*
+ * Extent status tree of an inode.  It caches the mappings the extent
+ * tree returned so that lookups do not have to read the tree blocks.
+ * ext4_es_init() sets it up when the ICB is created, and
+ * ext4_es_release() frees it with the ICB.
+ */
+struct ext4_es_tree {
+	drv_mutex_t			et_lock;		/* Protects the fields below */
+	ext4_es_table_t		et_table;		/* Ranges keyed by es_lblk */
+	struct ext4_es *	et_cache;		/* Range found by the last lookup */
+	__u32				et_nr_ranges;	/* Nr. of ranges in et_table */
+	__u32				et_seq;			/* Bumped by every invalidation */
+	__u32				et_nr_delayed;	/* Nr. of blocks in delayed ranges */
+	__u64				et_nr_hits;		/* Lookups answered by the tree */
+	__u64				et_nr_misses;	/* Lookups left to the extent tree */
+};
+
+/* Pool tag of extent status ranges */
+#define EXT4_ES_POOL_TAG	'SE4E'
+
+/* Nr. of ranges an extent status tree keeps before it starts over */
+#define EXT4_ES_MAX_RANGES	1024
+
+/*
+ * Mapping of a range of logical blocks
+ */
+struct ext4_extent_map {
+	ext4_lblk_t			em_lblk;		/* First logical block */
+	ext4_lblk_t			em_len;			/* Nr. of blocks */
+	ext4_fsblk_t		em_pblk;		/* Physical block of em_lblk */
+	__bool				em_unwritten;	/* The blocks are unwritten */
+};
+
+/* Pool tag of extent paths */
+#define EXT4_EXT_PATH_POOL_TAG	'PE4E'
+
 /*
  * Inode control block
  */
@@ -50,6 +115,11 @@ struct ext4_icb {
 	struct drv_timespec		i_mtime;			/* Modification time */
 	struct drv_timespec		i_crtime;			/* Creation time */
 	struct ext4_inode *		i_buf;			/* On-disk inode buffer */
+	struct ext4_es_tree		i_es;			/* Extent status tree */
+	struct ext4_extent_path *	i_ext_path;		/*
+												 * Extent path kept from the last lookup,
+												 * freed by ext4_extent_release_path()
+												 */
 
 	struct ext4_vcb *		i_vcb;			/* The volume this ICB belongs to */
 };
@@ -64,12 +134,52 @@ struct ext4_irp_ctx {
 	PDEVICE_OBJECT		ic_real_device;		/* The real device object */
 	PFILE_OBJECT			ic_file_object;		/* The file object */
 	struct ext4_fcb *		ic_fcb;			/* Fcb object */
+	struct ext4_vcb *		ic_vcb;			/* The volume the request goes to */
+	jbd2_txn_handle_t *	ic_txn;			/* Transaction handle, NULL if none is open */
+	__u32				ic_txn_depth;		/* Nr. of ext4_txn_start() calls not stopped yet */
+	__bool				ic_txn_grow;		/* Reservation grows as blocks are logged */
 	__bool				ic_top_level;		/* If the request is top level */
 	WORK_QUEUE_ITEM	ic_wq_item;		/* Used if the request needs to be queued for later processing */
 	__bool				ic_in_exception;	/* If an exception is currently in progress */
 	NTSTATUS			ic_exception;		/* The exception code when an exception is in progress */
 };
 
+/*
+ * Fast commit being written
+ */
+struct ext4_fc_writer {
+	jbd2_handle_t *		fw_journal;		/* Journal the fast commit goes to */
+	jbd2_tid_t			fw_tid;			/* Running transaction the records extend */
+	__u8 *				fw_buf;			/* Block being filled */
+	__u32				fw_off;			/* Offset of the next record in fw_buf */
+	__u32				fw_crc;			/* Checksum of the records written so far */
+	NTSTATUS			fw_status;		/* First error met */
+};
+
+/*
+ * Fast commits found by the replay of the journal.  rs_tags holds the
+ * records of the fast commits whose tail checked out, HEAD, PAD and
+ * TAIL records left out, for the volume to apply in order.
+ */
+struct ext4_fc_replay_state {
+	__u32				rs_blocksize;	/* Block size of the journal */
+	__u8 *				rs_tags;		/* Records kept */
+	__u32				rs_len;			/* Bytes of rs_tags in use */
+	__u32				rs_max;			/* Capacity of rs_tags */
+	__u32				rs_valid;		/* Bytes of rs_tags ended by a valid tail */
+	__u32				rs_crc;			/* Checksum since the last tail */
+	__u32				rs_nr_commits;	/* Fast commits found */
+};
+
+/* Pool tag of fast commit buffers */
+#define EXT4_FC_POOL_TAG	'CF4E'
+
+/*
+ * Blocks reserved by a transaction which does not know how many it logs,
+ * and added each time it runs out
+ */
+#define EXT4_TXN_DEFAULT_BLOCKS	8
+
 EXTERN_C_START
 
 DRIVER_INITIALIZE DriverEntry;
@@ -115,8 +225,120 @@ void ext4_cache_repin_bcb(void *bcb);
 
 void ext4_cache_unpin_repinned_bcb(void *bcb);
 
+/*
+ * ext4_es.c
+ */
+
+void ext4_es_init(struct ext4_es_tree *tree);
+
+void ext4_es_release(struct ext4_es_tree *tree);
+
+__bool ext4_es_lookup(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	struct ext4_es *es,
+	__u32 *seq);
+
+void ext4_es_insert(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len,
+	ext4_fsblk_t pblk,
+	__u32 status,
+	__u32 seq);
+
+NTSTATUS ext4_es_insert_delayed(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len,
+	ext4_lblk_t *nr_delayed);
+
+ext4_lblk_t ext4_es_remove(
+	struct ext4_es_tree *tree,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len);
+
+/*
+ * ext4_extent.c
+ */
+
+void ext4_extent_init_path_cache(void);
+
+void ext4_extent_destroy_path_cache(void);
+
+void ext4_extent_release_path(struct ext4_inode_ref *inode_ref);
+
+int ext4_extent_map_range(
+	struct ext4_inode_ref *inode_ref,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len,
+	struct ext4_extent_map *maps,
+	__u32 max_maps,
+	__u32 *nr_maps,
+	ext4_lblk_t *next_lblk);
+
+/*
+ * ext4_fc.c
+ */
+
+NTSTATUS ext4_fc_begin(
+	struct ext4_fc_writer *fw,
+	jbd2_handle_t *journal);
+
+NTSTATUS ext4_fc_add_range(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	struct ext4_extent *ex);
+
+NTSTATUS ext4_fc_del_range(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	ext4_lblk_t lblk,
+	ext4_lblk_t len);
+
+NTSTATUS ext4_fc_add_inode(
+	struct ext4_fc_writer *fw,
+	ext4_ino_t ino,
+	struct ext4_inode *raw_inode,
+	__u32 inode_size);
+
+NTSTATUS ext4_fc_end(struct ext4_fc_writer *fw);
+
+void ext4_fc_replay_init(
+	struct ext4_fc_replay_state *state,
+	__u32 blocksize);
+
+NTSTATUS ext4_fc_replay_scan(
+	void *context,
+	jbd2_tid_t expected_tid,
+	jbd2_logblk_t blk_off,
+	void *buf);
+
+void ext4_fc_replay_release(struct ext4_fc_replay_state *state);
+
+/*
+ * ext4_fsctrl.c
+ */
+
+NTSTATUS ext4_fsctrl(struct ext4_irp_ctx *irp_ctx);
+
+_Dispatch_type_(IRP_MJ_FILE_SYSTEM_CONTROL)
+DRIVER_DISPATCH ext4_fsd_fsctrl;
+
 /*
  * ext4_txn.c
  */
 
+NTSTATUS ext4_txn_start(
+	struct ext4_irp_ctx *irp_ctx,
+	ext4_lblk_t blk_cnt);
+
+NTSTATUS ext4_txn_get_write_access(
+	struct ext4_irp_ctx *irp_ctx,
+	ext4_fsblk_t blocknr,
+	void *bcb,
+	void *buf);
+
+NTSTATUS ext4_txn_stop(struct ext4_irp_ctx *irp_ctx);
+
 EXTERN_C_END
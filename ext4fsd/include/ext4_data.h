@@ -15,5 +15,7 @@ extern FS_FILTER_CALLBACKS ext4_fs_filter_callbacks;
 extern CACHE_MANAGER_CALLBACKS ext4_cache_manager_callbacks;
 extern CACHE_MANAGER_CALLBACKS ext4_cache_manager_noop_callbacks;
 
+extern NPAGED_LOOKASIDE_LIST ext4_ext_path_cache;
+
 #define EXT4_DISK_DEVICE_NAME L"\\Ext4Fsd"
 #define EXT4_CDROM_DEVICE_NAME L"\\Ext4CdromFsd"
@@ -473,6 +473,7 @@ struct ext4_super_block {
 #define EXT4_FEATURE_COMPAT_RESIZE_INODE		0x0010
 #define EXT4_FEATURE_COMPAT_DIR_INDEX			0x0020
 #define EXT4_FEATURE_COMPAT_SPARSE_SUPER2		0x0200
+#define EXT4_FEATURE_COMPAT_FAST_COMMIT		0x0400
 
 #define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER	0x0001
 #define EXT4_FEATURE_RO_COMPAT_LARGE_FILE		0x0002
@@ -567,6 +568,7 @@ EXT4_FEATURE_COMPAT_FUNCS(xattr, EXT_ATTR)
 EXT4_FEATURE_COMPAT_FUNCS(resize_inode, RESIZE_INODE)
 EXT4_FEATURE_COMPAT_FUNCS(dir_index, DIR_INDEX)
 EXT4_FEATURE_COMPAT_FUNCS(sparse_super2, SPARSE_SUPER2)
+EXT4_FEATURE_COMPAT_FUNCS(fast_commit, FAST_COMMIT)
 
 EXT4_FEATURE_RO_COMPAT_FUNCS(sparse_super, SPARSE_SUPER)
 EXT4_FEATURE_RO_COMPAT_FUNCS(large_file, LARGE_FILE)
@@ -944,4 +946,79 @@ static inline void ext4_idx_store_lblk(struct ext4_extent_idx *ix, ext4_lblk_t l
 	ix->ei_block = cpu_to_le32(lb);
 }
 
+/*
+ * Fast commit tags
+ */
+#define EXT4_FC_TAG_ADD_RANGE		0x0001
+#define EXT4_FC_TAG_DEL_RANGE		0x0002
+#define EXT4_FC_TAG_CREAT			0x0003
+#define EXT4_FC_TAG_LINK			0x0004
+#define EXT4_FC_TAG_UNLINK			0x0005
+#define EXT4_FC_TAG_INODE			0x0006
+#define EXT4_FC_TAG_PAD				0x0007
+#define EXT4_FC_TAG_TAIL			0x0008
+#define EXT4_FC_TAG_HEAD			0x0009
+
+/* Fast commit features known to this driver */
+#define EXT4_FC_SUPPORTED_FEATURES	0x0
+
+/*
+ * Tag and length of a fast commit record, followed by fc_len bytes
+ * of value.  The records of a block end exactly at its end.
+ */
+struct ext4_fc_tl {
+	__le16	fc_tag;
+	__le16	fc_len;
+};
+
+/*
+ * Value of EXT4_FC_TAG_HEAD, the first record of the fast commit area
+ */
+struct ext4_fc_head {
+	__le32	fc_features;
+	__le32	fc_tid;
+};
+
+/*
+ * Value of EXT4_FC_TAG_ADD_RANGE
+ */
+struct ext4_fc_add_range {
+	__le32	fc_ino;
+	__u8	fc_ex[12];		/* struct ext4_extent mapped by the inode */
+};
+
+/*
+ * Value of EXT4_FC_TAG_DEL_RANGE
+ */
+struct ext4_fc_del_range {
+	__le32	fc_ino;
+	__le32	fc_lblk;
+	__le32	fc_len;
+};
+
+/*
+ * Value of EXT4_FC_TAG_CREAT, EXT4_FC_TAG_LINK and EXT4_FC_TAG_UNLINK,
+ * followed by the name
+ */
+struct ext4_fc_dentry_info {
+	__le32	fc_parent_ino;
+	__le32	fc_ino;
+};
+
+/*
+ * Value of EXT4_FC_TAG_INODE, followed by the on-disk inode
+ */
+struct ext4_fc_inode {
+	__le32	fc_ino;
+};
+
+/*
+ * Value of EXT4_FC_TAG_TAIL, which ends a fast commit.  fc_crc is the
+ * crc32c of all the records since the previous tail, up to fc_tid.
+ */
+struct ext4_fc_tail {
+	__le32	fc_tid;
+	__le32	fc_crc;
+};
+
 #pragma pack(pop)
\ No newline at end of file
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+#pragma once
+
+/*
+ * File system control codes of Ext4Fsd and the records they return.
+ *
+ * The records are little-endian with fixed-width fields only, so that a
+ * copy of one saved on Windows can be decoded elsewhere.  __u32, __s32
+ * and __u64 have to be defined before this header is included.
+ */
+
+#ifdef CTL_CODE
+#define FSCTL_EXT4_QUERY_JOURNAL_STATS \
+	CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 0xA00, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#endif
+
+/* Version of struct ext4_journal_stats */
+#define EXT4_JOURNAL_STATS_VERSION	1
+
+/**
+ * @brief Output of FSCTL_EXT4_QUERY_JOURNAL_STATS
+ *
+ * The js_replay_* fields describe the recovery run when the volume was
+ * mounted, the js_commit_* fields the commits since.  Times are in
+ * microseconds.
+ */
+struct ext4_journal_stats {
+	__u32		js_version;				/* EXT4_JOURNAL_STATS_VERSION */
+	__u32		js_size;				/* sizeof(struct ext4_journal_stats) */
+
+	/* Recovery */
+	__s32		js_replay_status;		/* NTSTATUS of the recovery */
+	__u32		js_replay_nr_txns;		/* Committed transactions scanned */
+	__u32		js_replay_nr_log_blocks;/* Log blocks read while scanning */
+	__u32		js_replay_nr_recs;		/* Blocks logged by those transactions */
+	__u32		js_replay_nr_replayed;	/* Blocks written back to the volume */
+	__u32		js_replay_nr_superseded;/* Blocks skipped for a newer copy */
+	__u32		js_replay_nr_revoked;	/* Blocks skipped due to revocation */
+	__u32		js_replay_nr_fc_blocks;	/* Fast commit blocks replayed */
+	__u64		js_replay_bytes_read;	/* Bytes of the log read */
+	__u64		js_replay_scan_us;		/* Time spent scanning the log */
+	__u64		js_replay_dedup_us;		/* Time spent reducing the index */
+	__u64		js_replay_write_us;		/* Time spent writing blocks back */
+	__u64		js_replay_fc_us;		/* Time spent on the fast commit area */
+
+	/* Commits */
+	__u64		js_commit_nr_commits;	/* Transactions committed */
+	__u64		js_commit_nr_blocks;	/* Blocks logged by those transactions */
+	__u64		js_commit_us;			/* Time spent committing */
+	__u64		js_commit_nr_fc_commits;/* Fast commits written */
+	__u64		js_commit_nr_log_wraps;	/* Transactions split by the end of the log */
+	__u32		js_commit_log_blocks;	/* Size of the logging area */
+	__u32		js_commit_log_used;		/* Blocks of the logging area in use */
+};
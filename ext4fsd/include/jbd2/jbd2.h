@@ -38,8 +38,7 @@ struct jbd2_handle;
  * @brief Node type of in-tree entries
  */
 enum jbd2_node_type {
-	JBD2_NODE_LBCB,
-	JBD2_NODE_REVOKE
+	JBD2_NODE_LBCB
 };
 
 /**
@@ -64,7 +63,13 @@ typedef struct jbd2_lbcb {
 	void *					jl_bcb;				/* The bcb to be logged */
 	void *					jl_data;			/* Data field of bcb logged */
 
+	__bool					jl_writing;			/* Being written back by checkpoint */
+
 	struct jbd2_txn *		jl_txn;				/* The transaction this LBCB belongs to */
+	struct jbd2_txn *		jl_next_txn;		/*
+												 * The running transaction which logged
+												 * this LBCB again while jl_txn commits
+												 */
 	struct jbd2_txn *		jl_cp_txn;			/*
 												 * The the most recent transaction on checkpoint
 												 * queue this LBCB belonged to 
@@ -78,26 +83,36 @@ typedef struct jbd2_lbcb {
 } jbd2_lbcb_t;
 
 /**
- * @brief  Revoke entry
+ * @brief  Revoke entry, a slot of the revoke table
  */
 typedef struct jbd2_revoke_entry {
-	struct jbd2_node_hdr	re_header;		/* Node header of LBCB */
-	__bool					re_is_new;		/* Whether the revoke entry is new or not */
+	jbd2_fsblk_t			re_block;		/* Block nr. revoked */
 	jbd2_tid_t				re_tid;			/*
 											 * For any transaction id smaller
 											 * than trans_id, records of @block
 											 * in those transactions should not
 											 * be replayed
 											 */
+	__u32					re_gen;			/* Slot is in use if equal to rt_gen */
 } jbd2_revoke_entry_t;
 
+/**
+ * @brief  Revoke table, an open-addressing hash of revoke entries
+ */
+typedef struct jbd2_revoke_table {
+	jbd2_revoke_entry_t *	rt_slots;		/* Slots, a power of 2 of them */
+	__u32					rt_mask;		/* Nr. of slots - 1 */
+	__u32					rt_count;		/* Nr. of slots in use */
+	__u32					rt_gen;			/* Current generation of the table */
+} jbd2_revoke_table_t;
+
 /**
  * @brief JBD2 transaction unit
  */
 typedef struct jbd2_txn {
 	jbd2_tid_t				jt_tid;				/* Transaction ID */
 	jbd2_logblk_t			jt_start_blk;		/* Start of log block */
-	jbd2_logblk_t			jt_reserved_cnt;	/* Reserved block count of this transaction */
+	drv_atomic_t			jt_reserved_cnt;	/* Reserved block count of this transaction */
 	drv_atomic_t			jt_logged_cnt;		/* Logged block count of this transaction */
 
 	enum jbd2_txn_state		jt_state;			/* State of transaction */
@@ -106,10 +121,24 @@ typedef struct jbd2_txn {
 	LIST_ENTRY				jt_lbcb_list;		/* List of LBCB held by this transaction */
 	drv_atomic_t			jt_unwritten_cnt;	/* Unwritten block count of this transaction */
 
+	jbd2_logblk_t			jt_log_cnt;			/* Log blocks taken by this transaction */
+	__u64					jt_start_time;		/* Interrupt time the transaction started at */
+	LIST_ENTRY				jt_cp_list;			/* List of LBCB to be checkpointed */
+	LIST_ENTRY				jt_waiters;			/* Waiters for the commit of this transaction */
+
 	struct jbd2_handle *	jt_handle;			/* The log handle this transaction belongs to */
 	LIST_ENTRY				jt_list_node;		/* List node */
 } jbd2_txn_t;
 
+/**
+ * @brief Waiter for the commit of a transaction
+ */
+typedef struct jbd2_waiter {
+	KEVENT *				jw_event;			/* Event signaled once the commit is done */
+	NTSTATUS *				jw_status;			/* Result of the commit */
+	LIST_ENTRY				jw_list_node;		/* Chain node in jt_waiters */
+} jbd2_waiter_t;
+
 /**
  * @brief Handle to JBD2 transaction handle
  */
@@ -121,6 +150,81 @@ typedef struct jbd2_txn_handle {
 
 typedef RB_HEAD(jbd2_generic_table, jbd2_node_hdr) jbd2_generic_table_t;
 
+/* Nr. of shards of the LBCB table */
+#define JBD2_LBCB_SHARD_BITS	6
+#define JBD2_LBCB_SHARDS		(1 << JBD2_LBCB_SHARD_BITS)
+
+/**
+ * @brief Shard of the LBCB table
+ */
+typedef struct jbd2_lbcb_shard {
+	drv_mutex_t				ls_lock;		/* Lock of the shard and the LBCBs in it */
+	jbd2_generic_table_t	ls_table;		/* LBCBs whose block nr. hashes to the shard */
+} jbd2_lbcb_shard_t;
+
+/**
+ * @brief Statistics of the last journal replay
+ */
+typedef struct jbd2_replay_stats {
+	NTSTATUS				rs_status;			/* Result of the replay */
+	__u32					rs_nr_txns;			/* Committed transactions found */
+	__u32					rs_nr_log_blocks;	/* Log blocks read while scanning */
+	__u32					rs_nr_windows;		/* Log windows mapped */
+	__u32					rs_nr_recs;			/* Blocks logged by committed transactions */
+	__u32					rs_nr_revoke_recs;	/* Revoke records of committed transactions */
+	__u32					rs_nr_superseded;	/* Logged blocks skipped for a newer copy */
+	__u32					rs_nr_revoked;		/* Logged blocks skipped due to revocation */
+	__u32					rs_nr_replayed;		/* Blocks written to client file */
+	__u32					rs_nr_fc_blocks;	/* Fast commit blocks handed to the client */
+	__u64					rs_bytes_read;		/* Bytes of the log file mapped */
+	__u64					rs_scan_us;			/* Time spent scanning the log */
+	__u64					rs_dedup_us;		/* Time spent reducing the index */
+	__u64					rs_replay_us;		/* Time spent writing blocks back */
+	__u64					rs_fc_us;			/* Time spent replaying the fast commit area */
+} jbd2_replay_stats_t;
+
+/**
+ * @brief Commit statistics of a journal handle
+ */
+typedef struct jbd2_commit_stats {
+	__u64					cs_nr_commits;		/* Transactions committed */
+	__u64					cs_nr_blocks;		/* Blocks logged by those transactions */
+	__u64					cs_commit_us;		/* Time spent committing */
+	__u64					cs_elapsed_us;		/* Time since the handle was opened */
+	__u32					cs_commits_per_ksec;/* Commits per 1000 seconds */
+	__u32					cs_avg_txn_blocks;	/* Average blocks per transaction */
+	__u32					cs_avg_commit_us;	/* Average time of a commit */
+	__u64					cs_nr_fc_commits;	/* Fast commits written */
+	__u64					cs_nr_fc_blocks;	/* Blocks written by those fast commits */
+	__u32					cs_log_blocks;		/* Size of the logging area */
+	__u32					cs_log_used_blocks;	/* Blocks of the logging area in use */
+	__u32					cs_log_peak_used;	/* Most blocks in use right after a commit */
+	__u32					cs_avg_log_used;	/* Average blocks in use right after a commit */
+	__u64					cs_nr_log_wraps;	/* Transactions split by the end of the log */
+} jbd2_commit_stats_t;
+
+/**
+ * @brief	Callback replaying a block of the fast commit area
+ * @remarks	By the time it returns STATUS_NO_MORE_ENTRIES, the changes
+ *			the fast commits describe must be applied to the client
+ *			file, since the log is marked empty after that.
+ * @param context		Context given to jbd2_fc_set_replay()
+ * @param expected_tid	ID the fast commits to be replayed carry
+ * @param blk_off		Offset of the block in the fast commit area
+ * @param buf			Buffer of the block
+ * @return	STATUS_SUCCESS to be given the next block,
+ *			STATUS_NO_MORE_ENTRIES if the fast commits end here,
+ *			otherwise the replay fails.
+ */
+typedef NTSTATUS (*jbd2_fc_replay_t)(
+		void *context,
+		jbd2_tid_t expected_tid,
+		jbd2_logblk_t blk_off,
+		void *buf);
+
+/* Set in jh_updates while the running transaction is locked */
+#define JBD2_UPDATES_LOCKED		0x40000000
+
 /**
  * @brief JBD2 log handle
  */
@@ -131,6 +235,7 @@ typedef struct jbd2_handle {
 	__u32					jh_csum_seed;		/* Pre-calculated seed for checksumming */
 
 	drv_mutex_t				jh_lock;			/* Lock of the handle */
+	drv_mutex_t				jh_checkpoint_lock;	/* Serializes checkpoints and superblock updates */
 
 	__u32					jh_blocksize;		/* Block size of log file */
 	__u32					jh_blockcnt;		/* Size of of log file in blocks */
@@ -138,22 +243,66 @@ typedef struct jbd2_handle {
 	__u32					jh_max_txn;			/* Limit of journal blocks per trans */
 
 	jbd2_txn_t *			jh_running_txn;		/* Current running transaction */
+	jbd2_txn_t *			jh_committing_txn;	/* Transaction whose blocks are being written */
 	LIST_ENTRY				jh_txn_queue;		/* A queue of transaction committed */
+	jbd2_tid_t				jh_next_tid;		/* ID given to the next transaction */
+
+	__bool					jh_committing;		/* A thread is running the commit loop */
+	drv_atomic_t			jh_updates;			/*
+												 * Nr. of transaction handles open on the
+												 * running transaction, with
+												 * JBD2_UPDATES_LOCKED
+												 */
+	KEVENT					jh_updates_done;	/* Set when the last handle of a locked txn stops */
+	KEVENT					jh_txn_unlocked;	/* Cleared while the running txn is locked */
+	NTSTATUS				jh_status;			/* Error the journal was aborted with */
+	__bool					jh_needs_recovery;	/* The log holds transactions not replayed */
+
+	PKTHREAD				jh_commit_thread;	/* Thread committing in background */
+	KEVENT					jh_commit_wakeup;	/* Wakes the commit thread up */
+	__bool					jh_commit_stop;		/* Asks the commit thread to exit */
+	__s64					jh_commit_interval;	/* Age a transaction is committed at, in 100ns */
+	__u64					jh_open_time;		/* Interrupt time the handle was opened at */
+	__u64					jh_nr_commits;		/* Transactions committed */
+	__u64					jh_nr_commit_blocks;/* Blocks logged by those transactions */
+	__u64					jh_commit_time;		/* Time spent committing, in 100ns */
+
+	int						jh_tags_per_descr;	/* Nr. of tags a descriptor block holds */
+	jbd2_lbcb_t **			jh_commit_lbcbs;	/* LBCBs described by the descriptor being written */
+	struct drv_crc32_req *	jh_commit_reqs;		/* Checksum requests, one per tag */
 
 	jbd2_logblk_t			jh_start;			/* Start of logging area of journal */
 	jbd2_logblk_t			jh_end;				/* End of logging area of journal */
 
 	jbd2_logblk_t			jh_free_start;		/* Start of unused blocknr of journal */
 	jbd2_logblk_t			jh_free_end;		/* End of unused blocknr of journal */
-	jbd2_logblk_t			jh_free_blockcnt;	/* Nr. of free blocks in journal */
+	drv_atomic_t			jh_free_blockcnt;	/* Nr. of free blocks in journal */
+	LIST_ENTRY				jh_space_waiters;	/* Waiters for the commit thread to free log space */
+	__u64					jh_nr_log_allocs;	/* Log ranges allocated to transactions */
+	__u64					jh_nr_log_wraps;	/* Ranges split by the end of the log */
+	__u64					jh_log_used_sum;	/* Sum of blocks in use after each allocation */
+	jbd2_logblk_t			jh_log_peak_used;	/* Most blocks in use after an allocation */
 
 	journal_superblock_t *	jh_sb;				/* Superblock buffer */
 
-	jbd2_generic_table_t	jh_lbcb_table;		/* LBCB table logged by JBD2 */
-	jbd2_generic_table_t	jh_revoke_table;	/* Revoke table */
+	jbd2_lbcb_shard_t		jh_lbcb_shards[JBD2_LBCB_SHARDS];	/* LBCB table logged by JBD2 */
+	jbd2_revoke_table_t		jh_revoke_table;	/* Revoke table */
 
 	NPAGED_LOOKASIDE_LIST	jh_lbcb_cache;		/* Allocation cache for lbcb */
-	NPAGED_LOOKASIDE_LIST	jh_revoke_cache;	/* Allocation cache for revoke entries */
+
+	jbd2_replay_stats_t		jh_replay_stats;	/* Statistics of the last replay */
+
+	KEVENT					jh_fc_idle;			/* Cleared from jbd2_fc_begin() to jbd2_fc_end() */
+	jbd2_logblk_t			jh_fc_first;		/* First block of fast commit area */
+	jbd2_logblk_t			jh_fc_blockcnt;		/* Size of fast commit area, 0 if disabled */
+	jbd2_logblk_t			jh_fc_off;			/* Next block of the area to be written */
+	jbd2_logblk_t			jh_fc_start;		/* First block of the fast commit in progress */
+	jbd2_tid_t				jh_fc_tid;			/* Transaction the fast commits in the area extend */
+	void *					jh_fc_bcb;			/* Bcb of the fast commit block being filled */
+	__u64					jh_nr_fc_commits;	/* Fast commits written */
+	__u64					jh_nr_fc_blocks;	/* Blocks written by those fast commits */
+	jbd2_fc_replay_t		jh_fc_replay;		/* Replays the fast commit area for the client */
+	void *					jh_fc_replay_ctx;	/* Context of jh_fc_replay */
 
 	void					(*after_commit)(	/* After commit callback */
 								struct jbd2_handle *handle,
@@ -161,12 +310,136 @@ typedef struct jbd2_handle {
 							);
 } jbd2_handle_t;
 
+/**
+ * @brief Whether the journal uses checksum v2 or v3
+ * @param handle	Handle to journal file
+ * @return TRUE if either JBD2_FEATURE_INCOMPAT_CSUM_V2 or
+ *		JBD2_FEATURE_INCOMPAT_CSUM_V3 is set
+ */
+static inline __bool jbd2_has_csum_v2or3(jbd2_handle_t *handle)
+{
+	return jbd2_has_feature_csum2(handle->jh_sb) ||
+		jbd2_has_feature_csum3(handle->jh_sb);
+}
+
+/* Checksum v1 only counts if v2 and v3 are off, as they exclude it */
+static inline __bool jbd2_has_csum_v1(jbd2_handle_t *handle)
+{
+	return jbd2_has_feature_checksum(handle->jh_sb) &&
+		!jbd2_has_csum_v2or3(handle);
+}
+
 /* JBD2 pool tags */
 #define JBD2_POOL_TAG			'2BDJ'
 #define JBD2_SUPERBLOCK_TAG		'BS2J'
 #define JBD2_RECOVER_POOL_TAG	'ER2J'
 #define JBD2_LBCB_TABLE_TAG		'TL2J'
 #define JBD2_REVOKE_TABLE_TAG	'TR2J'
+#define JBD2_TXN_TAG			'XT2J'
+#define JBD2_WAITER_TAG			'TW2J'
+#define JBD2_COMMIT_TAG			'MC2J'
+#define JBD2_CHECKPOINT_TAG		'PC2J'
+
+/* Default interval of background commits, in seconds */
+#define JBD2_DEFAULT_COMMIT_INTERVAL	5
+
+/* jbd2.c */
+
+void jbd2_init();
+
+NTSTATUS jbd2_open_handle(
+		PFILE_OBJECT client_file,
+		PFILE_OBJECT log_file,
+		__s64 log_size,
+		unsigned int blocksize,
+		jbd2_handle_t **handle_ret
+);
+
+NTSTATUS jbd2_close_handle(
+		jbd2_handle_t *handle
+);
+
+NTSTATUS jbd2_replay_journal(
+		jbd2_handle_t *handle
+);
+
+void jbd2_flush(
+		jbd2_handle_t *handle,
+		KEVENT *event,
+		NTSTATUS *status
+);
+
+void jbd2_set_commit_interval(
+		jbd2_handle_t *handle,
+		__u32 interval_sec
+);
+
+NTSTATUS jbd2_set_async_commit(
+		jbd2_handle_t *handle,
+		__bool enable
+);
+
+void jbd2_query_replay_stats(
+		jbd2_handle_t *handle,
+		jbd2_replay_stats_t *stats
+);
+
+void jbd2_query_commit_stats(
+		jbd2_handle_t *handle,
+		jbd2_commit_stats_t *stats
+);
+
+NTSTATUS jbd2_fc_enable(
+		jbd2_handle_t *handle
+);
+
+void jbd2_fc_set_replay(
+		jbd2_handle_t *handle,
+		jbd2_fc_replay_t replay,
+		void *context
+);
+
+NTSTATUS jbd2_fc_begin(
+		jbd2_handle_t *handle,
+		jbd2_tid_t *tid,
+		jbd2_logblk_t *blk_off
+);
+
+NTSTATUS jbd2_fc_get_block(
+		jbd2_handle_t *handle,
+		void **buf
+);
+
+NTSTATUS jbd2_fc_end(
+		jbd2_handle_t *handle,
+		__bool commit
+);
+
+jbd2_logblk_t jbd2_txn_handle_max_blocks(
+		jbd2_handle_t *handle
+);
+
+NTSTATUS jbd2_txn_handle_start(
+		jbd2_handle_t *handle,
+		jbd2_logblk_t nr_blocks,
+		jbd2_txn_handle_t **txn_handle_ret
+);
+
+NTSTATUS jbd2_txn_handle_extend(
+		jbd2_txn_handle_t *txn_handle,
+		jbd2_logblk_t nr_blocks
+);
+
+NTSTATUS jbd2_txn_handle_log(
+		jbd2_txn_handle_t *txn_handle,
+		jbd2_fsblk_t blocknr,
+		void *bcb,
+		void *data
+);
+
+NTSTATUS jbd2_txn_handle_stop(
+		jbd2_txn_handle_t *txn_handle
+);
 
 /* jbd2_cachesup.c */
 
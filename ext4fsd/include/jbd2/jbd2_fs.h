@@ -160,7 +160,13 @@ typedef struct journal_superblock_s {
 	/* 0x0050 */
 	__u8				s_checksum_type;			/* checksum type */
 	__u8				s_padding2[3];
-	__u32				s_padding[42];
+
+	/* 0x0054 */
+	__be32				s_num_fc_blks;				/* Nr. of fast commit blocks */
+	__be32				s_head;						/* blocknr of head of log, only
+													 * up to date when the log is empty */
+	/* 0x005C */
+	__u32				s_padding[40];
 	__be32				s_checksum;					/* crc32c(superblock) */
 
 	/* 0x0100 */
@@ -175,10 +181,15 @@ typedef struct journal_superblock_s {
 #define JBD2_FEATURE_INCOMPAT_ASYNC_COMMIT	0x00000004
 #define JBD2_FEATURE_INCOMPAT_CSUM_V2		0x00000008
 #define JBD2_FEATURE_INCOMPAT_CSUM_V3		0x00000010
+#define JBD2_FEATURE_INCOMPAT_FAST_COMMIT	0x00000020
 
 /* See "journal feature predicate functions" below */
 
-/* Features known to this kernel version: */
+/*
+ * Features known to this kernel version.  Fast commits are left out
+ * until the file system emits them and registers a replay callback
+ * which applies them; until then a journal which has them is refused.
+ */
 #define JBD2_KNOWN_COMPAT_FEATURES		JBD2_FEATURE_COMPAT_CHECKSUM
 #define JBD2_KNOWN_ROCOMPAT_FEATURES	0
 #define JBD2_KNOWN_INCOMPAT_FEATURES	(JBD2_FEATURE_INCOMPAT_REVOKE | \
@@ -187,6 +198,12 @@ typedef struct journal_superblock_s {
 					JBD2_FEATURE_INCOMPAT_CSUM_V2 | \
 					JBD2_FEATURE_INCOMPAT_CSUM_V3)
 
+/* Size of the fast commit area if s_num_fc_blks is 0 */
+#define JBD2_DEFAULT_FAST_COMMIT_BLOCKS	256
+
+/* Nr. of blocks the log must keep besides the fast commit area */
+#define JBD2_MIN_JOURNAL_BLOCKS			1024
+
 #if 1
 
 /* journal feature predicate functions */
@@ -209,7 +226,7 @@ static inline void jbd2_clear_feature_##name(journal_superblock_t *sb) \
 }
 
 #define JBD2_FEATURE_RO_COMPAT_FUNCS(name, flagname) \
-static inline __bool jbd2_has_feature_##name(journal_t *sb) \
+static inline __bool jbd2_has_feature_##name(journal_superblock_t *sb) \
 { \
 	return (be32_to_cpu((sb)->s_header.h_blocktype) >= 2 && \
 		((sb)->s_feature_ro_compat & \
@@ -251,5 +268,6 @@ JBD2_FEATURE_INCOMPAT_FUNCS(64bit, 64BIT)
 JBD2_FEATURE_INCOMPAT_FUNCS(async_commit, ASYNC_COMMIT)
 JBD2_FEATURE_INCOMPAT_FUNCS(csum2, CSUM_V2)
 JBD2_FEATURE_INCOMPAT_FUNCS(csum3, CSUM_V3)
+JBD2_FEATURE_INCOMPAT_FUNCS(fast_commit, FAST_COMMIT)
 
 #endif
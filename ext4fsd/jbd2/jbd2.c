@@ -4,22 +4,84 @@
 
 #include "jbd2\jbd2.h"
 
-enum {
-	JBD2_PHASE_SCAN,
-	JBD2_PHASE_SCAN_REVOKE,
-	JBD2_PHASE_REPLAY
+/**
+ * @brief	Location of a block logged by a committed transaction
+ */
+struct jbd2_replay_rec {
+	jbd2_fsblk_t	rr_fs_blocknr;		/* Block nr. in client file */
+	jbd2_logblk_t	rr_log_blocknr;		/* Block nr. of the copy in log file */
+	jbd2_tid_t		rr_tid;				/* Transaction the copy belongs to */
+	__u32			rr_seq;				/* Position of the copy in the log */
+	__bool			rr_escaped;			/* The copy had its magic number escaped */
+};
+
+/* Initial capacity of the arrays in recovery_info */
+#define JBD2_RECOVERY_INIT_RECS		256
+
+/* s_errno of an aborted journal, -EIO as Linux records it */
+#define JBD2_ABORT_ERRNO			((__u32)-5)
+
+/**
+ * @brief	Sequential reader over the log file used by recovery
+ * @remarks	Log blocks are reached through a window mapped with
+ *			CcMapData() which runs up to the end of the cache view
+ *			(VACB_MAPPING_GRANULARITY) or the end of the logging area,
+ *			whichever comes first.  Whenever a new window is mapped,
+ *			the cache manager is asked to read the following one ahead,
+ *			wrapping to jh_start after jh_end.
+ */
+struct jbd2_log_reader {
+	jbd2_handle_t *	lr_handle;			/* Handle to journal file */
+	void *			lr_bcb;				/* Bcb of the window, NULL if none */
+	char *			lr_buf;				/* Buffer of the window */
+	jbd2_logblk_t	lr_start;			/* First log block in the window */
+	jbd2_logblk_t	lr_end;				/* Log block following the window */
+	__bool			lr_readahead;		/* Read the following window ahead */
+};
+
+/**
+ * @brief	Sequential writer over the log file used by commit
+ * @remarks	Windows are laid out like those of the reader, but pinned
+ *			with CcPreparePinWrite() and never extended past the blocks
+ *			the writer was set up for, so that log blocks still in use
+ *			are not zeroed.
+ */
+struct jbd2_log_writer {
+	jbd2_handle_t *	lw_handle;			/* Handle to journal file */
+	void *			lw_bcb;				/* Bcb of the window, NULL if none */
+	char *			lw_buf;				/* Buffer of the window */
+	jbd2_logblk_t	lw_start;			/* First log block in the window */
+	jbd2_logblk_t	lw_end;				/* Log block following the window */
+	jbd2_logblk_t	lw_left;			/* Blocks to write not mapped yet */
 };
 
  /**
-  * @details	Maintain information about the progress of the recovery job, so that
-  *				the different passes can carry information between them.
-  * @remarks	Copied from e2fsprogs/e2fsck/recovery.c
+  * @details	Maintain information about the progress of the recovery job.
+  * @remarks	Based on e2fsprogs/e2fsck/recovery.c
   */
 struct recovery_info {
 	jbd2_tid_t	ri_start_txn;
 	jbd2_tid_t	ri_end_txn;
 
 	__bool		ri_has_txn;
+
+	struct jbd2_replay_rec *ri_recs;	/* Index of logged blocks, in log order */
+	size_t		ri_nr_recs;				/* Nr. of records in ri_recs */
+	size_t		ri_nr_committed;		/* Nr. of records of committed transactions */
+	size_t		ri_max_recs;			/* Capacity of ri_recs */
+
+	jbd2_fsblk_t *ri_revokes;			/* Revokes of the transaction being scanned */
+	size_t		ri_nr_revokes;			/* Nr. of entries in ri_revokes */
+	size_t		ri_max_revokes;			/* Capacity of ri_revokes */
+
+	__u32		ri_crc32_sum;			/* Checksum v1 of the transaction being scanned */
+	__bool		ri_crc32_seen;			/* A commit block with a v1 checksum was found */
+	__bool		ri_torn;				/* A block of the transaction being scanned
+										 * does not match its tag checksum */
+
+	struct jbd2_log_reader ri_reader;	/* Reader over the log file */
+	void *		ri_descr_buf;			/* Copy of the descriptor being scanned */
+	struct drv_crc32_req *ri_csum_reqs;	/* Checksum requests, one per tag */
 };
 
 /*
@@ -97,40 +159,33 @@ jbd2_lbcb_free(
 	ExFreeToNPagedLookasideList(&handle->jh_lbcb_cache, lbcb);
 }
 
-/**
- * @brief	Allocate memory for caller-supplied data plus some
- *			additional memory for use by the revoke table entry
- * @param handle Handle to journal file
- * @return Allocated buffer address
- */
-static jbd2_revoke_entry_t *
-jbd2_revoke_entry_alloc(jbd2_handle_t *handle)
-{
-	return ExAllocateFromNPagedLookasideList(
-				&handle->jh_revoke_cache);
-}
+RB_GENERATE(jbd2_generic_table, jbd2_node_hdr, th_node, jbd2_generic_table_cmp);
 
 /**
- * @brief Deallocate memory for elements to be deleted
+ * @brief	Return the shard of the LBCB table which holds the LBCB of
+ *			@p blocknr
+ * @remarks	Fibonacci hashing spreads runs of adjacent blocks, which
+ *			are often logged together, over all the shards.
  * @param handle	Handle to journal file
- * @param re		A pointer to the revoke entry that is being deallocated
+ * @param blocknr	Block number
+ * @return	The shard
  */
-static void
-jbd2_revoke_entry_free(
+static jbd2_lbcb_shard_t *
+jbd2_lbcb_shard(
 	jbd2_handle_t *handle,
-	jbd2_revoke_entry_t *re
-)
+	jbd2_fsblk_t blocknr)
 {
-	ExFreeToNPagedLookasideList(&handle->jh_revoke_cache, re);
-}
+	__u64 hash = (__u64)blocknr * 0x9E3779B97F4A7C15ULL;
 
-RB_GENERATE(jbd2_generic_table, jbd2_node_hdr, th_node, jbd2_generic_table_cmp);
+	return &handle->jh_lbcb_shards[hash >> (64 - JBD2_LBCB_SHARD_BITS)];
+}
 
 /**
  * @brief	Get and reference an LBCB from LBCB table which represents
  *			given @p blocknr. 
  *			If the LBCB doesn't exist, an LBCB will be allocated an inserted into
  *			the LBCB table, and its jl_is_new flag will be set to TRUE.
+ * @remarks	The lock of the shard of @p blocknr must be held.
  * @param handle	Handle to journal file
  * @param blocknr	Block number
  * @return an LBCB
@@ -152,12 +207,14 @@ jbc2_lbcb_get(
 
 	lbcb_ret = (jbd2_lbcb_t *)RB_INSERT(
 							jbd2_generic_table,
-							&handle->jh_lbcb_table,
+							&jbd2_lbcb_shard(handle, blocknr)->ls_table,
 							&lbcb_tmp->jl_header);
-	if (lbcb_ret != lbcb_tmp) {
+	if (lbcb_ret) {
 		/* If there's already an existing node, free the temporary node */
 		jbd2_lbcb_free(handle, lbcb_tmp);
 		lbcb_ret->jl_is_new = FALSE;
+	} else {
+		lbcb_ret = lbcb_tmp;
 	}
 	/* Increment the reference count of the returned object */
 	drv_atomic_inc(&lbcb_ret->jl_header.th_refcount);
@@ -166,6 +223,7 @@ jbc2_lbcb_get(
 
 /**
  * @brief	Dereference an LBCB
+ * @remarks	The lock of the shard of the LBCB must be held.
  * @param handle	Handle to journal file
  * @param lbcb		The LBCB caller got from jbc2_lbcb_get()
  */
@@ -175,127 +233,193 @@ jbd2_lbcb_put(
 	jbd2_lbcb_t *lbcb
 )
 {
-	if (!drv_atomic_sub_and_test(&lbcb->jl_header.th_refcount, 1)) {
+	if (drv_atomic_sub_and_test(&lbcb->jl_header.th_refcount, 1)) {
 		RB_REMOVE(
 			jbd2_generic_table,
-			&handle->jh_lbcb_table,
+			&jbd2_lbcb_shard(handle, lbcb->jl_header.th_block)->ls_table,
 			&lbcb->jl_header);
 		jbd2_lbcb_free(handle, lbcb);
 	}
 }
 
+/*
+ * The revoke table is an open-addressing hash with linear probing,
+ * keyed by block number.  All the slots live in one array; a slot is
+ * in use only if its generation matches the table's, so clearing the
+ * table just starts a new generation.
+ */
+#define JBD2_REVOKE_TABLE_INIT_SLOTS	1024
+
+static __u32
+jbd2_revoke_hash(jbd2_revoke_table_t *table, jbd2_fsblk_t blocknr)
+{
+	return (__u32)((blocknr * 0x9E3779B97F4A7C15ULL) >> 32) & table->rt_mask;
+}
+
 /**
- * @brief	Get and reference revoke entry from revoke entry table which
- *			represents given @p blocknr.
- *			If the LBCB doesn't exist, an LBCB will be allocated an inserted into
- *			the LBCB table, and its jl_is_new flag will be set to TRUE.
- * @param handle	Handle to journal file
- * @param blocknr	Block number
- * @return an LBCB
+ * @brief	Find the slot of @p blocknr, or the free slot where it
+ *			would be inserted
  */
 static jbd2_revoke_entry_t *
-jbd2_revoke_entry_get(
-	jbd2_handle_t *handle,
+jbd2_revoke_table_slot(
+	jbd2_revoke_table_t *table,
 	jbd2_fsblk_t blocknr)
 {
-	jbd2_revoke_entry_t *re_tmp, *re_ret;
-	re_tmp = jbd2_revoke_entry_alloc(handle);
-	if (!re_tmp)
-		return NULL;
+	__u32 i = jbd2_revoke_hash(table, blocknr);
 
-	re_tmp->re_header.th_block = blocknr;
-	re_tmp->re_header.th_node_type = JBD2_NODE_REVOKE;
-	drv_atomic_init(&re_tmp->re_header.th_refcount, 0);
-	re_tmp->re_is_new = TRUE;
+	while (table->rt_slots[i].re_gen == table->rt_gen &&
+	       table->rt_slots[i].re_block != blocknr)
+		i = (i + 1) & table->rt_mask;
 
-	re_ret = (jbd2_revoke_entry_t *)RB_INSERT(
-								jbd2_generic_table,
-								&handle->jh_revoke_table,
-								&re_tmp->re_header);
-	if (re_ret != re_tmp) {
-		/* If there's already an existing node, free the temporary node */
-		jbd2_revoke_entry_free(handle, re_tmp);
-		re_ret->re_is_new = FALSE;
+	return &table->rt_slots[i];
+}
+
+/**
+ * @brief	Allocate a slot array of @p nr_slots and move the entries
+ *			in use into it
+ * @param table		Revoke table
+ * @param nr_slots	Nr. of slots, must be a power of 2
+ * @return	STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES
+ */
+static NTSTATUS
+jbd2_revoke_table_resize(
+	jbd2_revoke_table_t *table,
+	__u32 nr_slots)
+{
+	jbd2_revoke_entry_t *old_slots = table->rt_slots;
+	__u32 i, old_nr_slots = table->rt_slots ? table->rt_mask + 1 : 0;
+	__u32 old_gen = table->rt_gen;
+
+	table->rt_slots = ExAllocatePoolWithTag(
+				NonPagedPool,
+				nr_slots * sizeof(jbd2_revoke_entry_t),
+				JBD2_REVOKE_TABLE_TAG);
+	if (!table->rt_slots) {
+		table->rt_slots = old_slots;
+		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	/* Increment the reference count of the returned object */
-	drv_atomic_inc(&re_ret->re_header.th_refcount);
-	return re_ret;
+
+	RtlZeroMemory(table->rt_slots, nr_slots * sizeof(jbd2_revoke_entry_t));
+	table->rt_mask = nr_slots - 1;
+	table->rt_gen = 1;
+
+	for (i = 0; i < old_nr_slots; i++) {
+		jbd2_revoke_entry_t *re;
+
+		if (old_slots[i].re_gen != old_gen)
+			continue;
+
+		re = jbd2_revoke_table_slot(table, old_slots[i].re_block);
+		*re = old_slots[i];
+		re->re_gen = table->rt_gen;
+	}
+
+	if (old_slots)
+		ExFreePoolWithTag(old_slots, JBD2_REVOKE_TABLE_TAG);
+	return STATUS_SUCCESS;
 }
 
-/*
- * @brief	Get and reference revoke entry from revoke entry table which
- *			represents given @p blocknr.
+/**
+ * @brief	Record that the copies of @p blocknr logged by transaction
+ *			@p tid or earlier must not be replayed
  * @param handle	Handle to journal file
  * @param blocknr	Block number
- * @return	an LBCB if it exists in the revoke entry table,
- * 			otherwise NULL is returned
+ * @param tid		Transaction ID of the revoke record
+ * @return	STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES
  */
-static jbd2_revoke_entry_t *
-jbd2_revoke_entry_find(
+static NTSTATUS
+jbd2_revoke_table_insert(
 	jbd2_handle_t *handle,
-	jbd2_fsblk_t blocknr)
+	jbd2_fsblk_t blocknr,
+	jbd2_tid_t tid)
 {
-	jbd2_revoke_entry_t re_tmp, *re_ret;
-	re_tmp.re_header.th_block = blocknr;
-	re_tmp.re_header.th_node_type = JBD2_NODE_REVOKE;
-
-	re_ret = (jbd2_revoke_entry_t *)RB_FIND(
-								jbd2_generic_table,
-								&handle->jh_revoke_table,
-								&re_tmp.re_header);
-	if (re_ret) {
-		/* Increment the reference count of the returned object */
-		drv_atomic_inc(&re_ret->re_header.th_refcount);
+	jbd2_revoke_table_t *table = &handle->jh_revoke_table;
+	jbd2_revoke_entry_t *re;
+
+	/* Keep the load factor under 1/2 */
+	if (!table->rt_slots || (table->rt_count + 1) * 2 > table->rt_mask + 1) {
+		NTSTATUS status;
+		status = jbd2_revoke_table_resize(
+					table,
+					table->rt_slots ?
+					(table->rt_mask + 1) * 2 :
+					JBD2_REVOKE_TABLE_INIT_SLOTS);
+		if (!NT_SUCCESS(status))
+			return status;
 	}
 
-	return re_ret;
+	re = jbd2_revoke_table_slot(table, blocknr);
+	if (re->re_gen != table->rt_gen) {
+		re->re_gen = table->rt_gen;
+		re->re_block = blocknr;
+		re->re_tid = tid;
+		table->rt_count++;
+	} else if (jbd2_tid_cmp(tid, re->re_tid) > 0) {
+		re->re_tid = tid;
+	}
+	return STATUS_SUCCESS;
 }
 
 /**
- * @brief	Dereference a revoke entry
+ * @brief	Look up the revoke record of @p blocknr
  * @param handle	Handle to journal file
- * @param lbcb		The revoke entry caller got from jbc2_revoke_entry_get()
+ * @param blocknr	Block number
+ * @param tid		Transaction ID of the revoke record returned
+ * @return	TRUE if @p blocknr has a revoke record
  */
-static void
-jbd2_revoke_entry_put(
+static __bool
+jbd2_revoke_table_lookup(
 	jbd2_handle_t *handle,
-	jbd2_revoke_entry_t *re
-)
+	jbd2_fsblk_t blocknr,
+	jbd2_tid_t *tid)
 {
-	if (!drv_atomic_sub_and_test(&re->re_header.th_refcount, 1)) {
-		RB_REMOVE(
-			jbd2_generic_table,
-			&handle->jh_revoke_table,
-			&re->re_header);
-		jbd2_revoke_entry_free(handle, re);
-	}
+	jbd2_revoke_table_t *table = &handle->jh_revoke_table;
+	jbd2_revoke_entry_t *re;
+
+	if (!table->rt_count)
+		return FALSE;
+
+	re = jbd2_revoke_table_slot(table, blocknr);
+	if (re->re_gen != table->rt_gen)
+		return FALSE;
+
+	*tid = re->re_tid;
+	return TRUE;
 }
 
+/**
+ * @brief	Drop every revoke record.  The slots are kept for reuse.
+ * @param handle	Handle to journal file
+ */
 static void
 jbd2_revoke_table_clear(jbd2_handle_t *handle)
 {
-	jbd2_revoke_entry_t *re, *tmp;
-	RB_FOREACH_SAFE(re,
-			jbd2_generic_table,
-			&handle->jh_revoke_table,
-			tmp) {
-		jbd2_revoke_entry_put(handle, re);
+	jbd2_revoke_table_t *table = &handle->jh_revoke_table;
+
+	table->rt_count = 0;
+	if (++table->rt_gen == 0) {
+		/* Generation wrapped, so stale slots could look valid again */
+		if (table->rt_slots)
+			RtlZeroMemory(
+				table->rt_slots,
+				(table->rt_mask + 1) * sizeof(jbd2_revoke_entry_t));
+		table->rt_gen = 1;
 	}
 }
 
 /**
- * @brief Helper to calculate CRC32 checksum
- * @param buf	Buffer
- * @param bufsz	Size of buffer
- * @return CRC32 checksum of the buffer
+ * @brief	Free the slots of the revoke table
+ * @param handle	Handle to journal file
  */
-static __u32 jbd2_crc32(__u32 crc, void *buf, size_t bufsz)
+static void
+jbd2_revoke_table_destroy(jbd2_handle_t *handle)
 {
-	/*
-	 * ngkaho1234:	Not sure whether crc32/crc32c helpers
-	 * 		are provided by NT kernel...
-	 */
-	return drv_crc32(crc, buf, bufsz);
+	jbd2_revoke_table_t *table = &handle->jh_revoke_table;
+
+	if (table->rt_slots)
+		ExFreePoolWithTag(table->rt_slots, JBD2_REVOKE_TABLE_TAG);
+
+	RtlZeroMemory(table, sizeof(jbd2_revoke_table_t));
 }
 
 /**
@@ -304,7 +428,7 @@ static __u32 jbd2_crc32(__u32 crc, void *buf, size_t bufsz)
  * @param bufsz	Size of buffer
  * @return CRC32C checksum of the buffer
  */
-static __u32 jbd2_crc32c(__u32 crc, void *buf, size_t bufsz)
+static __u32 jbd2_crc32c(__u32 crc, const void *buf, size_t bufsz)
 {
 	/*
 	 * ngkaho1234:	Not sure whether crc32/crc32c helpers
@@ -313,6 +437,17 @@ static __u32 jbd2_crc32c(__u32 crc, void *buf, size_t bufsz)
 	return drv_crc32c(crc, buf, bufsz);
 }
 
+/**
+ * @brief Helper to calculate the MSB-first CRC32 of checksum v1
+ * @param buf	Buffer
+ * @param bufsz	Size of buffer
+ * @return CRC32 checksum of the buffer
+ */
+static __u32 jbd2_crc32_be(__u32 crc, const void *buf, size_t bufsz)
+{
+	return drv_crc32_be(crc, buf, bufsz);
+}
+
 static inline __u32
 jbd2_chksum(
 	jbd2_handle_t *handle,
@@ -324,6 +459,91 @@ jbd2_chksum(
 	return jbd2_crc32c(crc, buf, bufsz);
 }
 
+/**
+ * @brief	Calculate the checksum of several buffers in one call
+ * @param handle	Handle to journal file
+ * @param reqs		Array of checksum requests
+ * @param nr		Nr. of requests
+ */
+static inline void
+jbd2_chksum_multi(
+	jbd2_handle_t *handle,
+	struct drv_crc32_req *reqs,
+	int nr)
+{
+	UNREFERENCED_PARAMETER(handle);
+	drv_crc32c_multi(reqs, nr);
+}
+
+/**
+ * @brief	Advance a checksum state across @p len zero bytes, so that
+ *			jbd2_chksum(handle, crc, buf, len) ==
+ *			jbd2_chksum_shift(handle, crc, len) ^ jbd2_chksum(handle, 0, buf, len)
+ * @param handle	Handle to journal file
+ * @param crc		Checksum state
+ * @param len		Nr. of bytes to shift over
+ * @return the shifted checksum state
+ */
+static inline __u32
+jbd2_chksum_shift(
+	jbd2_handle_t *handle,
+	__u32 crc,
+	size_t len)
+{
+	UNREFERENCED_PARAMETER(handle);
+	return drv_crc32c_shift(crc, len);
+}
+
+/**
+ * @brief	Calculate the part of a data block checksum contributed by
+ *			the UUID seed and the transaction sequence
+ * @remarks	A block tag carries crc32c(uuid + be32 sequence + block).  The
+ *			prefix is the same for every block of a transaction, so it is
+ *			shifted across the block once here and XORed into the
+ *			zero-seeded checksum of each block.
+ * @param handle	Handle to journal file
+ * @param tid		Transaction ID
+ * @return Checksum contribution of uuid + sequence
+ */
+static __u32
+jbd2_block_csum_prefix(
+	jbd2_handle_t *handle,
+	jbd2_tid_t tid)
+{
+	__be32 seq = cpu_to_be32(tid);
+	__u32 csum;
+
+	csum = jbd2_chksum(handle, handle->jh_csum_seed, &seq, sizeof(seq));
+	return jbd2_chksum_shift(handle, csum, handle->jh_blocksize);
+}
+
+/**
+ * @brief	Checksum a metadata block as if its 4-byte checksum field
+ *			were zero, without modifying the block
+ * @param handle	Handle to journal file
+ * @param buf		Block buffer
+ * @param csum_off	Offset of the checksum field in the block
+ * @return Checksum of the block
+ */
+static __u32
+jbd2_metadata_chksum(
+	jbd2_handle_t *handle,
+	void *buf,
+	size_t csum_off)
+{
+	static const __u32 zero = 0;
+	char *p = (char *)buf;
+	__u32 csum;
+
+	csum = jbd2_chksum(handle, handle->jh_csum_seed, p, csum_off);
+	csum = jbd2_chksum(handle, csum, &zero, sizeof(zero));
+	return jbd2_chksum(
+			handle,
+			csum,
+			p + csum_off + sizeof(zero),
+			handle->jh_blocksize - csum_off - sizeof(zero));
+}
+
 /**
  * @brief Verify JBD2 metadata block.
  * @param hdr	JBD2 metadata block header
@@ -385,9 +605,10 @@ static __bool jbd2_descr_block_csum_verify(
 	tail = (journal_block_tail_t *)((char *)buf + handle->jh_blocksize -
 			sizeof(journal_block_tail_t));
 	provided = tail->t_checksum;
-	tail->t_checksum = 0;
-	calculated = jbd2_chksum(handle, handle->jh_csum_seed, buf, handle->jh_blocksize);
-	tail->t_checksum = provided;
+	calculated = jbd2_metadata_chksum(
+				handle,
+				buf,
+				handle->jh_blocksize - sizeof(journal_block_tail_t));
 
 	return (provided == cpu_to_be32(calculated))
 			? TRUE : FALSE;
@@ -417,9 +638,10 @@ static __bool jbd2_commit_block_csum_verify(
 		return TRUE;
 
 	provided = commit_hdr->h_chksum[0];
-	commit_hdr->h_chksum[0] = 0;
-	calculated = jbd2_chksum(handle, handle->jh_csum_seed, buf, handle->jh_blocksize);
-	commit_hdr->h_chksum[0] = provided;
+	calculated = jbd2_metadata_chksum(
+				handle,
+				buf,
+				FIELD_OFFSET(journal_commit_header_t, h_chksum));
 
 	return (provided == cpu_to_be32(calculated))
 			? TRUE : FALSE;
@@ -450,9 +672,10 @@ static __bool jbd2_revoke_block_csum_verify(
 	tail = (journal_block_tail_t *)((char *)buf + handle->jh_blocksize -
 			sizeof(journal_block_tail_t));
 	provided = tail->t_checksum;
-	tail->t_checksum = 0;
-	calculated = jbd2_chksum(handle, handle->jh_csum_seed, buf, handle->jh_blocksize);
-	tail->t_checksum = provided;
+	calculated = jbd2_metadata_chksum(
+				handle,
+				buf,
+				handle->jh_blocksize - sizeof(journal_block_tail_t));
 
 	return (provided == cpu_to_be32(calculated))
 			? TRUE : FALSE;
@@ -479,15 +702,15 @@ size_t jbd2_min_tag_size(jbd2_handle_t *handle)
 {
 	size_t sz;
 
-	if (jbd2_has_feature_csum3(handle))
+	if (jbd2_has_feature_csum3(handle->jh_sb))
 		return sizeof(journal_block_tag3_t);
 
 	sz = sizeof(journal_block_tag_t);
 
-	if (jbd2_has_feature_csum2(handle))
+	if (jbd2_has_feature_csum2(handle->jh_sb))
 		sz += sizeof(__u16);
 
-	if (jbd2_has_feature_64bit(handle))
+	if (jbd2_has_feature_64bit(handle->jh_sb))
 		return sz;
 
 	return sz - sizeof(__u32);
@@ -504,8 +727,8 @@ jbd2_tag_blocknr(jbd2_handle_t *handle, journal_block_tag_t *tag)
 {
 	jbd2_fsblk_t blocknr = 0;
 	blocknr = be32_to_cpu(tag->t_blocknr);
-	if (jbd2_has_feature_64bit(handle))
-		blocknr |= be32_to_cpu(tag->t_blocknr_high);
+	if (jbd2_has_feature_64bit(handle->jh_sb))
+		blocknr |= (jbd2_fsblk_t)be32_to_cpu(tag->t_blocknr_high) << 32;
 
 	return blocknr;
 }
@@ -518,7 +741,7 @@ jbd2_tag_blocknr(jbd2_handle_t *handle, journal_block_tag_t *tag)
 static size_t
 jbd2_revoke_entry_size(jbd2_handle_t *handle)
 {
-	if (jbd2_has_feature_64bit(handle))
+	if (jbd2_has_feature_64bit(handle->jh_sb))
 		return sizeof(__be64);
 
 	return sizeof(__be32);
@@ -533,7 +756,7 @@ jbd2_revoke_entry_size(jbd2_handle_t *handle)
 static jbd2_fsblk_t
 jbd2_revoke_entry_blocknr(jbd2_handle_t *handle, void *entry)
 {
-	if (jbd2_has_feature_64bit(handle))
+	if (jbd2_has_feature_64bit(handle->jh_sb))
 		return be64_to_cpu(*(__be64 *)entry);
 
 	return be32_to_cpu(*(__be32 *)entry);
@@ -551,7 +774,7 @@ jbd2_tag_size(
 	void *tag)
 {
 	size_t sz = jbd2_min_tag_size(handle);
-	if (jbd2_has_feature_csum3(handle)) {
+	if (jbd2_has_feature_csum3(handle->jh_sb)) {
 		journal_block_tag3_t *tag3;
 		tag3 = (journal_block_tag3_t *)tag;
 
@@ -580,7 +803,7 @@ jbd2_test_flag(
 	void *tag,
 	int flag)
 {
-	if (jbd2_has_feature_csum3(handle)) {
+	if (jbd2_has_feature_csum3(handle->jh_sb)) {
 		journal_block_tag3_t *tag3;
 		tag3 = (journal_block_tag3_t *)tag;
 
@@ -608,7 +831,7 @@ jbd2_tag_csum(
 	void *tag)
 {
 	__u32 csum = ~0;
-	if (jbd2_has_feature_csum3(handle)) {
+	if (jbd2_has_feature_csum3(handle->jh_sb)) {
 		journal_block_tag3_t *tag3;
 		tag3 = (journal_block_tag3_t *)tag;
 
@@ -640,11 +863,12 @@ static int jbd2_count_tags(jbd2_handle_t *handle, void *buf)
 
 	tagp = (char *)buf + sizeof(journal_header_t);
 
-	for (; tagp - buf + tag_bytes <= blocksize;
-			tagp += jbd2_tag_size(handle, tagp), nr++) {
+	for (; tagp - (char *)buf + tag_bytes <= blocksize;
+			tagp += jbd2_tag_size(handle, tagp)) {
 		journal_block_tag_t *tag;
 		tag = (journal_block_tag_t *)tagp;
 
+		nr++;
 		if (jbd2_test_flag(handle, tag, JBD2_FLAG_LAST_TAG))
 			break;
 	}
@@ -653,204 +877,682 @@ static int jbd2_count_tags(jbd2_handle_t *handle, void *buf)
 }
 
 /**
- * @brief Verify checksum of the blocks mentioned in a descriptor block
+ * @brief Fill a block tag of a descriptor block
  * @param handle	Handle to journal file
- * @param tid		Transaction ID the descriptor block belongs to
- * @param blocknr	Block number of the descriptor block in log file
- * @param buf		Descriptor block buffer
- * @return	STATUS_SUCCESS indicating that the operation succeeds,
- * 		otherwise the operation fails.
+ * @param tagp		Tag to be filled
+ * @param blocknr	Block nr. in client file
+ * @param flags		JBD2_FLAG_* of the tag
+ * @param csum		Checksum of the logged block, ignored without
+ *					checksum v2 or v3
  */
-static NTSTATUS
-jbd2_blocks_csum_verify(jbd2_handle_t *handle,
-			jbd2_logblk_t blocknr,
-			void *buf)
+static void
+jbd2_tag_fill(
+	jbd2_handle_t *handle,
+	void *tagp,
+	jbd2_fsblk_t blocknr,
+	__u32 flags,
+	__u32 csum)
 {
-	char *tagp;
-	jbd2_logblk_t nr = 1;
-	NTSTATUS status = STATUS_SUCCESS;
-	int blocksize = handle->jh_blocksize;
-	int tag_bytes = jbd2_min_tag_size(handle);
+	__be32 blocknr_high = 0;
 
-	if (!jbd2_has_csum_v2or3(handle))
-		return STATUS_SUCCESS;
+	if (jbd2_has_feature_64bit(handle->jh_sb))
+		blocknr_high = cpu_to_be32((__u32)(blocknr >> 32));
 
-	tagp = (char *)buf + sizeof(journal_header_t);
+	if (jbd2_has_feature_csum3(handle->jh_sb)) {
+		journal_block_tag3_t *tag3;
+		tag3 = (journal_block_tag3_t *)tagp;
 
-	for (; tagp - buf + tag_bytes <= blocksize;
-			tagp += jbd2_tag_size(handle, tagp), nr++) {
-		__bool cc_ret;
-		__u32 calculated;
-		LARGE_INTEGER tmp;
-		journal_block_tag_t *tag;
-		jbd2_fsblk_t fs_blocknr;
-		void *from_bcb, *from_buf;
-		tag = (journal_block_tag_t *)tagp;
+		tag3->t_blocknr = cpu_to_be32((__u32)blocknr);
+		tag3->t_flags = cpu_to_be32(flags);
+		tag3->t_blocknr_high = blocknr_high;
+		tag3->t_checksum = cpu_to_be32(csum);
+	} else {
+		journal_block_tag_t *tag1;
+		tag1 = (journal_block_tag_t *)tagp;
+
+		tag1->t_blocknr = cpu_to_be32((__u32)blocknr);
+		tag1->t_flags = cpu_to_be16((__u16)flags);
+		tag1->t_checksum = 0;
+		if (jbd2_has_feature_csum2(handle->jh_sb))
+			tag1->t_checksum = cpu_to_be16((__u16)csum);
+		if (jbd2_has_feature_64bit(handle->jh_sb))
+			tag1->t_blocknr_high = blocknr_high;
+	}
 
-		fs_blocknr = jbd2_tag_blocknr(handle, tag);
+	if (!(flags & JBD2_FLAG_SAME_UUID))
+		RtlCopyMemory(
+			(char *)tagp + jbd2_min_tag_size(handle),
+			handle->jh_uuid,
+			UUID_SIZE);
+}
 
-		/*
-		 * XXX:	We do not support multiple clients, since
-		 *	as of linux 4.x multiple clients support isn't
-		 *	available
-		 */
-		tmp.QuadPart = blocknr_to_offset(
-					blocknr + nr,
-					handle->jh_blocksize);
-		cc_ret = CcPinRead(
-				handle->jh_log_file,
-				&tmp,
-				handle->jh_blocksize,
-				PIN_WAIT,
-				&from_bcb,
-				&from_buf);
-		if (!cc_ret) {
-			status = STATUS_UNEXPECTED_IO_ERROR;
-			break;
-		}
+/**
+ * @brief	Calculate the number of log blocks a transaction of
+ *			@p nr_blocks blocks takes, descriptor and commit blocks
+ *			included
+ * @param handle	Handle to journal file
+ * @param nr_blocks	Nr. of blocks logged by the transaction
+ */
+static jbd2_logblk_t
+jbd2_txn_log_blocks(
+	jbd2_handle_t *handle,
+	jbd2_logblk_t nr_blocks)
+{
+	jbd2_logblk_t nr_descr;
 
-		if (jbd2_has_feature_csum2(handle)) {
-			calculated = jbd2_chksum(
-							handle,
-							handle->jh_csum_seed,
-							from_buf,
-							handle->jh_blocksize) & 0xffff;
-		} else {
-			calculated = jbd2_chksum(
-							handle,
-							handle->jh_csum_seed,
-							from_buf,
-							handle->jh_blocksize);
-		}
-		if (calculated != jbd2_tag_csum(handle, tag)) {
-			dbg_print("Checksum calculation fails on handle %p\n", handle);
-			status = STATUS_UNSUCCESSFUL;
-		}
+	if (!nr_blocks)
+		return 0;
 
-		CcUnpinData(from_bcb);
+	nr_descr = (nr_blocks + handle->jh_tags_per_descr - 1) /
+			handle->jh_tags_per_descr;
+	return nr_blocks + nr_descr + 1;
+}
 
-		if (status == STATUS_UNSUCCESSFUL)
-			break;
+/**
+ * @brief Initialize a log reader
+ * @param reader	Log reader
+ * @param handle	Handle to journal file
+ */
+static void
+jbd2_log_reader_init(
+		struct jbd2_log_reader *reader,
+		jbd2_handle_t *handle)
+{
+	RtlZeroMemory(reader, sizeof(struct jbd2_log_reader));
+	reader->lr_handle = handle;
+	reader->lr_readahead = TRUE;
+	CcSetReadAheadGranularity(
+		handle->jh_log_file,
+		VACB_MAPPING_GRANULARITY);
+}
 
-		if (jbd2_test_flag(handle, tag, JBD2_FLAG_LAST_TAG))
-			break;
-	}
+/**
+ * @brief Unmap the window of a log reader
+ * @param reader	Log reader
+ */
+static void
+jbd2_log_reader_release(struct jbd2_log_reader *reader)
+{
+	if (reader->lr_bcb)
+		CcUnpinData(reader->lr_bcb);
 
-	return status;
+	reader->lr_bcb = NULL;
 }
 
 /**
- * @brief Replay the blocks mentioned in a descriptor block
- * @param handle	Handle to journal file
- * @param tid		Transaction ID the descriptor block belongs to
- * @param blocknr	Block number of the descriptor block in log file
- * @param buf		Descriptor block buffer
+ * @brief	Calculate the log block following the window which
+ *			starts at @p blocknr
+ */
+static jbd2_logblk_t
+jbd2_log_window_end(
+		jbd2_handle_t *handle,
+		jbd2_logblk_t blocknr)
+{
+	jbd2_logblk_t blocks_per_view;
+	jbd2_logblk_t end;
+
+	blocks_per_view = VACB_MAPPING_GRANULARITY / handle->jh_blocksize;
+	end = (blocknr / blocks_per_view + 1) * blocks_per_view;
+	if (end > handle->jh_end + 1)
+		end = handle->jh_end + 1;
+
+	return end;
+}
+
+/**
+ * @brief	Whether @p blocknr is in the window currently mapped
+ * @param reader	Log reader
+ * @param blocknr	Block number in log file
+ */
+static __bool
+jbd2_log_reader_mapped(
+		struct jbd2_log_reader *reader,
+		jbd2_logblk_t blocknr)
+{
+	return reader->lr_bcb &&
+		blocknr >= reader->lr_start &&
+		blocknr < reader->lr_end;
+}
+
+/**
+ * @brief	Get the buffer of a log block, mapping a new window if the
+ *			block is not in the current one.  Buffers returned earlier
+ *			are only valid until a new window is mapped.
+ * @param reader	Log reader
+ * @param blocknr	Block number in log file
+ * @param buf		Buffer of the block returned
  * @return	STATUS_SUCCESS indicating that the operation succeeds,
  * 		otherwise the operation fails.
  */
 static NTSTATUS
-jbd2_replay_descr_block(jbd2_handle_t *handle,
-			jbd2_tid_t tid,
-			jbd2_logblk_t blocknr,
-			void *buf)
+jbd2_log_reader_get(
+		struct jbd2_log_reader *reader,
+		jbd2_logblk_t blocknr,
+		void **buf)
 {
-	char *tagp;
-	jbd2_logblk_t nr = 1;
-	NTSTATUS status = STATUS_SUCCESS;
-	int blocksize = handle->jh_blocksize;
-	int tag_bytes = jbd2_min_tag_size(handle);
+	jbd2_handle_t *handle = reader->lr_handle;
+	jbd2_logblk_t next;
+	LARGE_INTEGER tmp;
+	__bool cc_ret;
 
-	if (jbd2_has_csum_v2or3(handle))
-		blocksize -= sizeof(journal_block_tail_t);
+	if (!jbd2_log_reader_mapped(reader, blocknr)) {
+		jbd2_log_reader_release(reader);
 
-	tagp = (char *)buf + sizeof(journal_header_t);
+		reader->lr_start = blocknr;
+		reader->lr_end = jbd2_log_window_end(handle, blocknr);
+		tmp.QuadPart = blocknr_to_offset(blocknr, handle->jh_blocksize);
+		cc_ret = CcMapData(
+				handle->jh_log_file,
+				&tmp,
+				(reader->lr_end - blocknr) * handle->jh_blocksize,
+				MAP_WAIT,
+				&reader->lr_bcb,
+				&reader->lr_buf);
+		if (!cc_ret) {
+			reader->lr_bcb = NULL;
+			return STATUS_UNEXPECTED_IO_ERROR;
+		}
 
-	for (; tagp - buf + tag_bytes <= blocksize;
-			tagp += jbd2_tag_size(handle, tagp), nr++) {
-		__bool cc_ret;
-		jbd2_tid_t re_tid;
-		LARGE_INTEGER tmp;
-		journal_block_tag_t *tag;
-		jbd2_fsblk_t fs_blocknr;
-		jbd2_revoke_entry_t *entry;
-		void *from_bcb, *from_buf, *to_bcb, *to_buf;
-		tag = (journal_block_tag_t *)tagp;
+		handle->jh_replay_stats.rs_nr_windows++;
+		handle->jh_replay_stats.rs_bytes_read +=
+			(__u64)(reader->lr_end - blocknr) * handle->jh_blocksize;
+		if (!reader->lr_readahead)
+			goto out;
+
+		/* Have the following window read while this one is parsed */
+		next = reader->lr_end;
+		if (next > handle->jh_end)
+			next = handle->jh_start;
+		tmp.QuadPart = blocknr_to_offset(next, handle->jh_blocksize);
+		CcScheduleReadAhead(
+			handle->jh_log_file,
+			&tmp,
+			(jbd2_log_window_end(handle, next) - next) *
+				handle->jh_blocksize);
+	}
 
-		fs_blocknr = jbd2_tag_blocknr(handle, tag);
-		entry = jbd2_revoke_entry_find(handle, fs_blocknr);
-		if (entry) {
-			re_tid = entry->re_tid;
-			jbd2_revoke_entry_put(handle, entry);
-			if (jbd2_tid_cmp(tid, re_tid) <= 0)
-				continue;
-		}
+out:
+	*buf = reader->lr_buf +
+		(blocknr - reader->lr_start) * handle->jh_blocksize;
+	return STATUS_SUCCESS;
+}
 
-		/*
-		 * XXX:	We do not support multiple clients, since
-		 *	as of linux 4.x multiple clients support isn't
-		 *	available
-		 */
-		tmp.QuadPart = blocknr_to_offset(
-					blocknr + nr,
-					handle->jh_blocksize);
-		cc_ret = CcPinRead(
+/**
+ * @brief Initialize a log writer
+ * @param writer	Log writer
+ * @param handle	Handle to journal file
+ * @param nr_blocks	Nr. of log blocks to be written with the writer
+ */
+static void
+jbd2_log_writer_init(
+		struct jbd2_log_writer *writer,
+		jbd2_handle_t *handle,
+		jbd2_logblk_t nr_blocks)
+{
+	RtlZeroMemory(writer, sizeof(struct jbd2_log_writer));
+	writer->lw_handle = handle;
+	writer->lw_left = nr_blocks;
+}
+
+/**
+ * @brief Mark the window of a log writer dirty and unpin it
+ * @param writer	Log writer
+ */
+static void
+jbd2_log_writer_release(struct jbd2_log_writer *writer)
+{
+	if (writer->lw_bcb) {
+		CcSetDirtyPinnedData(writer->lw_bcb, NULL);
+		CcUnpinData(writer->lw_bcb);
+	}
+
+	writer->lw_bcb = NULL;
+}
+
+/**
+ * @brief	Get the buffer of a log block to be overwritten, pinning a
+ *			new window if the block is not in the current one.  Blocks
+ *			must be asked for in log order.
+ * @param writer	Log writer
+ * @param blocknr	Block number in log file
+ * @param buf		Buffer of the block returned
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_log_writer_get(
+		struct jbd2_log_writer *writer,
+		jbd2_logblk_t blocknr,
+		void **buf)
+{
+	jbd2_handle_t *handle = writer->lw_handle;
+	jbd2_logblk_t end;
+	LARGE_INTEGER tmp;
+	__bool cc_ret;
+
+	if (!writer->lw_bcb ||
+		blocknr < writer->lw_start ||
+		blocknr >= writer->lw_end) {
+
+		jbd2_log_writer_release(writer);
+		NT_ASSERT(writer->lw_left);
+
+		end = jbd2_log_window_end(handle, blocknr);
+		if (end - blocknr > writer->lw_left)
+			end = blocknr + writer->lw_left;
+
+		tmp.QuadPart = blocknr_to_offset(blocknr, handle->jh_blocksize);
+		cc_ret = CcPreparePinWrite(
 				handle->jh_log_file,
 				&tmp,
-				handle->jh_blocksize,
+				(end - blocknr) * handle->jh_blocksize,
+				TRUE,
 				PIN_WAIT,
-				&from_bcb,
-				&from_buf);
+				&writer->lw_bcb,
+				&writer->lw_buf);
 		if (!cc_ret) {
-			status = STATUS_UNEXPECTED_IO_ERROR;
-			break;
+			writer->lw_bcb = NULL;
+			return STATUS_UNEXPECTED_IO_ERROR;
 		}
 
-		tmp.QuadPart = blocknr_to_offset(
-					fs_blocknr,
-					handle->jh_blocksize);
-		cc_ret = CcPreparePinWrite(
-					handle->jh_client_file,
-					&tmp,
-					handle->jh_blocksize,
-					TRUE,
-					PIN_WAIT,
-					&to_bcb,
-					&to_buf);
-		if (!cc_ret) {
-			status = STATUS_UNEXPECTED_IO_ERROR;
-			CcUnpinData(from_bcb);
-			break;
+		writer->lw_start = blocknr;
+		writer->lw_end = end;
+		writer->lw_left -= end - blocknr;
+	}
+
+	*buf = writer->lw_buf +
+		(blocknr - writer->lw_start) * handle->jh_blocksize;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Write @p nr_blocks log blocks starting at @p blocknr to disk,
+ *			wrapping to jh_start after jh_end
+ * @param handle	Handle to journal file
+ * @param blocknr	First block number in log file
+ * @param nr_blocks	Nr. of blocks
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_log_flush(
+		jbd2_handle_t *handle,
+		jbd2_logblk_t blocknr,
+		jbd2_logblk_t nr_blocks)
+{
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER tmp;
+	jbd2_logblk_t cnt;
+
+	while (nr_blocks) {
+		cnt = handle->jh_end + 1 - blocknr;
+		if (cnt > nr_blocks)
+			cnt = nr_blocks;
+
+		tmp.QuadPart = blocknr_to_offset(blocknr, handle->jh_blocksize);
+		CcFlushCache(
+			handle->jh_log_file->SectionObjectPointer,
+			&tmp,
+			cnt * handle->jh_blocksize,
+			&iosb);
+		if (!NT_SUCCESS(iosb.Status))
+			return iosb.Status;
+
+		nr_blocks -= cnt;
+		blocknr = handle->jh_start;
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Record the tail of the log in the superblock and write it
+ *			to disk
+ * @param handle	Handle to journal file
+ * @param tid		ID of the oldest transaction in the log
+ * @param start		Log block of the oldest transaction, or 0 if the
+ *					log is empty
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_write_superblock(
+		jbd2_handle_t *handle,
+		jbd2_tid_t tid,
+		jbd2_logblk_t start)
+{
+	journal_superblock_t *sb = handle->jh_sb;
+	__bool had_fast_commit;
+	void *bcb;
+	void *buf;
+	LARGE_INTEGER tmp;
+
+	tmp.QuadPart = 0;
+	if (!CcPinRead(
+			handle->jh_log_file,
+			&tmp,
+			handle->jh_blocksize,
+			PIN_WAIT,
+			&bcb,
+			&buf))
+		return STATUS_UNEXPECTED_IO_ERROR;
+
+	/* An empty log has no fast commits, so other drivers may open it */
+	had_fast_commit = !start && jbd2_has_feature_fast_commit(sb);
+	if (had_fast_commit)
+		jbd2_clear_feature_fast_commit(sb);
+
+	sb->s_sequence = cpu_to_be32(tid);
+	sb->s_start = cpu_to_be32(start);
+	if (jbd2_has_csum_v2or3(handle)) {
+		sb->s_checksum = 0;
+		sb->s_checksum = cpu_to_be32(jbd2_chksum(
+						handle,
+						~0,
+						sb,
+						sizeof(journal_superblock_t)));
+	}
+
+	RtlCopyMemory(buf, sb, sizeof(journal_superblock_t));
+	if (had_fast_commit)
+		jbd2_set_feature_fast_commit(sb);
+	CcSetDirtyPinnedData(bcb, NULL);
+	CcUnpinData(bcb);
+	return jbd2_log_flush(handle, 0, 1);
+}
+
+/**
+ * @brief Verify checksum of the blocks mentioned in a descriptor block
+ * @remarks	The blocks are checksummed in batches, one per window of
+ *			the log reader, so that the checksum engine can interleave
+ *			them.  @p buf must not point into the reader's window.
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @param tid		Transaction ID the descriptor block belongs to
+ * @param blocknr	Block number of the descriptor block in log file
+ * @param buf		Descriptor block buffer
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ *			STATUS_CRC_ERROR if a block does not match its tag,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_blocks_csum_verify(jbd2_handle_t *handle,
+			struct recovery_info *recovery_info,
+			jbd2_tid_t tid,
+			jbd2_logblk_t blocknr,
+			void *buf)
+{
+	char *tagp;
+	int i, nr_tags, nr_done = 0;
+	NTSTATUS status;
+	struct drv_crc32_req *reqs = recovery_info->ri_csum_reqs;
+	__u32 prefix;
+
+	if (!jbd2_has_csum_v2or3(handle))
+		return STATUS_SUCCESS;
+
+	/*
+	 * XXX:	We do not support multiple clients, since
+	 *	as of linux 4.x multiple clients support isn't
+	 *	available
+	 */
+	nr_tags = jbd2_count_tags(handle, buf);
+	for (i = 0; i < nr_tags; i++) {
+		void *from_buf;
+
+		blocknr++;
+		jbd2_wrap(handle, blocknr);
+
+		/* Checksum what the current window holds before it goes away */
+		if (!jbd2_log_reader_mapped(&recovery_info->ri_reader, blocknr)) {
+			jbd2_chksum_multi(handle, reqs + nr_done, i - nr_done);
+			nr_done = i;
 		}
 
-		RtlCopyMemory(to_buf, from_buf, handle->jh_blocksize);
-		if (jbd2_test_flag(handle, tag, JBD2_FLAG_ESCAPE)) {
-			journal_header_t *jh_buf = to_buf;
-			jh_buf->h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+		status = jbd2_log_reader_get(
+					&recovery_info->ri_reader,
+					blocknr,
+					&from_buf);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		reqs[i].cr_seed = 0;
+		reqs[i].cr_buf = from_buf;
+		reqs[i].cr_len = handle->jh_blocksize;
+	}
+	jbd2_chksum_multi(handle, reqs + nr_done, nr_tags - nr_done);
+
+	prefix = jbd2_block_csum_prefix(handle, tid);
+	tagp = (char *)buf + sizeof(journal_header_t);
+	for (i = 0; i < nr_tags; i++, tagp += jbd2_tag_size(handle, tagp)) {
+		__u32 calculated;
+		journal_block_tag_t *tag;
+		tag = (journal_block_tag_t *)tagp;
+
+		calculated = prefix ^ reqs[i].cr_crc;
+		if (jbd2_has_feature_csum2(handle->jh_sb))
+			calculated &= 0xffff;
+
+		if (calculated != jbd2_tag_csum(handle, tag)) {
+			dbg_print("Checksum calculation fails on handle %p\n", handle);
+			return STATUS_CRC_ERROR;
 		}
-		CcSetDirtyPinnedData(to_bcb, NULL);
+	}
 
-		CcUnpinData(from_bcb);
-		CcUnpinData(to_bcb);
+	return STATUS_SUCCESS;
+}
 
-		if (jbd2_test_flag(handle, tag, JBD2_FLAG_LAST_TAG))
-			break;
+/**
+ * @brief	Add a descriptor block and the blocks it mentions to the
+ *			checksum v1 of the transaction being scanned
+ * @remarks	The blocks are checksummed as they are in the log, escaped
+ *			ones included.  @p buf must not point into the reader's
+ *			window.
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @param blocknr	Block number of the descriptor block in log file
+ * @param buf		Descriptor block buffer
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_blocks_crc32_sum(jbd2_handle_t *handle,
+			struct recovery_info *recovery_info,
+			jbd2_logblk_t blocknr,
+			void *buf)
+{
+	int i, nr_tags;
+	NTSTATUS status;
+
+	if (!jbd2_has_csum_v1(handle))
+		return STATUS_SUCCESS;
+
+	recovery_info->ri_crc32_sum = jbd2_crc32_be(
+					recovery_info->ri_crc32_sum,
+					buf,
+					handle->jh_blocksize);
+
+	nr_tags = jbd2_count_tags(handle, buf);
+	for (i = 0; i < nr_tags; i++) {
+		void *from_buf;
+
+		blocknr++;
+		jbd2_wrap(handle, blocknr);
+
+		status = jbd2_log_reader_get(
+					&recovery_info->ri_reader,
+					blocknr,
+					&from_buf);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		recovery_info->ri_crc32_sum = jbd2_crc32_be(
+						recovery_info->ri_crc32_sum,
+						from_buf,
+						handle->jh_blocksize);
 	}
 
-	return status;
+	return STATUS_SUCCESS;
 }
 
 /**
- * @brief	Scan revoke entries in a revocation block and
- *			insert them into revoke table
+ * @brief	Check the checksum v1 in a commit block against the blocks
+ *			of the transaction
+ * @remarks	Commit blocks without a checksum are accepted until one
+ *			with a checksum is found, as in Linux, since the feature may
+ *			have been enabled with transactions in the log.
  * @param handle	Handle to journal file
- * @param tid		Transaction ID
- * @param buf		Block buffer
- * @return STATUS_SUCCESS if all the revoke entries are inserted
+ * @param recovery_info	Recovery context
+ * @param buf		Commit block buffer
+ * @return	TRUE if the transaction is intact
+ */
+static __bool
+jbd2_commit_block_crc32_verify(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info,
+		void *buf)
+{
+	journal_commit_header_t *commit_hdr = (journal_commit_header_t *)buf;
+	__u32 crc32_sum = recovery_info->ri_crc32_sum;
+
+	if (!jbd2_has_csum_v1(handle))
+		return TRUE;
+
+	recovery_info->ri_crc32_sum = ~0U;
+	if (commit_hdr->h_chksum_type == JBD2_CRC32_CHKSUM &&
+		commit_hdr->h_chksum_size == JBD2_CRC32_CHKSUM_SIZE &&
+		be32_to_cpu(commit_hdr->h_chksum[0]) == crc32_sum) {
+		recovery_info->ri_crc32_seen = TRUE;
+		return TRUE;
+	}
+
+	return !commit_hdr->h_chksum_type &&
+		!commit_hdr->h_chksum_size &&
+		!commit_hdr->h_chksum[0] &&
+		!recovery_info->ri_crc32_seen;
+}
+
+/**
+ * @brief	Grow an array used by the recovery index
+ * @param array		Pointer to the array, replaced on success
+ * @param max		Pointer to the capacity of the array in elements
+ * @param nr		Nr. of elements in use
+ * @param elem_size	Size of an element
+ * @return	STATUS_SUCCESS, or STATUS_INSUFFICIENT_RESOURCES
+ */
+static NTSTATUS
+jbd2_recovery_grow(
+		void **array,
+		size_t *max,
+		size_t nr,
+		size_t elem_size)
+{
+	void *new_array;
+	size_t new_max = *max ? *max * 2 : JBD2_RECOVERY_INIT_RECS;
+
+	new_array = ExAllocatePoolWithTag(
+					NonPagedPool,
+					new_max * elem_size,
+					JBD2_RECOVER_POOL_TAG);
+	if (!new_array)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	if (*array) {
+		RtlCopyMemory(new_array, *array, nr * elem_size);
+		ExFreePoolWithTag(*array, JBD2_RECOVER_POOL_TAG);
+	}
+	*array = new_array;
+	*max = new_max;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Release the memory held by the recovery index
+ * @param recovery_info	Recovery context
+ */
+static void
+jbd2_recovery_release(struct recovery_info *recovery_info)
+{
+	if (recovery_info->ri_recs)
+		ExFreePoolWithTag(recovery_info->ri_recs, JBD2_RECOVER_POOL_TAG);
+	if (recovery_info->ri_revokes)
+		ExFreePoolWithTag(recovery_info->ri_revokes, JBD2_RECOVER_POOL_TAG);
+	if (recovery_info->ri_descr_buf)
+		ExFreePoolWithTag(recovery_info->ri_descr_buf, JBD2_RECOVER_POOL_TAG);
+	if (recovery_info->ri_csum_reqs)
+		ExFreePoolWithTag(recovery_info->ri_csum_reqs, JBD2_RECOVER_POOL_TAG);
+
+	recovery_info->ri_recs = NULL;
+	recovery_info->ri_revokes = NULL;
+	recovery_info->ri_descr_buf = NULL;
+	recovery_info->ri_csum_reqs = NULL;
+	jbd2_log_reader_release(&recovery_info->ri_reader);
+}
+
+/**
+ * @brief Record the blocks mentioned in a descriptor block in the index
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @param tid		Transaction ID the descriptor block belongs to
+ * @param blocknr	Block number of the descriptor block in log file
+ * @param buf		Descriptor block buffer
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
  */
 static NTSTATUS
-jbd2_scan_revoke_entries(
+jbd2_recovery_index_descr(
 		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info,
 		jbd2_tid_t tid,
+		jbd2_logblk_t blocknr,
+		void *buf)
+{
+	char *tagp;
+	int i, nr_tags;
+	NTSTATUS status;
+
+	nr_tags = jbd2_count_tags(handle, buf);
+	while (recovery_info->ri_nr_recs + nr_tags > recovery_info->ri_max_recs) {
+		status = jbd2_recovery_grow(
+					&recovery_info->ri_recs,
+					&recovery_info->ri_max_recs,
+					recovery_info->ri_nr_recs,
+					sizeof(struct jbd2_replay_rec));
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	tagp = (char *)buf + sizeof(journal_header_t);
+	for (i = 0; i < nr_tags; i++, tagp += jbd2_tag_size(handle, tagp)) {
+		struct jbd2_replay_rec *rec;
+		journal_block_tag_t *tag;
+		tag = (journal_block_tag_t *)tagp;
+
+		blocknr++;
+		jbd2_wrap(handle, blocknr);
+
+		rec = &recovery_info->ri_recs[recovery_info->ri_nr_recs++];
+		rec->rr_fs_blocknr = jbd2_tag_blocknr(handle, tag);
+		rec->rr_log_blocknr = blocknr;
+		rec->rr_tid = tid;
+		rec->rr_seq = (__u32)(recovery_info->ri_nr_recs - 1);
+		rec->rr_escaped = jbd2_test_flag(handle, tag, JBD2_FLAG_ESCAPE);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Stage the revoke entries in a revocation block.  They only
+ *			take effect once the commit block of @p tid is found.
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @param buf		Block buffer
+ * @return STATUS_SUCCESS if all the revoke entries are staged
+ */
+static NTSTATUS
+jbd2_recovery_stage_revokes(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info,
 		void *buf)
 {
 	size_t entry_sz = jbd2_revoke_entry_size(handle);
@@ -869,19 +1571,59 @@ jbd2_scan_revoke_entries(
 	if (rcount > handle->jh_blocksize - csum_size)
 		return STATUS_DISK_CORRUPT_ERROR;
 
-	for (bufp += sizeof(journal_header_t);
+	for (bufp += sizeof(journal_revoke_header_t);
 			bufp + entry_sz <= (char *)buf + rcount;
 			bufp += entry_sz) {
-		jbd2_fsblk_t fs_blocknr = jbd2_revoke_entry_blocknr(bufp);
-		jbd2_revoke_entry_t *revoke_entry;
+		if (recovery_info->ri_nr_revokes == recovery_info->ri_max_revokes) {
+			NTSTATUS status;
+			status = jbd2_recovery_grow(
+						&recovery_info->ri_revokes,
+						&recovery_info->ri_max_revokes,
+						recovery_info->ri_nr_revokes,
+						sizeof(jbd2_fsblk_t));
+			if (!NT_SUCCESS(status))
+				return status;
+		}
 
-		revoke_entry = jbd2_revoke_entry_get(handle, fs_blocknr);
-		if (!revoke_entry)
-			return STATUS_INSUFFICIENT_RESOURCES;
+		recovery_info->ri_revokes[recovery_info->ri_nr_revokes++] =
+				jbd2_revoke_entry_blocknr(handle, bufp);
+	}
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Make the records and revokes of a transaction whose commit
+ *			block has been found part of the index
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @param tid		Transaction ID
+ * @return STATUS_SUCCESS if all the revoke entries are inserted
+ */
+static NTSTATUS
+jbd2_recovery_commit(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info,
+		jbd2_tid_t tid)
+{
+	size_t i;
 
-		revoke_entry->re_tid = tid;
-		jbd2_revoke_entry_put(handle, revoke_entry);
+	for (i = 0; i < recovery_info->ri_nr_revokes; i++) {
+		NTSTATUS status;
+
+		status = jbd2_revoke_table_insert(
+					handle,
+					recovery_info->ri_revokes[i],
+					tid);
+		if (!NT_SUCCESS(status))
+			return status;
 	}
+	handle->jh_replay_stats.rs_nr_revoke_recs += (__u32)i;
+	recovery_info->ri_nr_revokes = 0;
+
+	recovery_info->ri_nr_committed = recovery_info->ri_nr_recs;
+	recovery_info->ri_end_txn = tid;
+	recovery_info->ri_has_txn = TRUE;
+	handle->jh_replay_stats.rs_nr_txns++;
 	return STATUS_SUCCESS;
 }
 
@@ -896,172 +1638,523 @@ void jbd2_init()
 	jbd2_cc_manager_callbacks.ReleaseFromReadAhead = jbd2_cc_release_from_readahead;
 }
 
-NTSTATUS jbd2_replay_one_pass(
-			jbd2_handle_t *handle,
-			struct recovery_info *recovery_info,
-			int phase)
+/**
+ * @brief	Read the log once from s_start, verifying every block and
+ *			building the index of logged blocks and the revoke table
+ *			of all the committed transactions found.
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @return	STATUS_SUCCESS if the end of the log is reached,
+ *			otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_recovery_scan(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info)
 {
-	LARGE_INTEGER tmp;
 	NTSTATUS status = STATUS_SUCCESS;
 	jbd2_logblk_t curr_blocknr = be32_to_cpu(handle->jh_sb->s_start);
 	jbd2_tid_t curr_tid = be32_to_cpu(handle->jh_sb->s_sequence);
-	RtlZeroMemory(recovery_info, sizeof(struct recovery_info));
+	__bool end_of_log = FALSE;
 
-	if (phase == JBD2_PHASE_SCAN) {
-		recovery_info->ri_start_txn = curr_tid;
-		recovery_info->ri_has_txn = FALSE;
-	}
+	recovery_info->ri_start_txn = curr_tid;
+	recovery_info->ri_has_txn = FALSE;
+	recovery_info->ri_crc32_sum = ~0U;
+	recovery_info->ri_crc32_seen = FALSE;
+	recovery_info->ri_torn = FALSE;
 
-	while (1) {
-		void *bcb;
-		__bool cc_ret, veri_ret;
+	while (!end_of_log && NT_SUCCESS(status)) {
 		journal_header_t *jh_buf;
 
-		if (phase != JBD2_PHASE_SCAN &&
-				jbd2_tid_cmp(curr_tid, recovery_info->ri_end_txn) > 0)
+		status = jbd2_log_reader_get(
+					&recovery_info->ri_reader,
+					curr_blocknr,
+					&jh_buf);
+		if (!NT_SUCCESS(status))
+			break;
+		handle->jh_replay_stats.rs_nr_log_blocks++;
+
+		/* Anything which isn't the next block we expect ends the log */
+		end_of_log = TRUE;
+		if (!jbd2_verify_metadata_block(jh_buf)
+				|| be32_to_cpu(jh_buf->h_sequence) != curr_tid)
 			break;
 
-		__try {
-			int nr_tags;
-			tmp.QuadPart = blocknr_to_offset(
+		switch (be32_to_cpu(jh_buf->h_blocktype)) {
+		case JBD2_DESCRIPTOR_BLOCK:
+			if (!jbd2_verify_descr_block(handle, jh_buf))
+				break;
+
+			/* Verifying the tags may move the reader's window */
+			RtlCopyMemory(
+				recovery_info->ri_descr_buf,
+				jh_buf,
+				handle->jh_blocksize);
+			jh_buf = recovery_info->ri_descr_buf;
+
+			status = jbd2_blocks_csum_verify(
+						handle,
+						recovery_info,
+						curr_tid,
 						curr_blocknr,
-						handle->jh_blocksize);
-			cc_ret = CcPinRead(
-					handle->jh_log_file,
-					&tmp,
-					handle->jh_blocksize,
-					PIN_WAIT,
-					&bcb,
-					&jh_buf);
-			if (!cc_ret) {
-				status = STATUS_UNEXPECTED_IO_ERROR;
-				goto end;
+						jh_buf);
+
+			/* Only fatal if the commit block follows */
+			if (status == STATUS_CRC_ERROR) {
+				recovery_info->ri_torn = TRUE;
+				status = STATUS_SUCCESS;
 			}
+			if (!NT_SUCCESS(status))
+				break;
+
+			status = jbd2_blocks_crc32_sum(
+						handle,
+						recovery_info,
+						curr_blocknr,
+						jh_buf);
+			if (!NT_SUCCESS(status))
+				break;
 
-			if (!jbd2_verify_metadata_block(jh_buf)
-					|| be32_to_cpu(jh_buf->h_sequence) != curr_tid) {
-				if (phase == JBD2_PHASE_SCAN)
-					status = STATUS_SUCCESS;
-				else
-					status = STATUS_DISK_CORRUPT_ERROR;
+			status = jbd2_recovery_index_descr(
+						handle,
+						recovery_info,
+						curr_tid,
+						curr_blocknr,
+						jh_buf);
+			if (!NT_SUCCESS(status))
+				break;
+
+			curr_blocknr += jbd2_count_tags(handle, jh_buf) + 1;
+			jbd2_wrap(handle, curr_blocknr);
+			end_of_log = FALSE;
+			break;
+		case JBD2_COMMIT_BLOCK:
+			if (!jbd2_verify_commit_block(handle, jh_buf))
+				break;
 
-				goto end;
+			/*
+			 * With async commit the commit block may reach the disk
+			 * before the blocks it commits, so a transaction whose
+			 * blocks do not check out simply did not commit.
+			 */
+			if (recovery_info->ri_torn) {
+				if (!jbd2_has_feature_async_commit(handle->jh_sb))
+					status = STATUS_CRC_ERROR;
+				break;
 			}
+			if (!jbd2_commit_block_crc32_verify(
+					handle,
+					recovery_info,
+					jh_buf))
+				break;
 
-			switch (be32_to_cpu(jh_buf->h_blocktype)) {
-			case JBD2_DESCRIPTOR_BLOCK:
-				veri_ret = jbd2_verify_descr_block(handle, jh_buf);
-				if (!veri_ret) {
-					if (phase == JBD2_PHASE_SCAN)
-						status = STATUS_SUCCESS;
-					else
-						status = STATUS_DISK_CORRUPT_ERROR;
-
-					goto end;
-				}
-
-				nr_tags = jbd2_count_tags(handle, jh_buf);
-				if (phase != JBD2_PHASE_REPLAY) {
-					if (phase == JBD2_PHASE_SCAN) {
-						status = jbd2_blocks_csum_verify(
-									handle,
-									curr_blocknr,
-									jh_buf);
-						if (!NT_SUCCESS(status))
-							goto end;
-					}
-					curr_blocknr += nr_tags + 1;
-					jbd2_wrap(handle, curr_blocknr);
-					break;
-				} else {
-					status = jbd2_replay_descr_block(
-								handle,
-								curr_tid,
-								curr_blocknr,
-								jh_buf);
-					if (!NT_SUCCESS(status))
-						goto end;
-
-					curr_blocknr += nr_tags + 1;
-					jbd2_wrap(handle, curr_blocknr);
-				}
+			status = jbd2_recovery_commit(
+						handle,
+						recovery_info,
+						curr_tid);
+			if (!NT_SUCCESS(status))
+				break;
 
+			curr_tid++;
+			curr_blocknr++;
+			jbd2_wrap(handle, curr_blocknr);
+			end_of_log = FALSE;
+			break;
+		case JBD2_REVOKE_BLOCK:
+			if (!jbd2_verify_revoke_block(handle, jh_buf))
 				break;
-			case JBD2_COMMIT_BLOCK:
-				veri_ret = jbd2_verify_commit_block(handle, jh_buf);
-				if (!veri_ret) {
-					if (phase == JBD2_PHASE_SCAN)
-						status = STATUS_SUCCESS;
-					else
-						status = STATUS_DISK_CORRUPT_ERROR;
-
-					goto end;
-				}
-
-				if (phase == JBD2_PHASE_SCAN) {
-					recovery_info->ri_end_txn = curr_tid;
-					recovery_info->ri_has_txn = TRUE;
-				}
-				curr_tid++;
-				curr_blocknr++;
-				jbd2_wrap(handle, curr_blocknr);
+
+			status = jbd2_recovery_stage_revokes(
+						handle,
+						recovery_info,
+						jh_buf);
+			if (!NT_SUCCESS(status))
 				break;
-			case JBD2_REVOKE_BLOCK:
-				veri_ret = jbd2_verify_revoke_block(handle, jh_buf);
-				if (!veri_ret) {
-					if (phase == JBD2_PHASE_SCAN)
-						status = STATUS_SUCCESS;
-					else
-						status = STATUS_DISK_CORRUPT_ERROR;
-
-					goto end;
-				}
-
-				if (phase == JBD2_PHASE_SCAN_REVOKE)
-					jbd2_scan_revoke_entries(handle, curr_tid, jh_buf);
-
-				curr_blocknr++;
-				jbd2_wrap(handle, curr_blocknr);
-			}
-		} __finally {
-			if (cc_ret)
-				CcUnpinData(bcb);
+
+			curr_blocknr++;
+			jbd2_wrap(handle, curr_blocknr);
+			end_of_log = FALSE;
+			break;
 		}
 	}
-end:
+
+	/* Records of the transaction which never committed are dropped */
+	recovery_info->ri_nr_recs = recovery_info->ri_nr_committed;
+	recovery_info->ri_nr_revokes = 0;
 	return status;
 }
 
+/**
+ * @brief	Order replay records by block number in client file, and by
+ *			position in the log for copies of the same block
+ */
+static int
+jbd2_replay_rec_cmp(
+		struct jbd2_replay_rec *a,
+		struct jbd2_replay_rec *b)
+{
+	if (a->rr_fs_blocknr < b->rr_fs_blocknr)
+		return -1;
+	if (a->rr_fs_blocknr > b->rr_fs_blocknr)
+		return 1;
+	if (a->rr_seq < b->rr_seq)
+		return -1;
+	if (a->rr_seq > b->rr_seq)
+		return 1;
+	return 0;
+}
+
+static void
+jbd2_replay_rec_sift_down(
+		struct jbd2_replay_rec *recs,
+		size_t root,
+		size_t nr)
+{
+	struct jbd2_replay_rec tmp;
+	size_t child;
+
+	while ((child = 2 * root + 1) < nr) {
+		if (child + 1 < nr &&
+		    jbd2_replay_rec_cmp(&recs[child], &recs[child + 1]) < 0)
+			child++;
+		if (jbd2_replay_rec_cmp(&recs[root], &recs[child]) >= 0)
+			break;
+
+		tmp = recs[root];
+		recs[root] = recs[child];
+		recs[child] = tmp;
+		root = child;
+	}
+}
+
+/**
+ * @brief	Sort replay records with jbd2_replay_rec_cmp()
+ * @remarks	Heapsort: in place, and no recursion on the kernel stack.
+ * @param recs	Array of records
+ * @param nr	Nr. of records
+ */
+static void
+jbd2_replay_rec_sort(
+		struct jbd2_replay_rec *recs,
+		size_t nr)
+{
+	struct jbd2_replay_rec tmp;
+	size_t i;
+
+	if (nr < 2)
+		return;
+
+	for (i = nr / 2; i-- > 0; )
+		jbd2_replay_rec_sift_down(recs, i, nr);
+
+	for (i = nr - 1; i > 0; i--) {
+		tmp = recs[0];
+		recs[0] = recs[i];
+		recs[i] = tmp;
+		jbd2_replay_rec_sift_down(recs, 0, i);
+	}
+}
+
+/**
+ * @brief	Reduce the index to the newest copy of each block, drop the
+ *			blocks revoked after their newest copy was logged, and leave
+ *			the remaining records sorted by block number in client file
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ */
+static void
+jbd2_recovery_dedup(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info)
+{
+	struct jbd2_replay_rec *recs = recovery_info->ri_recs;
+	size_t i, nr = 0;
+
+	jbd2_replay_rec_sort(recs, recovery_info->ri_nr_recs);
+
+	for (i = 0; i < recovery_info->ri_nr_recs; i++) {
+		jbd2_tid_t re_tid;
+
+		/* Only the last copy of a block in the log survives */
+		if (i + 1 < recovery_info->ri_nr_recs &&
+		    recs[i + 1].rr_fs_blocknr == recs[i].rr_fs_blocknr) {
+			handle->jh_replay_stats.rs_nr_superseded++;
+			continue;
+		}
+
+		/*
+		 * A revoke newer than the last copy covers every older
+		 * copy as well.
+		 */
+		if (jbd2_revoke_table_lookup(handle, recs[i].rr_fs_blocknr, &re_tid)) {
+			if (jbd2_tid_cmp(recs[i].rr_tid, re_tid) <= 0) {
+				handle->jh_replay_stats.rs_nr_revoked++;
+				continue;
+			}
+		}
+
+		recs[nr++] = recs[i];
+	}
+
+	recovery_info->ri_nr_recs = nr;
+}
+
+/**
+ * @brief	Write the blocks recorded in the index to the client file
+ *			and flush them
+ * @remarks	The index has been reduced by jbd2_recovery_dedup(), so
+ *			each block is written once, in ascending order.
+ * @param handle	Handle to journal file
+ * @param recovery_info	Recovery context
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_recovery_replay(
+		jbd2_handle_t *handle,
+		struct recovery_info *recovery_info)
+{
+	size_t i;
+	IO_STATUS_BLOCK iosb;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/*
+	 * Replay visits the log in client block order, which the scan
+	 * has just brought into the cache, so reading ahead is useless.
+	 */
+	recovery_info->ri_reader.lr_readahead = FALSE;
+
+	for (i = 0; i < recovery_info->ri_nr_recs; i++) {
+		__bool cc_ret;
+		LARGE_INTEGER tmp;
+		struct jbd2_replay_rec *rec = &recovery_info->ri_recs[i];
+		void *from_buf, *to_bcb, *to_buf;
+
+		/*
+		 * XXX:	We do not support multiple clients, since
+		 *	as of linux 4.x multiple clients support isn't
+		 *	available
+		 */
+		status = jbd2_log_reader_get(
+					&recovery_info->ri_reader,
+					rec->rr_log_blocknr,
+					&from_buf);
+		if (!NT_SUCCESS(status))
+			break;
+
+		tmp.QuadPart = blocknr_to_offset(
+					rec->rr_fs_blocknr,
+					handle->jh_blocksize);
+		cc_ret = CcPreparePinWrite(
+					handle->jh_client_file,
+					&tmp,
+					handle->jh_blocksize,
+					TRUE,
+					PIN_WAIT,
+					&to_bcb,
+					&to_buf);
+		if (!cc_ret) {
+			status = STATUS_UNEXPECTED_IO_ERROR;
+			break;
+		}
+
+		RtlCopyMemory(to_buf, from_buf, handle->jh_blocksize);
+		if (rec->rr_escaped) {
+			journal_header_t *jh_buf = to_buf;
+			jh_buf->h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+		}
+		CcSetDirtyPinnedData(to_bcb, NULL);
+		CcUnpinData(to_bcb);
+		handle->jh_replay_stats.rs_nr_replayed++;
+	}
+
+	if (!NT_SUCCESS(status) || !recovery_info->ri_nr_recs)
+		return status;
+
+	/* The dirty blocks are written back in file order in one sweep */
+	CcFlushCache(
+		handle->jh_client_file->SectionObjectPointer,
+		NULL,
+		0,
+		&iosb);
+	return iosb.Status;
+}
+
+/**
+ * @brief	Hand the blocks of the fast commit area to the client
+ * @remarks	Called once the committed transactions are replayed, since
+ *			the fast commits extend the last of them.  What the client
+ *			wrote to the client file is flushed before the log is marked
+ *			empty.
+ * @param handle	Handle to journal file
+ * @param expected_tid	ID following the last committed transaction
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ *			STATUS_NOT_SUPPORTED if the log may hold fast commits but
+ *				the client cannot apply them, so the log is left for a
+ *				driver which can,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_fc_replay_area(
+		jbd2_handle_t *handle,
+		jbd2_tid_t expected_tid)
+{
+	NTSTATUS status;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER tmp;
+	jbd2_logblk_t i;
+	void *bcb, *buf;
+
+	if (!handle->jh_fc_blockcnt)
+		return STATUS_SUCCESS;
+	if (!handle->jh_fc_replay)
+		return STATUS_NOT_SUPPORTED;
+
+	tmp.QuadPart = blocknr_to_offset(handle->jh_fc_first, handle->jh_blocksize);
+	CcScheduleReadAhead(
+		handle->jh_log_file,
+		&tmp,
+		handle->jh_fc_blockcnt * handle->jh_blocksize);
+
+	for (i = 0; i < handle->jh_fc_blockcnt; i++) {
+		tmp.QuadPart = blocknr_to_offset(
+					handle->jh_fc_first + i,
+					handle->jh_blocksize);
+		if (!CcMapData(
+				handle->jh_log_file,
+				&tmp,
+				handle->jh_blocksize,
+				MAP_WAIT,
+				&bcb,
+				&buf))
+			return STATUS_UNEXPECTED_IO_ERROR;
+
+		status = handle->jh_fc_replay(
+					handle->jh_fc_replay_ctx,
+					expected_tid,
+					i,
+					buf);
+		CcUnpinData(bcb);
+		handle->jh_replay_stats.rs_nr_fc_blocks++;
+		handle->jh_replay_stats.rs_bytes_read += handle->jh_blocksize;
+		if (status == STATUS_NO_MORE_ENTRIES)
+			break;
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	CcFlushCache(
+		handle->jh_client_file->SectionObjectPointer,
+		NULL,
+		0,
+		&iosb);
+	return iosb.Status;
+}
+
+/**
+ * @brief	Return the time elapsed since @p since in microseconds,
+ *			and move @p since to now
+ */
+static __u64
+jbd2_elapsed_us(LARGE_INTEGER *since, LARGE_INTEGER freq)
+{
+	LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+	__u64 us;
+
+	us = (__u64)(now.QuadPart - since->QuadPart) * 1000000 / freq.QuadPart;
+	*since = now;
+	return us;
+}
+
 /**
  * @brief Replay a journal file
+ * @remarks	The log is read once: the scan builds an index of the
+ *			blocks logged by committed transactions together with
+ *			the revoke table.  The index is then reduced to the newest
+ *			unrevoked copy of each block, and replay writes those in
+ *			block order, before the fast commit area is handed to the
+ *			client.  Once the blocks are on disk the log is
+ *			marked empty, and new transactions start past the ID of
+ *			the last transaction found, committed or not.
+ *			Statistics of the replay are left in jh_replay_stats.
  * @param handle Handle to journal file
- * @return	STATUS_SUCCESS
+ * @return	STATUS_SUCCESS if the log is marked empty, otherwise the
+ *			log is left to be replayed again.
  */
 NTSTATUS jbd2_replay_journal(jbd2_handle_t *handle)
 {
+	NTSTATUS status = STATUS_UNSUCCESSFUL;
+	LARGE_INTEGER freq, since;
 	struct recovery_info recovery_info;
-	NTSTATUS status = jbd2_replay_one_pass(
-					handle,
-					&recovery_info,
-					JBD2_PHASE_SCAN);
-	if (!status)
-		goto cleanup;
+	jbd2_replay_stats_t *stats = &handle->jh_replay_stats;
+	jbd2_tid_t next_tid;
 
-	status = jbd2_replay_one_pass(
-				handle,
-				&recovery_info,
-				JBD2_PHASE_SCAN_REVOKE);
-	if (!status)
-		goto cleanup;
+	RtlZeroMemory(&recovery_info, sizeof(struct recovery_info));
+	RtlZeroMemory(stats, sizeof(jbd2_replay_stats_t));
+	if (!handle->jh_needs_recovery) {
+		stats->rs_status = STATUS_SUCCESS;
+		return STATUS_SUCCESS;
+	}
 
-	status = jbd2_replay_one_pass(
-				handle,
-				&recovery_info,
-				JBD2_PHASE_REPLAY);
-	if (!status)
-		goto cleanup;
-cleanup:
-	jbd2_revoke_table_clear(handle);
+	jbd2_log_reader_init(&recovery_info.ri_reader, handle);
+	since = KeQueryPerformanceCounter(&freq);
+
+	__try {
+		recovery_info.ri_descr_buf = ExAllocatePoolWithTag(
+						NonPagedPool,
+						handle->jh_blocksize,
+						JBD2_RECOVER_POOL_TAG);
+		recovery_info.ri_csum_reqs = ExAllocatePoolWithTag(
+						NonPagedPool,
+						(handle->jh_blocksize / jbd2_min_tag_size(handle) + 1) *
+							sizeof(struct drv_crc32_req),
+						JBD2_RECOVER_POOL_TAG);
+		if (!recovery_info.ri_descr_buf || !recovery_info.ri_csum_reqs) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			__leave;
+		}
+
+		status = jbd2_recovery_scan(handle, &recovery_info);
+		stats->rs_scan_us = jbd2_elapsed_us(&since, freq);
+		stats->rs_nr_recs = (__u32)recovery_info.ri_nr_recs;
+		if (!NT_SUCCESS(status))
+			__leave;
+
+		if (recovery_info.ri_has_txn) {
+			jbd2_recovery_dedup(handle, &recovery_info);
+			stats->rs_dedup_us = jbd2_elapsed_us(&since, freq);
+
+			status = jbd2_recovery_replay(handle, &recovery_info);
+			stats->rs_replay_us = jbd2_elapsed_us(&since, freq);
+			if (!NT_SUCCESS(status))
+				__leave;
+		}
+
+		next_tid = recovery_info.ri_has_txn ?
+				recovery_info.ri_end_txn + 1 :
+				be32_to_cpu(handle->jh_sb->s_sequence);
+		status = jbd2_fc_replay_area(handle, next_tid);
+		stats->rs_fc_us = jbd2_elapsed_us(&since, freq);
+	} __finally {
+		if (NT_SUCCESS(status)) {
+			/* Skipping next_tid keeps stale fast commits from matching */
+			handle->jh_next_tid = next_tid + 1;
+			status = jbd2_write_superblock(handle, handle->jh_next_tid, 0);
+			if (NT_SUCCESS(status))
+				handle->jh_needs_recovery = FALSE;
+		}
+		jbd2_recovery_release(&recovery_info);
+		jbd2_revoke_table_clear(handle);
+		stats->rs_status = status;
+	}
+
+	dbg_print("jbd2 replay: %u txns, %u/%u blocks replayed, %u superseded, "
+		  "%u revoked, %u fast commit blocks, %I64u bytes read, scan %I64u us, "
+		  "dedup %I64u us, replay %I64u us, fast commit %I64u us\n",
+		  stats->rs_nr_txns, stats->rs_nr_replayed, stats->rs_nr_recs,
+		  stats->rs_nr_superseded, stats->rs_nr_revoked, stats->rs_nr_fc_blocks,
+		  stats->rs_bytes_read, stats->rs_scan_us, stats->rs_dedup_us,
+		  stats->rs_replay_us, stats->rs_fc_us);
 	return status;
 }
 
@@ -1098,6 +2191,10 @@ void jbd2_cache_sync_uninit_map(PFILE_OBJECT file_object)
 	NT_ASSERT(wait_status == STATUS_SUCCESS);
 }
 
+static NTSTATUS jbd2_commit_thread_start(jbd2_handle_t *handle);
+static NTSTATUS jbd2_fc_init_area(jbd2_handle_t *handle);
+static void jbd2_set_max_txn(jbd2_handle_t *handle);
+
 /**
  * @brief Open a journal file (we won't append the file of course...)
  * @param client_file	FILE_OBJECT of client file
@@ -1122,7 +2219,6 @@ NTSTATUS jbd2_open_handle(
 {
 	void *bcb = NULL;
 	__bool lbcb_cache_inited = FALSE;
-	__bool revoke_cache_inited = FALSE;
 	__bool lock_inited = FALSE;
 	journal_superblock_t *jh_sb = NULL;
 
@@ -1132,6 +2228,7 @@ NTSTATUS jbd2_open_handle(
 	jbd2_handle_t *handle;
 	LARGE_INTEGER tmp;
 	journal_superblock_t *sb_buf;
+	int i;
 	NT_ASSERT(handle_ret);
 
 	cc_size.AllocationSize.QuadPart = log_size;
@@ -1155,7 +2252,7 @@ NTSTATUS jbd2_open_handle(
 		NULL);
 
 	__try {
-		tmp.QuadPart = blocknr_to_offset(log_size, blocksize);
+		tmp.QuadPart = 0;
 		cc_ret = CcPinRead(
 					log_file,
 					&tmp,
@@ -1175,7 +2272,7 @@ NTSTATUS jbd2_open_handle(
 			status = STATUS_DISK_CORRUPT_ERROR;
 			__leave;
 		}
-		if (be32_to_cpu(sb_buf->s_maxlen) <
+		if (be32_to_cpu(sb_buf->s_maxlen) >
 			offset_to_blocknr(log_size, blocksize)) {
 
 			status = STATUS_DISK_CORRUPT_ERROR;
@@ -1193,7 +2290,7 @@ NTSTATUS jbd2_open_handle(
 			"be32_to_cpu(sb_buf->s_feature_incompat) : %d\n",
 			be32_to_cpu(sb_buf->s_feature_incompat));
 
-		if (jbd2_features_supported(
+		if (!jbd2_features_supported(
 			sb_buf->s_feature_incompat,
 			JBD2_KNOWN_INCOMPAT_FEATURES)) {
 
@@ -1204,7 +2301,7 @@ NTSTATUS jbd2_open_handle(
 			__leave;
 		}
 		/* Will there ever be read-only features for journal ??? */
-		if (jbd2_features_supported(
+		if (!jbd2_features_supported(
 			sb_buf->s_feature_ro_compat,
 			JBD2_KNOWN_ROCOMPAT_FEATURES)) {
 
@@ -1225,6 +2322,11 @@ NTSTATUS jbd2_open_handle(
 		}
 
 		drv_mutex_init(&handle->jh_lock);
+		drv_mutex_init(&handle->jh_checkpoint_lock);
+		for (i = 0; i < JBD2_LBCB_SHARDS; i++) {
+			drv_mutex_init(&handle->jh_lbcb_shards[i].ls_lock);
+			RB_INIT(&handle->jh_lbcb_shards[i].ls_table);
+		}
 		lock_inited = TRUE;
 		handle->jh_sb = jh_sb;
 
@@ -1237,19 +2339,70 @@ NTSTATUS jbd2_open_handle(
 
 		handle->jh_blocksize = blocksize;
 		handle->jh_blockcnt = be32_to_cpu(jh_sb->s_maxlen);
-		RtlCopyMemory(handle->jh_uuid, jh_sb, UUID_SIZE);
-		handle->jh_max_txn = be32_to_cpu(jh_sb->s_max_transaction);
+		RtlCopyMemory(handle->jh_uuid, jh_sb->s_uuid, UUID_SIZE);
+
+		/* Precompute the checksum state of the UUID prefix */
+		if (jbd2_has_csum_v2or3(handle))
+			handle->jh_csum_seed = jbd2_chksum(
+							handle,
+							~0,
+							jh_sb->s_uuid,
+							UUID_SIZE);
 		handle->jh_running_txn = NULL;
 		InitializeListHead(&handle->jh_txn_queue);
+		KeInitializeEvent(&handle->jh_txn_unlocked, NotificationEvent, TRUE);
+		drv_atomic_init(&handle->jh_updates, 0);
+		KeInitializeEvent(&handle->jh_updates_done, NotificationEvent, FALSE);
+		handle->jh_status = STATUS_SUCCESS;
+
+		KeInitializeEvent(&handle->jh_commit_wakeup, SynchronizationEvent, FALSE);
+		KeInitializeEvent(&handle->jh_fc_idle, SynchronizationEvent, TRUE);
+		handle->jh_commit_interval =
+			(__s64)JBD2_DEFAULT_COMMIT_INTERVAL * 10000000;
+		handle->jh_open_time = KeQueryInterruptTime();
+
+		/* A log not marked empty has to be replayed before logging */
+		handle->jh_next_tid = be32_to_cpu(jh_sb->s_sequence);
+		handle->jh_needs_recovery = jh_sb->s_start != 0;
 
 		/* Calculate the head, tail of logging area in journal */
 		handle->jh_start = be32_to_cpu(jh_sb->s_first);
 		handle->jh_end = handle->jh_blockcnt - 1;
+		if (jbd2_has_feature_fast_commit(jh_sb)) {
+			status = jbd2_fc_init_area(handle);
+			if (!NT_SUCCESS(status)) {
+				status = STATUS_DISK_CORRUPT_ERROR;
+				__leave;
+			}
+		}
+		jbd2_set_max_txn(handle);
 
 		/* Calculate the head, tail and nr. of blocks of free area in journal */
-		handle->jh_free_start = be32_to_cpu(jh_sb->s_first);
-		handle->jh_free_end = handle->jh_blockcnt - 1;
-		handle->jh_free_blockcnt = handle->jh_blockcnt - 1;
+		handle->jh_free_start = handle->jh_start;
+		handle->jh_free_end = handle->jh_end;
+		drv_atomic_init(
+			&handle->jh_free_blockcnt,
+			handle->jh_end - handle->jh_start + 1);
+		InitializeListHead(&handle->jh_space_waiters);
+
+		/* Each descriptor block carries the UUID with its first tag */
+		handle->jh_tags_per_descr = (int)((blocksize -
+					sizeof(journal_header_t) -
+					(jbd2_has_csum_v2or3(handle) ?
+						sizeof(journal_block_tail_t) : 0) -
+					UUID_SIZE) / jbd2_min_tag_size(handle));
+		handle->jh_commit_lbcbs = ExAllocatePoolWithTag(
+						NonPagedPool,
+						handle->jh_tags_per_descr * sizeof(jbd2_lbcb_t *),
+						JBD2_COMMIT_TAG);
+		handle->jh_commit_reqs = ExAllocatePoolWithTag(
+						NonPagedPool,
+						handle->jh_tags_per_descr * sizeof(struct drv_crc32_req),
+						JBD2_COMMIT_TAG);
+		if (!handle->jh_commit_lbcbs || !handle->jh_commit_reqs) {
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			__leave;
+		}
 
 		/* Initialize block table allocator and revoke table allocator */
 		ExInitializeNPagedLookasideList(
@@ -1261,19 +2414,12 @@ NTSTATUS jbd2_open_handle(
 				JBD2_LBCB_TABLE_TAG,
 				0);
 		lbcb_cache_inited = TRUE;
-		ExInitializeNPagedLookasideList(
-				&handle->jh_revoke_cache,
-				NULL,
-				NULL,
-				0,
-				sizeof(jbd2_revoke_entry_t),
-				JBD2_REVOKE_TABLE_TAG,
-				0);
-		revoke_cache_inited = TRUE;
 
-		/* Initialize block table and revoke table */
-		RB_INIT(&handle->jh_lbcb_table);
-		RB_INIT(&handle->jh_revoke_table);
+		/* The block table is initialized with the locks; the revoke
+		 * table is allocated on demand */
+
+		/* Nothing may fail after the thread is started */
+		status = jbd2_commit_thread_start(handle);
 	} __finally {
 		if (bcb)
 			CcUnpinData(bcb);
@@ -1281,12 +2427,18 @@ NTSTATUS jbd2_open_handle(
 		if (!NT_SUCCESS(status)) {
 			if (jh_sb)
 				ExFreePoolWithTag(jh_sb, JBD2_SUPERBLOCK_TAG);
-			if (lock_inited)
+			if (lock_inited) {
 				drv_mutex_destroy(&handle->jh_lock);
+				drv_mutex_destroy(&handle->jh_checkpoint_lock);
+				for (i = 0; i < JBD2_LBCB_SHARDS; i++)
+					drv_mutex_destroy(&handle->jh_lbcb_shards[i].ls_lock);
+			}
 			if (lbcb_cache_inited)
 				ExDeleteNPagedLookasideList(&handle->jh_lbcb_cache);
-			if (revoke_cache_inited)
-				ExDeleteNPagedLookasideList(&handle->jh_revoke_cache);
+			if (handle->jh_commit_lbcbs)
+				ExFreePoolWithTag(handle->jh_commit_lbcbs, JBD2_COMMIT_TAG);
+			if (handle->jh_commit_reqs)
+				ExFreePoolWithTag(handle->jh_commit_reqs, JBD2_COMMIT_TAG);
 
 			jbd2_cache_sync_uninit_map(log_file);
 			ExFreePoolWithTag(handle, JBD2_POOL_TAG);
@@ -1298,33 +2450,2195 @@ NTSTATUS jbd2_open_handle(
 	return status;
 }
 
-void jbd2_flush(
-		jbd2_handle_t *handle,
-		KEVENT *event,
-		NTSTATUS *status)
+/*
+ * Transactions go through the following states:
+ *
+ * TXN_RUNNING		Transaction handles join the transaction and log
+ *					blocks into it.
+ * TXN_LOCKED		The commit has started.  No handle may join; once
+ *					the handles still open have stopped, the logged blocks
+ *					are copied into the log cache.  New handles wait for
+ *					the copy to end, so no block changes under it.
+ * TXN_COMMITTING	The copy is done and handles start on a new running
+ *					transaction.  The copy is written to the log, then
+ *					the commit block behind it.
+ * TXN_CHECKPOINT	The transaction is on the checkpoint queue until its
+ *					blocks are written back to the client file.
+ *
+ * Only one thread commits at a time.  jbd2_flush() queues a waiter on
+ * the running transaction; if no thread is committing, the caller
+ * becomes the committer and keeps committing as long as the running
+ * transaction has waiters, so that flushes which arrive during a commit
+ * are served together by the next one.  While the handle is open that
+ * role belongs to the commit thread: jbd2_flush() only wakes it, and it
+ * also commits the running transaction once it is as old as the commit
+ * interval or its reservations near the size limit of a transaction.
+ *
+ * Every LBCB holds a repin of its bcb, so that the cache manager keeps
+ * the buffer until the block is checkpointed, and one reference for each
+ * of jl_txn, jl_next_txn and jl_cp_txn which is set.
+ *
+ * The LBCB table is split into shards by a hash of the block nr., so
+ * handles logging different blocks rarely contend.  The lock of a shard
+ * protects its tree and the state of the LBCBs in it; jt_lock protects
+ * the LBCB list of a running transaction, and jh_lock the checkpoint
+ * lists and queue.  Locks are taken in the order jh_checkpoint_lock,
+ * jh_lock, shard lock, jt_lock.
+ */
+
+/**
+ * @brief Allocate the next running transaction
+ * @param handle	Handle to journal file
+ * @return the transaction, or NULL if there isn't enough memory
+ */
+static jbd2_txn_t *
+jbd2_txn_alloc(jbd2_handle_t *handle)
 {
-	
+	jbd2_txn_t *txn;
+
+	txn = ExAllocatePoolWithTag(
+			NonPagedPool,
+			sizeof(jbd2_txn_t),
+			JBD2_TXN_TAG);
+	if (!txn)
+		return NULL;
+
+	RtlZeroMemory(txn, sizeof(jbd2_txn_t));
+	txn->jt_tid = handle->jh_next_tid++;
+	txn->jt_state = TXN_RUNNING;
+	drv_mutex_init(&txn->jt_lock);
+	InitializeListHead(&txn->jt_lbcb_list);
+	InitializeListHead(&txn->jt_cp_list);
+	InitializeListHead(&txn->jt_waiters);
+	drv_atomic_init(&txn->jt_logged_cnt, 0);
+	drv_atomic_init(&txn->jt_unwritten_cnt, 0);
+	drv_atomic_init(&txn->jt_reserved_cnt, 0);
+	txn->jt_start_time = KeQueryInterruptTime();
+	txn->jt_handle = handle;
+	return txn;
 }
 
-NTSTATUS jbd2_close_handle(jbd2_handle_t *handle)
+/**
+ * @brief Free a transaction
+ * @param txn	Transaction
+ */
+static void
+jbd2_txn_free(jbd2_txn_t *txn)
 {
-	NTSTATUS status = STATUS_UNSUCCESSFUL;
-	KEVENT event;
+	drv_mutex_destroy(&txn->jt_lock);
+	ExFreePoolWithTag(txn, JBD2_TXN_TAG);
+}
 
-	jbd2_flush(handle, &event, &status);
+/**
+ * @brief Move all the entries of @p list to the tail of @p head
+ */
+static void
+jbd2_list_splice_tail(LIST_ENTRY *list, LIST_ENTRY *head)
+{
+	if (IsListEmpty(list))
+		return;
+
+	list->Flink->Blink = head->Blink;
+	list->Blink->Flink = head;
+	head->Blink->Flink = list->Flink;
+	head->Blink = list->Blink;
+	InitializeListHead(list);
+}
 
-	ExFreePoolWithTag(handle->jh_sb, JBD2_SUPERBLOCK_TAG);
-	drv_mutex_destroy(&handle->jh_lock);
-	ExDeleteNPagedLookasideList(&handle->jh_lbcb_cache);
-	ExDeleteNPagedLookasideList(&handle->jh_revoke_cache);
-	jbd2_cache_sync_uninit_map(handle->jh_log_file);
-	ExFreePoolWithTag(handle, JBD2_POOL_TAG);
-	return status;
+/**
+ * @brief Signal and free the waiters on @p waiters
+ * @param waiters	List of jbd2_waiter_t
+ * @param status	Result of the commit
+ */
+static void
+jbd2_complete_waiters(LIST_ENTRY *waiters, NTSTATUS status)
+{
+	while (!IsListEmpty(waiters)) {
+		jbd2_waiter_t *waiter;
+
+		waiter = CONTAINING_RECORD(
+				RemoveHeadList(waiters),
+				jbd2_waiter_t,
+				jw_list_node);
+		*waiter->jw_status = status;
+		KeSetEvent(waiter->jw_event, IO_NO_INCREMENT, FALSE);
+		ExFreePoolWithTag(waiter, JBD2_WAITER_TAG);
+	}
 }
 
-/*
- * NOTES:
- *
- * It sounds better if we remove a transaction from checkpoint queue
- * when all its buffer is flushed to persistent storage...
+/**
+ * @brief	Set the maximum nr. of log blocks a transaction may take
+ * @remarks	s_max_transaction is only honored up to a quarter of the
+ *			logging area, so that a transaction handle which passes the
+ *			check in jbd2_txn_handle_start() always fits once the log
+ *			is empty.  Called again when the logging area shrinks.
+ * @param handle	Handle to journal file
+ */
+static void
+jbd2_set_max_txn(jbd2_handle_t *handle)
+{
+	__u32 max_txn = (handle->jh_end - handle->jh_start + 1) / 4;
+	__u32 sb_max_txn = be32_to_cpu(handle->jh_sb->s_max_transaction);
+
+	if (sb_max_txn && sb_max_txn < max_txn)
+		max_txn = sb_max_txn;
+	handle->jh_max_txn = max_txn;
+}
+
+/**
+ * @brief Calculate the maximum nr. of log blocks a transaction may take
+ * @param handle	Handle to journal file
+ */
+static jbd2_logblk_t
+jbd2_txn_max_blocks(jbd2_handle_t *handle)
+{
+	return handle->jh_max_txn;
+}
+
+/**
+ * @brief	Whether the running transaction may have @p reserved_cnt
+ *			blocks reserved in total
+ * @remarks	Called without jh_lock.  While the transaction runs, the
+ *			free block count only grows, so a reservation which fits
+ *			keeps fitting until the transaction commits.
  */
+static __bool
+jbd2_txn_has_room(
+	jbd2_handle_t *handle,
+	jbd2_logblk_t reserved_cnt)
+{
+	jbd2_logblk_t log_cnt;
+
+	log_cnt = jbd2_txn_log_blocks(handle, reserved_cnt);
+	return log_cnt <= jbd2_txn_max_blocks(handle) &&
+		log_cnt <= (jbd2_logblk_t)drv_atomic_read(&handle->jh_free_blockcnt);
+}
+
+/**
+ * @brief	Find the oldest transaction still needed in the log
+ * @remarks	jh_lock must be held.
+ * @param handle	Handle to journal file
+ * @param tid		ID of the transaction returned
+ * @param start		Log block of the transaction returned
+ */
+static void
+jbd2_log_tail(
+	jbd2_handle_t *handle,
+	jbd2_tid_t *tid,
+	jbd2_logblk_t *start)
+{
+	jbd2_txn_t *txn = NULL;
+
+	if (!IsListEmpty(&handle->jh_txn_queue))
+		txn = CONTAINING_RECORD(
+				handle->jh_txn_queue.Flink,
+				jbd2_txn_t,
+				jt_list_node);
+	else if (handle->jh_committing_txn)
+		txn = handle->jh_committing_txn;
+
+	if (txn) {
+		*tid = txn->jt_tid;
+		*start = txn->jt_start_blk;
+	} else {
+		/* Nothing left, the next commit goes to the free area */
+		*tid = handle->jh_running_txn ?
+				handle->jh_running_txn->jt_tid :
+				handle->jh_next_tid;
+		*start = handle->jh_free_start;
+	}
+}
+
+/**
+ * @brief	Allocate the log blocks of a transaction
+ * @remarks	jh_lock must be held, and the blocks must have been
+ *			reserved.  The range only splits where the log wraps at
+ *			jh_end, so the transaction takes at most two sequential
+ *			writes.
+ * @param handle	Handle to journal file
+ * @param nr_blocks	Nr. of log blocks
+ * @return	First log block of the range
+ */
+static jbd2_logblk_t
+jbd2_log_alloc(
+	jbd2_handle_t *handle,
+	jbd2_logblk_t nr_blocks)
+{
+	jbd2_logblk_t start = handle->jh_free_start;
+	jbd2_logblk_t nr_used;
+
+	NT_ASSERT(nr_blocks <=
+		(jbd2_logblk_t)drv_atomic_read(&handle->jh_free_blockcnt));
+	if (start + nr_blocks > handle->jh_end + 1)
+		handle->jh_nr_log_wraps++;
+
+	handle->jh_free_start += nr_blocks;
+	jbd2_wrap(handle, handle->jh_free_start);
+	drv_atomic_sub(&handle->jh_free_blockcnt, nr_blocks);
+	nr_used = handle->jh_end - handle->jh_start + 1 -
+		(jbd2_logblk_t)drv_atomic_read(&handle->jh_free_blockcnt);
+
+	handle->jh_nr_log_allocs++;
+	handle->jh_log_used_sum += nr_used;
+	if (nr_used > handle->jh_log_peak_used)
+		handle->jh_log_peak_used = nr_used;
+	return start;
+}
+
+/**
+ * @brief	Give back the log blocks of checkpointed transactions
+ * @remarks	jh_lock must be held.
+ * @param handle	Handle to journal file
+ * @param nr_blocks	Nr. of log blocks freed
+ * @param tail_start	Log block of the oldest transaction left, or
+ *						jh_free_start if none
+ */
+static void
+jbd2_log_free(
+	jbd2_handle_t *handle,
+	jbd2_logblk_t nr_blocks,
+	jbd2_logblk_t tail_start)
+{
+	drv_atomic_add(&handle->jh_free_blockcnt, nr_blocks);
+	handle->jh_free_end = (tail_start > handle->jh_start ?
+				tail_start : handle->jh_end + 1) - 1;
+}
+
+/**
+ * @brief	Write the descriptor and data blocks of a locked transaction
+ *			to the log cache
+ * @remarks	The blocks of a descriptor are checksummed in one batch
+ *			from the client buffers before the descriptor is filled.
+ *			A block starting with the JBD2 magic number is logged with
+ *			the magic number cleared and JBD2_FLAG_ESCAPE set.
+ * @param handle	Handle to journal file
+ * @param txn		Transaction
+ * @param writer	Log writer set up for the blocks
+ * @param blocknr_ret	Log block following the last one written
+ * @param crc32_sum	Checksum v1 of the blocks written, if enabled
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_commit_write_blocks(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn,
+		struct jbd2_log_writer *writer,
+		jbd2_logblk_t *blocknr_ret,
+		__u32 *crc32_sum)
+{
+	static const __u32 zero = 0;
+	jbd2_lbcb_t **lbcbs = handle->jh_commit_lbcbs;
+	struct drv_crc32_req *reqs = handle->jh_commit_reqs;
+	__bool has_csum = jbd2_has_csum_v2or3(handle);
+	__bool has_csum_v1 = jbd2_has_csum_v1(handle);
+	__be32 magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+	jbd2_logblk_t blocknr = txn->jt_start_blk;
+	LIST_ENTRY *entry = txn->jt_lbcb_list.Flink;
+	__u32 prefix = 0;
+	NTSTATUS status;
+	int i, nr;
+
+	if (has_csum)
+		prefix = jbd2_block_csum_prefix(handle, txn->jt_tid);
+	*crc32_sum = ~0U;
+
+	while (entry != &txn->jt_lbcb_list) {
+		journal_header_t *hdr;
+		char *tagp;
+		void *buf;
+
+		/* Gather the blocks described by the next descriptor */
+		for (nr = 0;
+			nr < handle->jh_tags_per_descr && entry != &txn->jt_lbcb_list;
+			nr++, entry = entry->Flink) {
+
+			lbcbs[nr] = CONTAINING_RECORD(
+						entry,
+						jbd2_lbcb_t,
+						jl_txn_list_node);
+			reqs[nr].cr_seed = 0;
+			reqs[nr].cr_buf = lbcbs[nr]->jl_data;
+			reqs[nr].cr_len = handle->jh_blocksize;
+			reqs[nr].cr_crc = 0;
+		}
+		if (has_csum)
+			jbd2_chksum_multi(handle, reqs, nr);
+
+		status = jbd2_log_writer_get(writer, blocknr, &hdr);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		hdr->h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+		hdr->h_blocktype = cpu_to_be32(JBD2_DESCRIPTOR_BLOCK);
+		hdr->h_sequence = cpu_to_be32(txn->jt_tid);
+
+		tagp = (char *)(hdr + 1);
+		for (i = 0; i < nr; i++) {
+			__u32 flags = 0;
+			char *data = lbcbs[i]->jl_data;
+
+			if (i)
+				flags |= JBD2_FLAG_SAME_UUID;
+			if (i == nr - 1)
+				flags |= JBD2_FLAG_LAST_TAG;
+
+			/* The tag checksum covers the block as logged */
+			if (*(__be32 *)data == magic) {
+				flags |= JBD2_FLAG_ESCAPE;
+				if (has_csum)
+					reqs[i].cr_crc = jbd2_chksum(
+							handle,
+							jbd2_chksum(handle, 0, &zero, sizeof(zero)),
+							data + sizeof(zero),
+							handle->jh_blocksize - sizeof(zero));
+			}
+
+			jbd2_tag_fill(
+				handle,
+				tagp,
+				lbcbs[i]->jl_header.th_block,
+				flags,
+				has_csum ? prefix ^ reqs[i].cr_crc : 0);
+			tagp += jbd2_tag_size(handle, tagp);
+		}
+
+		if (has_csum) {
+			journal_block_tail_t *tail;
+			tail = (journal_block_tail_t *)((char *)hdr +
+				handle->jh_blocksize - sizeof(journal_block_tail_t));
+			tail->t_checksum = cpu_to_be32(jbd2_metadata_chksum(
+						handle,
+						hdr,
+						handle->jh_blocksize - sizeof(journal_block_tail_t)));
+		}
+		if (has_csum_v1)
+			*crc32_sum = jbd2_crc32_be(*crc32_sum, hdr, handle->jh_blocksize);
+		blocknr++;
+		jbd2_wrap(handle, blocknr);
+
+		for (i = 0; i < nr; i++) {
+			status = jbd2_log_writer_get(writer, blocknr, &buf);
+			if (!NT_SUCCESS(status))
+				return status;
+
+			RtlCopyMemory(buf, lbcbs[i]->jl_data, handle->jh_blocksize);
+			if (*(__be32 *)buf == magic)
+				*(__be32 *)buf = 0;
+			if (has_csum_v1)
+				*crc32_sum = jbd2_crc32_be(*crc32_sum, buf, handle->jh_blocksize);
+
+			blocknr++;
+			jbd2_wrap(handle, blocknr);
+		}
+	}
+
+	*blocknr_ret = blocknr;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Fill the commit block of a transaction
+ * @param handle	Handle to journal file
+ * @param txn		Transaction
+ * @param commit	Buffer of the commit block
+ * @param crc32_sum	Checksum v1 of the blocks of the transaction
+ */
+static void
+jbd2_commit_fill_commit_block(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn,
+		journal_commit_header_t *commit,
+		__u32 crc32_sum)
+{
+	LARGE_INTEGER now;
+	__u64 unix_time;
+
+	commit->h_header.h_magic = cpu_to_be32(JBD2_MAGIC_NUMBER);
+	commit->h_header.h_blocktype = cpu_to_be32(JBD2_COMMIT_BLOCK);
+	commit->h_header.h_sequence = cpu_to_be32(txn->jt_tid);
+
+	/* 100ns intervals since 1601 to ns since 1970 */
+	KeQuerySystemTime(&now);
+	unix_time = (__u64)(now.QuadPart - 116444736000000000LL);
+	commit->h_commit_sec = cpu_to_be64(unix_time / 10000000);
+	commit->h_commit_nsec = cpu_to_be32((__u32)(unix_time % 10000000) * 100);
+
+	if (jbd2_has_csum_v1(handle)) {
+		commit->h_chksum_type = JBD2_CRC32_CHKSUM;
+		commit->h_chksum_size = JBD2_CRC32_CHKSUM_SIZE;
+		commit->h_chksum[0] = cpu_to_be32(crc32_sum);
+	}
+
+	if (jbd2_has_csum_v2or3(handle))
+		commit->h_chksum[0] = cpu_to_be32(jbd2_metadata_chksum(
+					handle,
+					commit,
+					FIELD_OFFSET(journal_commit_header_t, h_chksum)));
+}
+
+/**
+ * @brief Write the commit block of a transaction to disk
+ * @param handle	Handle to journal file
+ * @param txn		Transaction
+ * @param blocknr	Log block of the commit block
+ * @param crc32_sum	Checksum v1 of the blocks of the transaction
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_commit_write_commit_block(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn,
+		jbd2_logblk_t blocknr,
+		__u32 crc32_sum)
+{
+	struct jbd2_log_writer writer;
+	journal_commit_header_t *commit;
+	NTSTATUS status;
+
+	jbd2_log_writer_init(&writer, handle, 1);
+	status = jbd2_log_writer_get(&writer, blocknr, &commit);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	jbd2_commit_fill_commit_block(handle, txn, commit, crc32_sum);
+	jbd2_log_writer_release(&writer);
+	return jbd2_log_flush(handle, blocknr, 1);
+}
+
+/**
+ * @brief	Hand the LBCBs of a committed transaction over to the
+ *			checkpoint, and queue the transaction for checkpointing
+ * @remarks	jh_lock must be held.
+ * @param handle	Handle to journal file
+ * @param txn		Transaction
+ */
+static void
+jbd2_commit_finish(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn)
+{
+	while (!IsListEmpty(&txn->jt_lbcb_list)) {
+		jbd2_lbcb_shard_t *shard;
+		jbd2_lbcb_t *lbcb;
+
+		lbcb = CONTAINING_RECORD(
+				RemoveHeadList(&txn->jt_lbcb_list),
+				jbd2_lbcb_t,
+				jl_txn_list_node);
+		shard = jbd2_lbcb_shard(handle, lbcb->jl_header.th_block);
+		drv_mutex_acquire(&shard->ls_lock, TRUE);
+
+		/* This copy supersedes the one of an older transaction */
+		if (lbcb->jl_cp_txn) {
+			RemoveEntryList(&lbcb->jl_cp_txn_list_node);
+			lbcb->jl_cp_txn = NULL;
+			jbd2_lbcb_put(handle, lbcb);
+		}
+		lbcb->jl_cp_txn = txn;
+		InsertTailList(&txn->jt_cp_list, &lbcb->jl_cp_txn_list_node);
+
+		/* Logged again by the running transaction during the commit */
+		lbcb->jl_txn = lbcb->jl_next_txn;
+		lbcb->jl_next_txn = NULL;
+		if (lbcb->jl_txn) {
+			drv_mutex_acquire(&lbcb->jl_txn->jt_lock, TRUE);
+			InsertTailList(
+				&lbcb->jl_txn->jt_lbcb_list,
+				&lbcb->jl_txn_list_node);
+			drv_mutex_release(&lbcb->jl_txn->jt_lock);
+		}
+		drv_mutex_release(&shard->ls_lock);
+	}
+
+	txn->jt_state = TXN_CHECKPOINT;
+	handle->jh_committing_txn = NULL;
+	InsertTailList(&handle->jh_txn_queue, &txn->jt_list_node);
+}
+
+/**
+ * @brief Commit the running transaction
+ * @remarks	The descriptor and data blocks go to the log as one
+ *			sequential write.  The commit block is written after it
+ *			has completed, so a commit block on disk always follows a
+ *			complete transaction.  With async commit the commit block
+ *			is part of the same write instead, and recovery relies on
+ *			the block checksums to tell whether it is complete.
+ * @param handle	Handle to journal file
+ * @param txn		The running transaction
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_commit_txn(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn)
+{
+	struct jbd2_log_writer writer;
+	jbd2_logblk_t nr_blocks, log_cnt, blocknr;
+	__u64 start_time = KeQueryInterruptTime();
+	journal_commit_header_t *commit;
+	LIST_ENTRY waiters;
+	__u32 crc32_sum;
+	NTSTATUS status;
+	__bool wait, async;
+
+	InitializeListHead(&waiters);
+
+	/* Stop new handles from joining and wait for those still open */
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	txn->jt_state = TXN_LOCKED;
+	KeClearEvent(&handle->jh_txn_unlocked);
+	KeClearEvent(&handle->jh_updates_done);
+	wait = InterlockedExchangeAdd(
+				(PLONG)&handle->jh_updates.counter,
+				JBD2_UPDATES_LOCKED) != 0;
+	drv_mutex_release(&handle->jh_lock);
+
+	if (wait)
+		KeWaitForSingleObject(
+			&handle->jh_updates_done,
+			Executive,
+			KernelMode,
+			FALSE,
+			NULL);
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	nr_blocks = (jbd2_logblk_t)drv_atomic_read(&txn->jt_logged_cnt);
+	if (!nr_blocks) {
+		/* Nothing logged; no transaction was created meanwhile */
+		handle->jh_running_txn = NULL;
+		handle->jh_next_tid = txn->jt_tid;
+		jbd2_list_splice_tail(&txn->jt_waiters, &waiters);
+		drv_atomic_sub(&handle->jh_updates, JBD2_UPDATES_LOCKED);
+		KeSetEvent(&handle->jh_txn_unlocked, IO_NO_INCREMENT, FALSE);
+		drv_mutex_release(&handle->jh_lock);
+
+		jbd2_complete_waiters(&waiters, STATUS_SUCCESS);
+		jbd2_txn_free(txn);
+		return STATUS_SUCCESS;
+	}
+
+	/* Reserved by the credits of the transaction handles */
+	log_cnt = jbd2_txn_log_blocks(handle, nr_blocks);
+	txn->jt_start_blk = jbd2_log_alloc(handle, log_cnt);
+	txn->jt_log_cnt = log_cnt;
+	handle->jh_committing_txn = txn;
+	drv_mutex_release(&handle->jh_lock);
+
+	async = jbd2_has_feature_async_commit(handle->jh_sb);
+	jbd2_log_writer_init(&writer, handle, async ? log_cnt : log_cnt - 1);
+	status = jbd2_commit_write_blocks(
+				handle,
+				txn,
+				&writer,
+				&blocknr,
+				&crc32_sum);
+	if (NT_SUCCESS(status) && async) {
+		status = jbd2_log_writer_get(&writer, blocknr, &commit);
+		if (NT_SUCCESS(status))
+			jbd2_commit_fill_commit_block(handle, txn, commit, crc32_sum);
+	}
+	jbd2_log_writer_release(&writer);
+
+	/* The blocks are copied; let new handles start */
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	txn->jt_state = TXN_COMMITTING;
+	handle->jh_running_txn = NULL;
+	drv_atomic_sub(&handle->jh_updates, JBD2_UPDATES_LOCKED);
+	KeSetEvent(&handle->jh_txn_unlocked, IO_NO_INCREMENT, FALSE);
+	drv_mutex_release(&handle->jh_lock);
+
+	if (NT_SUCCESS(status) && !async)
+		status = jbd2_log_flush(handle, txn->jt_start_blk, log_cnt - 1);
+
+	/*
+	 * An empty log has to be pointed at the transaction first.  Stale
+	 * blocks the superblock may then point at carry older IDs, so it
+	 * is fine for it to go first with async commit.
+	 */
+	if (NT_SUCCESS(status)) {
+		drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+		if (!handle->jh_sb->s_start)
+			status = jbd2_write_superblock(
+						handle,
+						txn->jt_tid,
+						txn->jt_start_blk);
+		drv_mutex_release(&handle->jh_checkpoint_lock);
+	}
+
+	if (NT_SUCCESS(status)) {
+		if (async)
+			status = jbd2_log_flush(handle, txn->jt_start_blk, log_cnt);
+		else
+			status = jbd2_commit_write_commit_block(
+						handle,
+						txn,
+						blocknr,
+						crc32_sum);
+	}
+
+	if (NT_SUCCESS(status) && handle->after_commit)
+		handle->after_commit(handle, txn);
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	if (!NT_SUCCESS(status) && NT_SUCCESS(handle->jh_status))
+		handle->jh_status = status;
+	if (NT_SUCCESS(status)) {
+		handle->jh_nr_commits++;
+		handle->jh_nr_commit_blocks += nr_blocks;
+		handle->jh_commit_time += KeQueryInterruptTime() - start_time;
+	}
+
+	jbd2_commit_finish(handle, txn);
+	jbd2_list_splice_tail(&txn->jt_waiters, &waiters);
+	drv_mutex_release(&handle->jh_lock);
+
+	jbd2_complete_waiters(&waiters, status);
+	return status;
+}
+
+/**
+ * @brief	Whether the running transaction reserved enough blocks to
+ *			be committed before its interval elapses
+ */
+static __bool
+jbd2_txn_nearly_full(jbd2_handle_t *handle, jbd2_txn_t *txn)
+{
+	jbd2_logblk_t max_blocks = jbd2_txn_max_blocks(handle);
+	jbd2_logblk_t reserved_cnt;
+
+	reserved_cnt = (jbd2_logblk_t)drv_atomic_read(&txn->jt_reserved_cnt);
+	return jbd2_txn_log_blocks(handle, reserved_cnt) >=
+		max_blocks - max_blocks / 4;
+}
+
+/**
+ * @brief	Calculate how long the running transaction may stay
+ *			uncommitted
+ * @remarks	jh_lock must be held.
+ * @param handle	Handle to journal file
+ * @return	0 if the running transaction is to be committed now,
+ *			otherwise the time to wait in 100ns units.
+ */
+static __s64
+jbd2_commit_delay(jbd2_handle_t *handle)
+{
+	jbd2_txn_t *txn = handle->jh_running_txn;
+	__s64 age;
+
+	if (!txn || !NT_SUCCESS(handle->jh_status))
+		return handle->jh_commit_interval;
+	if (!IsListEmpty(&txn->jt_waiters))
+		return 0;
+	if (!drv_atomic_read(&txn->jt_logged_cnt))
+		return handle->jh_commit_interval;
+	if (jbd2_txn_nearly_full(handle, txn))
+		return 0;
+
+	age = (__s64)(KeQueryInterruptTime() - txn->jt_start_time);
+	return age >= handle->jh_commit_interval ?
+		0 : handle->jh_commit_interval - age;
+}
+
+/**
+ * @brief	Commit the running transaction for as long as it has
+ *			waiters or is due, then give up the role of committer
+ * @param handle	Handle to journal file
+ */
+static void
+jbd2_commit_loop(jbd2_handle_t *handle)
+{
+	LIST_ENTRY waiters;
+	jbd2_txn_t *txn;
+	NTSTATUS status;
+
+	InitializeListHead(&waiters);
+	for (;;) {
+		drv_mutex_acquire(&handle->jh_lock, TRUE);
+		txn = handle->jh_running_txn;
+		status = handle->jh_status;
+		if (!txn || jbd2_commit_delay(handle) || !NT_SUCCESS(status)) {
+			if (txn && !NT_SUCCESS(status))
+				jbd2_list_splice_tail(&txn->jt_waiters, &waiters);
+			handle->jh_committing = FALSE;
+			drv_mutex_release(&handle->jh_lock);
+			break;
+		}
+		drv_mutex_release(&handle->jh_lock);
+
+		jbd2_commit_txn(handle, txn);
+	}
+
+	jbd2_complete_waiters(&waiters, status);
+}
+
+/* Largest write issued by a checkpoint */
+#define JBD2_CHECKPOINT_MAX_IO		(1024 * 1024)
+
+static void
+jbd2_lbcb_sift_down(
+		jbd2_lbcb_t **lbcbs,
+		size_t root,
+		size_t nr)
+{
+	jbd2_lbcb_t *tmp;
+	size_t child;
+
+	while ((child = 2 * root + 1) < nr) {
+		if (child + 1 < nr &&
+		    lbcbs[child]->jl_header.th_block <
+				lbcbs[child + 1]->jl_header.th_block)
+			child++;
+		if (lbcbs[root]->jl_header.th_block >=
+				lbcbs[child]->jl_header.th_block)
+			break;
+
+		tmp = lbcbs[root];
+		lbcbs[root] = lbcbs[child];
+		lbcbs[child] = tmp;
+		root = child;
+	}
+}
+
+/**
+ * @brief	Sort LBCBs by block nr. in client file
+ * @remarks	Heapsort, like jbd2_replay_rec_sort().
+ * @param lbcbs	Array of LBCBs
+ * @param nr	Nr. of LBCBs
+ */
+static void
+jbd2_lbcb_sort(
+		jbd2_lbcb_t **lbcbs,
+		size_t nr)
+{
+	jbd2_lbcb_t *tmp;
+	size_t i;
+
+	if (nr < 2)
+		return;
+
+	for (i = nr / 2; i-- > 0; )
+		jbd2_lbcb_sift_down(lbcbs, i, nr);
+
+	for (i = nr - 1; i > 0; i--) {
+		tmp = lbcbs[0];
+		lbcbs[0] = lbcbs[i];
+		lbcbs[i] = tmp;
+		jbd2_lbcb_sift_down(lbcbs, 0, i);
+	}
+}
+
+/**
+ * @brief	Write sorted LBCBs back to the client file, each run of
+ *			consecutive blocks with a single write
+ * @remarks	The repins are dropped first, which leaves the blocks
+ *			dirty in the cache, and the run is then flushed.  Blocks
+ *			that are not in @p lbcbs never join a run, since they may
+ *			hold changes not committed yet.
+ * @param handle	Handle to journal file
+ * @param lbcbs		LBCBs sorted by jbd2_lbcb_sort()
+ * @param nr		Nr. of LBCBs
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_checkpoint_write(
+		jbd2_handle_t *handle,
+		jbd2_lbcb_t **lbcbs,
+		size_t nr)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	size_t max_run = JBD2_CHECKPOINT_MAX_IO / handle->jh_blocksize;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER offset;
+	size_t start, i;
+
+	if (!max_run)
+		max_run = 1;
+
+	for (start = 0; start < nr; start = i) {
+		for (i = start; i < nr && i - start < max_run; i++) {
+			if (i > start &&
+			    lbcbs[i]->jl_header.th_block !=
+					lbcbs[i - 1]->jl_header.th_block + 1)
+				break;
+
+			CcUnpinRepinnedBcb(lbcbs[i]->jl_bcb, FALSE, &iosb);
+			lbcbs[i]->jl_bcb = NULL;
+		}
+
+		offset.QuadPart = blocknr_to_offset(
+					lbcbs[start]->jl_header.th_block,
+					handle->jh_blocksize);
+		CcFlushCache(
+			handle->jh_client_file->SectionObjectPointer,
+			&offset,
+			(ULONG)((i - start) * handle->jh_blocksize),
+			&iosb);
+		if (!NT_SUCCESS(iosb.Status) && NT_SUCCESS(status))
+			status = iosb.Status;
+	}
+	return status;
+}
+
+/**
+ * @brief	Mark the LBCBs of a committed transaction as being written
+ *			back, unless it has blocks logged again by a transaction
+ *			not committed yet
+ * @remarks	jh_lock must be held.  Writing those back would expose
+ *			uncommitted changes, so the marks are undone then.
+ * @param handle	Handle to journal file
+ * @param txn		Transaction on the checkpoint queue
+ * @param nr_lbcbs	Incremented by the nr. of LBCBs marked
+ * @return	FALSE if the transaction cannot be checkpointed yet
+ */
+static __bool
+jbd2_txn_cp_mark(
+		jbd2_handle_t *handle,
+		jbd2_txn_t *txn,
+		size_t *nr_lbcbs)
+{
+	LIST_ENTRY *entry, *blocked = NULL;
+	jbd2_lbcb_shard_t *shard;
+	jbd2_lbcb_t *lbcb;
+	size_t nr = 0;
+
+	for (entry = txn->jt_cp_list.Flink;
+		entry != &txn->jt_cp_list;
+		entry = entry->Flink) {
+
+		lbcb = CONTAINING_RECORD(entry, jbd2_lbcb_t, jl_cp_txn_list_node);
+		shard = jbd2_lbcb_shard(handle, lbcb->jl_header.th_block);
+		drv_mutex_acquire(&shard->ls_lock, TRUE);
+		if (lbcb->jl_txn)
+			blocked = entry;
+		else
+			lbcb->jl_writing = TRUE;
+		drv_mutex_release(&shard->ls_lock);
+		if (blocked)
+			break;
+		nr++;
+	}
+	if (!blocked) {
+		*nr_lbcbs += nr;
+		return TRUE;
+	}
+
+	/* Handles which saw the marks retry once the checkpoint lock is free */
+	for (entry = txn->jt_cp_list.Flink;
+		entry != blocked;
+		entry = entry->Flink) {
+
+		lbcb = CONTAINING_RECORD(entry, jbd2_lbcb_t, jl_cp_txn_list_node);
+		shard = jbd2_lbcb_shard(handle, lbcb->jl_header.th_block);
+		drv_mutex_acquire(&shard->ls_lock, TRUE);
+		lbcb->jl_writing = FALSE;
+		drv_mutex_release(&shard->ls_lock);
+	}
+	return FALSE;
+}
+
+/**
+ * @brief	Write back the blocks of the committed transactions at the
+ *			head of the checkpoint queue, then move the tail of the log
+ *			past all of them with one superblock update
+ * @remarks	An LBCB is only on the checkpoint list of the last
+ *			transaction which committed it, so each block is written
+ *			once however many transactions logged it.  The blocks of all
+ *			the transactions are written together in client block order.
+ *			If no memory is left to sort them, each block is written on
+ *			its own.
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS if the checkpoint queue is emptied,
+ *			STATUS_PENDING if the oldest transaction left has blocks
+ *			logged again by the running transaction, which has to be
+ *			committed first, otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_checkpoint(jbd2_handle_t *handle)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	jbd2_logblk_t nr_freed = 0;
+	jbd2_lbcb_t **lbcbs = NULL;
+	size_t nr_lbcbs = 0, i;
+	IO_STATUS_BLOCK iosb;
+	jbd2_logblk_t tail_start;
+	jbd2_tid_t tail_tid;
+	LIST_ENTRY txns, *entry;
+	__bool blocked = FALSE;
+	jbd2_lbcb_t *lbcb;
+	jbd2_txn_t *txn;
+
+	InitializeListHead(&txns);
+
+	drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	status = handle->jh_status;
+	while (NT_SUCCESS(status) && !IsListEmpty(&handle->jh_txn_queue)) {
+		txn = CONTAINING_RECORD(
+				handle->jh_txn_queue.Flink,
+				jbd2_txn_t,
+				jt_list_node);
+
+		/* Handles logging these blocks wait until they are written */
+		if (!jbd2_txn_cp_mark(handle, txn, &nr_lbcbs)) {
+			blocked = TRUE;
+			break;
+		}
+		RemoveEntryList(&txn->jt_list_node);
+		InsertTailList(&txns, &txn->jt_list_node);
+		nr_freed += txn->jt_log_cnt;
+	}
+	drv_mutex_release(&handle->jh_lock);
+
+	if (IsListEmpty(&txns))
+		goto out;
+
+	if (nr_lbcbs)
+		lbcbs = ExAllocatePoolWithTag(
+				NonPagedPool,
+				nr_lbcbs * sizeof(jbd2_lbcb_t *),
+				JBD2_CHECKPOINT_TAG);
+
+	/* No other thread moves an LBCB being written */
+	i = 0;
+	for (entry = txns.Flink; entry != &txns; entry = entry->Flink) {
+		LIST_ENTRY *cp_entry;
+
+		txn = CONTAINING_RECORD(entry, jbd2_txn_t, jt_list_node);
+		for (cp_entry = txn->jt_cp_list.Flink;
+			cp_entry != &txn->jt_cp_list;
+			cp_entry = cp_entry->Flink) {
+
+			lbcb = CONTAINING_RECORD(cp_entry, jbd2_lbcb_t, jl_cp_txn_list_node);
+			if (lbcbs) {
+				lbcbs[i++] = lbcb;
+				continue;
+			}
+
+			CcUnpinRepinnedBcb(lbcb->jl_bcb, TRUE, &iosb);
+			lbcb->jl_bcb = NULL;
+			if (!NT_SUCCESS(iosb.Status) && NT_SUCCESS(status))
+				status = iosb.Status;
+		}
+	}
+	if (lbcbs) {
+		jbd2_lbcb_sort(lbcbs, nr_lbcbs);
+		status = jbd2_checkpoint_write(handle, lbcbs, nr_lbcbs);
+		ExFreePoolWithTag(lbcbs, JBD2_CHECKPOINT_TAG);
+	}
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	while (!IsListEmpty(&txns)) {
+		txn = CONTAINING_RECORD(
+				RemoveHeadList(&txns),
+				jbd2_txn_t,
+				jt_list_node);
+		while (!IsListEmpty(&txn->jt_cp_list)) {
+			jbd2_lbcb_shard_t *shard;
+
+			lbcb = CONTAINING_RECORD(
+					RemoveHeadList(&txn->jt_cp_list),
+					jbd2_lbcb_t,
+					jl_cp_txn_list_node);
+			shard = jbd2_lbcb_shard(handle, lbcb->jl_header.th_block);
+			drv_mutex_acquire(&shard->ls_lock, TRUE);
+			lbcb->jl_writing = FALSE;
+			lbcb->jl_data = NULL;
+			lbcb->jl_cp_txn = NULL;
+			jbd2_lbcb_put(handle, lbcb);
+			drv_mutex_release(&shard->ls_lock);
+		}
+		jbd2_txn_free(txn);
+	}
+
+	/* The transactions stay in the log for the next recovery */
+	if (!NT_SUCCESS(status)) {
+		if (NT_SUCCESS(handle->jh_status))
+			handle->jh_status = status;
+		drv_mutex_release(&handle->jh_lock);
+		goto out;
+	}
+
+	jbd2_log_tail(handle, &tail_tid, &tail_start);
+	jbd2_log_free(handle, nr_freed, tail_start);
+	drv_mutex_release(&handle->jh_lock);
+
+	status = jbd2_write_superblock(handle, tail_tid, tail_start);
+
+out:
+	drv_mutex_release(&handle->jh_checkpoint_lock);
+	if (NT_SUCCESS(status) && blocked)
+		status = STATUS_PENDING;
+	return status;
+}
+
+/**
+ * @brief	Whether the log is short enough of space for the commit
+ *			thread to checkpoint
+ * @remarks	jh_lock must be held.
+ */
+static __bool
+jbd2_log_low(jbd2_handle_t *handle)
+{
+	return (jbd2_logblk_t)drv_atomic_read(&handle->jh_free_blockcnt) <
+		2 * jbd2_txn_max_blocks(handle);
+}
+
+/**
+ * @brief	Commit the running transaction and checkpoint the log until
+ *			the checkpoint queue is empty
+ * @remarks	The caller holds the role of committer.
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_log_make_space(jbd2_handle_t *handle)
+{
+	NTSTATUS status;
+	jbd2_txn_t *txn;
+
+	do {
+		drv_mutex_acquire(&handle->jh_lock, TRUE);
+		txn = handle->jh_running_txn;
+		status = handle->jh_status;
+		drv_mutex_release(&handle->jh_lock);
+
+		if (txn && NT_SUCCESS(status))
+			status = jbd2_commit_txn(handle, txn);
+		if (NT_SUCCESS(status))
+			status = jbd2_checkpoint(handle);
+	} while (status == STATUS_PENDING);
+
+	return status;
+}
+
+/**
+ * @brief	Body of the commit thread, which commits the running
+ *			transaction once it is flushed, nearly full or as old as
+ *			the commit interval, checkpoints when the log runs low and
+ *			frees log space for the handles waiting for it
+ * @param context	Handle to journal file
+ */
+static VOID
+jbd2_commit_thread(PVOID context)
+{
+	jbd2_handle_t *handle = context;
+	LARGE_INTEGER timeout;
+	LIST_ENTRY waiters;
+	NTSTATUS status;
+
+	InitializeListHead(&waiters);
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	for (;;) {
+		if (!IsListEmpty(&handle->jh_space_waiters)) {
+			jbd2_list_splice_tail(&handle->jh_space_waiters, &waiters);
+			handle->jh_committing = TRUE;
+			drv_mutex_release(&handle->jh_lock);
+
+			status = jbd2_log_make_space(handle);
+			jbd2_complete_waiters(&waiters, status);
+
+			drv_mutex_acquire(&handle->jh_lock, TRUE);
+			handle->jh_committing = FALSE;
+			continue;
+		}
+		if (handle->jh_commit_stop)
+			break;
+
+		timeout.QuadPart = -jbd2_commit_delay(handle);
+		if (!timeout.QuadPart && !handle->jh_committing) {
+			handle->jh_committing = TRUE;
+			drv_mutex_release(&handle->jh_lock);
+
+			jbd2_commit_loop(handle);
+
+			/* Free log space before handles have to wait for it */
+			drv_mutex_acquire(&handle->jh_lock, TRUE);
+			if (jbd2_log_low(handle)) {
+				drv_mutex_release(&handle->jh_lock);
+				jbd2_checkpoint(handle);
+				drv_mutex_acquire(&handle->jh_lock, TRUE);
+			}
+			continue;
+		}
+		if (!timeout.QuadPart)
+			timeout.QuadPart = -handle->jh_commit_interval;
+		drv_mutex_release(&handle->jh_lock);
+
+		KeWaitForSingleObject(
+			&handle->jh_commit_wakeup,
+			Executive,
+			KernelMode,
+			FALSE,
+			&timeout);
+		drv_mutex_acquire(&handle->jh_lock, TRUE);
+	}
+	drv_mutex_release(&handle->jh_lock);
+
+	PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/**
+ * @brief Start the commit thread of @p handle
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_commit_thread_start(jbd2_handle_t *handle)
+{
+	HANDLE thread_handle;
+	NTSTATUS status;
+
+	status = PsCreateSystemThread(
+				&thread_handle,
+				THREAD_ALL_ACCESS,
+				NULL,
+				NULL,
+				NULL,
+				jbd2_commit_thread,
+				handle);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = ObReferenceObjectByHandle(
+				thread_handle,
+				THREAD_ALL_ACCESS,
+				NULL,
+				KernelMode,
+				(PVOID *)&handle->jh_commit_thread,
+				NULL);
+	if (!NT_SUCCESS(status)) {
+		handle->jh_commit_stop = TRUE;
+		KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+		ZwWaitForSingleObject(thread_handle, FALSE, NULL);
+	}
+	ZwClose(thread_handle);
+	return status;
+}
+
+/**
+ * @brief	Stop the commit thread of @p handle; commits are made by
+ *			the callers of jbd2_flush() from then on
+ * @param handle	Handle to journal file
+ */
+static void
+jbd2_commit_thread_stop(jbd2_handle_t *handle)
+{
+	PKTHREAD thread;
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	handle->jh_commit_stop = TRUE;
+	thread = handle->jh_commit_thread;
+	drv_mutex_release(&handle->jh_lock);
+	if (!thread)
+		return;
+
+	KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+	KeWaitForSingleObject(thread, Executive, KernelMode, FALSE, NULL);
+	ObDereferenceObject(thread);
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	handle->jh_commit_thread = NULL;
+	drv_mutex_release(&handle->jh_lock);
+}
+
+/**
+ * @brief	Set the age at which the commit thread commits the running
+ *			transaction
+ * @param handle		Handle to journal file
+ * @param interval_sec	Interval in seconds, 0 for the default
+ */
+void jbd2_set_commit_interval(
+		jbd2_handle_t *handle,
+		__u32 interval_sec)
+{
+	if (!interval_sec)
+		interval_sec = JBD2_DEFAULT_COMMIT_INTERVAL;
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	handle->jh_commit_interval = (__s64)interval_sec * 10000000;
+	drv_mutex_release(&handle->jh_lock);
+
+	/* Let the thread wait again with the new interval */
+	KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+}
+
+/**
+ * @brief	Turn async commit on or off
+ * @remarks	Must be called after the replay and before the first
+ *			transaction handle starts, as recovery has to know how the
+ *			transactions in the log were written.  Without checksum v2
+ *			or v3 the blocks get a checksum v1 in their commit block.
+ *			The features reach the disk with the superblock update which
+ *			marks the log non-empty.
+ * @param handle	Handle to journal file
+ * @param enable	Whether to write commit blocks along with the blocks
+ *					they commit
+ * @return	STATUS_SUCCESS, or STATUS_INVALID_DEVICE_STATE if the log
+ *			is in use
+ */
+NTSTATUS jbd2_set_async_commit(
+		jbd2_handle_t *handle,
+		__bool enable)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	if (handle->jh_needs_recovery ||
+		handle->jh_running_txn ||
+		handle->jh_committing_txn ||
+		!IsListEmpty(&handle->jh_txn_queue) ||
+		handle->jh_free_start != handle->jh_start) {
+
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto out;
+	}
+
+	if (enable) {
+		jbd2_set_feature_async_commit(handle->jh_sb);
+		if (!jbd2_has_csum_v2or3(handle))
+			jbd2_set_feature_checksum(handle->jh_sb);
+	} else {
+		jbd2_clear_feature_async_commit(handle->jh_sb);
+	}
+
+out:
+	drv_mutex_release(&handle->jh_lock);
+	drv_mutex_release(&handle->jh_checkpoint_lock);
+	return status;
+}
+
+/**
+ * @brief Return the statistics of the last replay of @p handle
+ * @param handle	Handle to journal file
+ * @param stats		Statistics returned
+ */
+void jbd2_query_replay_stats(
+		jbd2_handle_t *handle,
+		jbd2_replay_stats_t *stats)
+{
+	RtlCopyMemory(stats, &handle->jh_replay_stats, sizeof(jbd2_replay_stats_t));
+}
+
+/**
+ * @brief Return the commit statistics of @p handle
+ * @param handle	Handle to journal file
+ * @param stats		Statistics returned
+ */
+void jbd2_query_commit_stats(
+		jbd2_handle_t *handle,
+		jbd2_commit_stats_t *stats)
+{
+	__u64 elapsed;
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	elapsed = KeQueryInterruptTime() - handle->jh_open_time;
+	stats->cs_nr_commits = handle->jh_nr_commits;
+	stats->cs_nr_blocks = handle->jh_nr_commit_blocks;
+	stats->cs_commit_us = handle->jh_commit_time / 10;
+	stats->cs_nr_fc_commits = handle->jh_nr_fc_commits;
+	stats->cs_nr_fc_blocks = handle->jh_nr_fc_blocks;
+	stats->cs_log_blocks = handle->jh_end - handle->jh_start + 1;
+	stats->cs_log_used_blocks = stats->cs_log_blocks -
+		(__u32)drv_atomic_read(&handle->jh_free_blockcnt);
+	stats->cs_log_peak_used = handle->jh_log_peak_used;
+	stats->cs_avg_log_used = handle->jh_nr_log_allocs ?
+		(__u32)(handle->jh_log_used_sum / handle->jh_nr_log_allocs) : 0;
+	stats->cs_nr_log_wraps = handle->jh_nr_log_wraps;
+	drv_mutex_release(&handle->jh_lock);
+
+	stats->cs_elapsed_us = elapsed / 10;
+	stats->cs_commits_per_ksec = elapsed ?
+		(__u32)(stats->cs_nr_commits * 10000000000ULL / elapsed) : 0;
+	stats->cs_avg_txn_blocks = stats->cs_nr_commits ?
+		(__u32)(stats->cs_nr_blocks / stats->cs_nr_commits) : 0;
+	stats->cs_avg_commit_us = stats->cs_nr_commits ?
+		(__u32)(stats->cs_commit_us / stats->cs_nr_commits) : 0;
+}
+
+/**
+ * @brief	Commit all the blocks logged so far
+ * @remarks	@p event is set and @p status filled in once the
+ *			transactions holding the blocks are committed.  The commit
+ *			is left to the commit thread while it runs.  Flushes
+ *			issued while a commit is in progress are served together by
+ *			the next commit.  The caller must not have a transaction
+ *			handle open.
+ * @param handle	Handle to journal file
+ * @param event		Event signaled on completion
+ * @param status	Result of the commit
+ */
+void jbd2_flush(
+		jbd2_handle_t *handle,
+		KEVENT *event,
+		NTSTATUS *status)
+{
+	jbd2_waiter_t *waiter;
+	jbd2_txn_t *txn;
+
+	waiter = ExAllocatePoolWithTag(
+			NonPagedPool,
+			sizeof(jbd2_waiter_t),
+			JBD2_WAITER_TAG);
+	if (!waiter) {
+		*status = STATUS_INSUFFICIENT_RESOURCES;
+		KeSetEvent(event, IO_NO_INCREMENT, FALSE);
+		return;
+	}
+	waiter->jw_event = event;
+	waiter->jw_status = status;
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	txn = handle->jh_running_txn;
+	if (!txn)
+		txn = handle->jh_committing_txn;
+
+	if (!txn || !NT_SUCCESS(handle->jh_status)) {
+		*status = handle->jh_status;
+		drv_mutex_release(&handle->jh_lock);
+		KeSetEvent(event, IO_NO_INCREMENT, FALSE);
+		ExFreePoolWithTag(waiter, JBD2_WAITER_TAG);
+		return;
+	}
+	InsertTailList(&txn->jt_waiters, &waiter->jw_list_node);
+
+	if (handle->jh_commit_thread && !handle->jh_commit_stop) {
+		drv_mutex_release(&handle->jh_lock);
+		KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+		return;
+	}
+
+	/* The thread committing picks the running transaction up */
+	if (handle->jh_committing) {
+		drv_mutex_release(&handle->jh_lock);
+		return;
+	}
+	handle->jh_committing = TRUE;
+	drv_mutex_release(&handle->jh_lock);
+
+	jbd2_commit_loop(handle);
+}
+
+/**
+ * @brief Commit all the blocks logged so far and wait for it
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_flush_sync(jbd2_handle_t *handle)
+{
+	NTSTATUS status;
+	KEVENT event;
+
+	KeInitializeEvent(&event, NotificationEvent, FALSE);
+	jbd2_flush(handle, &event, &status);
+	KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+	return status;
+}
+
+/**
+ * @brief	Whether nothing is logged, committing or reserved
+ * @remarks	jh_lock must be held.
+ * @param handle	Handle to journal file
+ */
+static __bool
+jbd2_log_is_empty(jbd2_handle_t *handle)
+{
+	jbd2_txn_t *txn = handle->jh_running_txn;
+
+	return !handle->jh_committing_txn &&
+		IsListEmpty(&handle->jh_txn_queue) &&
+		(!txn || (!drv_atomic_read(&txn->jt_logged_cnt) &&
+			!drv_atomic_read(&txn->jt_reserved_cnt))) &&
+		(jbd2_logblk_t)drv_atomic_read(&handle->jh_free_blockcnt) ==
+			handle->jh_end - handle->jh_start + 1;
+}
+
+/**
+ * @brief	Wait until the running transaction is committed and the
+ *			log checkpointed
+ * @remarks	While the commit thread runs, the caller is queued on
+ *			jh_space_waiters and woken by the thread once the checkpoint
+ *			is done.  Otherwise the caller does the work itself.
+ * @param handle	Handle to journal file
+ * @param nr_blocks	Nr. of blocks the caller is to reserve, 0 if none
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ *			STATUS_LOG_FILE_FULL if the log is empty and @p nr_blocks
+ *				still does not fit, so waiting would not help,
+ * 		otherwise the operation fails.
+ */
+static NTSTATUS
+jbd2_log_wait_for_space(
+	jbd2_handle_t *handle,
+	jbd2_logblk_t nr_blocks)
+{
+	jbd2_waiter_t *waiter;
+	NTSTATUS status;
+	KEVENT event;
+
+	if (nr_blocks) {
+		drv_mutex_acquire(&handle->jh_lock, TRUE);
+		status = (jbd2_log_is_empty(handle) &&
+				!jbd2_txn_has_room(handle, nr_blocks)) ?
+				STATUS_LOG_FILE_FULL : STATUS_SUCCESS;
+		drv_mutex_release(&handle->jh_lock);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	waiter = ExAllocatePoolWithTag(
+			NonPagedPool,
+			sizeof(jbd2_waiter_t),
+			JBD2_WAITER_TAG);
+	if (!waiter)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	if (handle->jh_commit_thread && !handle->jh_commit_stop) {
+		KeInitializeEvent(&event, NotificationEvent, FALSE);
+		waiter->jw_event = &event;
+		waiter->jw_status = &status;
+		InsertTailList(&handle->jh_space_waiters, &waiter->jw_list_node);
+		drv_mutex_release(&handle->jh_lock);
+
+		KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+		KeWaitForSingleObject(&event, Executive, KernelMode, FALSE, NULL);
+		return status;
+	}
+	drv_mutex_release(&handle->jh_lock);
+	ExFreePoolWithTag(waiter, JBD2_WAITER_TAG);
+
+	do {
+		status = jbd2_flush_sync(handle);
+		if (NT_SUCCESS(status))
+			status = jbd2_checkpoint(handle);
+	} while (status == STATUS_PENDING);
+
+	return status;
+}
+
+/*
+ * Fast commits let the client make a small change durable without
+ * committing the running transaction.  The client describes the change
+ * in its own records, which go to the fast commit area at the end of
+ * the journal, tagged with the ID of the running transaction.  Once that
+ * transaction commits they are obsolete, and the next fast commit starts
+ * over at the beginning of the area.  Recovery hands the area to the
+ * client after the committed transactions are replayed; only records
+ * tagged with the ID following the last committed transaction apply.
+ */
+
+/**
+ * @brief	Carve the fast commit area out of the end of the log
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS, or STATUS_DISK_FULL if the log would be
+ *			left too small
+ */
+static NTSTATUS
+jbd2_fc_init_area(jbd2_handle_t *handle)
+{
+	jbd2_logblk_t nr_blocks = be32_to_cpu(handle->jh_sb->s_num_fc_blks);
+
+	if (!nr_blocks)
+		nr_blocks = JBD2_DEFAULT_FAST_COMMIT_BLOCKS;
+	if (handle->jh_end + 1 - handle->jh_start <
+			nr_blocks + JBD2_MIN_JOURNAL_BLOCKS)
+		return STATUS_DISK_FULL;
+
+	handle->jh_fc_first = handle->jh_blockcnt - nr_blocks;
+	handle->jh_fc_blockcnt = nr_blocks;
+	handle->jh_fc_off = 0;
+	handle->jh_end = handle->jh_fc_first - 1;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Enable fast commits on a journal which does not have them yet
+ * @remarks	Must be called after the replay and before the first
+ *			transaction handle starts, as the log shrinks by the size of
+ *			the area.  The feature reaches the disk with the superblock
+ *			update which marks the log non-empty.
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS if fast commits can be used,
+ *			STATUS_NOT_SUPPORTED if no replay callback is set, or the
+ *				feature is not in JBD2_KNOWN_INCOMPAT_FEATURES,
+ *			STATUS_INVALID_DEVICE_STATE if the log is in use,
+ *			STATUS_DISK_FULL if the log is too small.
+ */
+NTSTATUS jbd2_fc_enable(jbd2_handle_t *handle)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/*
+	 * Fast commits nobody can replay would not be durable, and the
+	 * feature would leave a journal this driver refuses to open.
+	 */
+	if (!handle->jh_fc_replay ||
+		!(JBD2_KNOWN_INCOMPAT_FEATURES & JBD2_FEATURE_INCOMPAT_FAST_COMMIT))
+		return STATUS_NOT_SUPPORTED;
+
+	drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	if (handle->jh_fc_blockcnt)
+		goto out;
+
+	if (handle->jh_needs_recovery ||
+		handle->jh_running_txn ||
+		handle->jh_committing_txn ||
+		!IsListEmpty(&handle->jh_txn_queue) ||
+		handle->jh_free_start != handle->jh_start) {
+
+		status = STATUS_INVALID_DEVICE_STATE;
+		goto out;
+	}
+
+	status = jbd2_fc_init_area(handle);
+	if (!NT_SUCCESS(status))
+		goto out;
+
+	jbd2_set_feature_fast_commit(handle->jh_sb);
+	jbd2_set_max_txn(handle);
+	handle->jh_free_end = handle->jh_end;
+	drv_atomic_set(
+		&handle->jh_free_blockcnt,
+		handle->jh_end - handle->jh_start + 1);
+
+out:
+	drv_mutex_release(&handle->jh_lock);
+	drv_mutex_release(&handle->jh_checkpoint_lock);
+	return status;
+}
+
+/**
+ * @brief	Set the callback replaying the fast commit area
+ * @remarks	Must be called before jbd2_replay_journal().  Without a
+ *			callback fast commits cannot be enabled, and a log which
+ *			may hold some is not replayed.
+ * @param handle	Handle to journal file
+ * @param replay	Callback, called for each block of the area in order
+ * @param context	Context passed to @p replay
+ */
+void jbd2_fc_set_replay(
+		jbd2_handle_t *handle,
+		jbd2_fc_replay_t replay,
+		void *context)
+{
+	handle->jh_fc_replay = replay;
+	handle->jh_fc_replay_ctx = context;
+}
+
+/**
+ * @brief	Start a fast commit of the running transaction
+ * @remarks	Fast commits are serialized until jbd2_fc_end().  A commit
+ *			in progress would have to reach the disk before the records,
+ *			so the client does a full commit with jbd2_flush() instead.
+ * @param handle	Handle to journal file
+ * @param tid		ID of the running transaction, which the client has to
+ *					tag its records with
+ * @param blk_off	Offset in the area of the first block to be written;
+ *					0 if the fast commit is the first one of @p tid
+ * @return	STATUS_SUCCESS if the fast commit has started,
+ *			STATUS_ALREADY_COMMITTED if the running transaction has
+ *				nothing logged, so the client changes are all committed,
+ *			STATUS_DEVICE_BUSY if a commit is in progress,
+ *			STATUS_NOT_SUPPORTED if fast commits are not enabled or
+ *				no replay callback is set,
+ *			otherwise the error the journal was aborted with.
+ */
+NTSTATUS jbd2_fc_begin(
+		jbd2_handle_t *handle,
+		jbd2_tid_t *tid,
+		jbd2_logblk_t *blk_off)
+{
+	jbd2_logblk_t free_start;
+	jbd2_txn_t *txn;
+	NTSTATUS status;
+
+	if (!handle->jh_fc_blockcnt || !handle->jh_fc_replay)
+		return STATUS_NOT_SUPPORTED;
+
+	/*
+	 * The fast commit stays in progress after the return, so it is
+	 * not serialized by a mutex, which would keep the caller at
+	 * APC_LEVEL while it builds the records.
+	 */
+	KeWaitForSingleObject(
+		&handle->jh_fc_idle,
+		Executive,
+		KernelMode,
+		FALSE,
+		NULL);
+	drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+	drv_mutex_acquire(&handle->jh_lock, TRUE);
+	txn = handle->jh_running_txn;
+	status = handle->jh_status;
+	if (NT_SUCCESS(status)) {
+		if (handle->jh_committing_txn ||
+			(txn && txn->jt_state != TXN_RUNNING))
+			status = STATUS_DEVICE_BUSY;
+		else if (!txn || !drv_atomic_read(&txn->jt_logged_cnt))
+			status = STATUS_ALREADY_COMMITTED;
+	}
+	if (NT_SUCCESS(status)) {
+		*tid = txn->jt_tid;
+		free_start = handle->jh_free_start;
+	}
+	drv_mutex_release(&handle->jh_lock);
+
+	/*
+	 * Recovery only looks at the area if the log is non-empty.  The
+	 * running transaction is the next one to be written, and no commit
+	 * moves jh_free_start while the checkpoint lock is held.
+	 */
+	if (NT_SUCCESS(status) && !handle->jh_sb->s_start)
+		status = jbd2_write_superblock(handle, *tid, free_start);
+	drv_mutex_release(&handle->jh_checkpoint_lock);
+
+	if (!NT_SUCCESS(status)) {
+		KeSetEvent(&handle->jh_fc_idle, IO_NO_INCREMENT, FALSE);
+		return status;
+	}
+
+	/* Fast commits of committed transactions may be overwritten */
+	if (handle->jh_fc_tid != *tid) {
+		handle->jh_fc_tid = *tid;
+		handle->jh_fc_off = 0;
+	}
+	handle->jh_fc_start = handle->jh_fc_off;
+	*blk_off = handle->jh_fc_off;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Get the buffer of the next block of the fast commit in
+ *			progress
+ * @remarks	The previous block can no longer be changed.  The block is
+ *			zeroed.
+ * @param handle	Handle to journal file
+ * @param buf		Buffer of the block returned
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ *			STATUS_LOG_FILE_FULL if the area is full,
+ * 		otherwise the operation fails.
+ */
+NTSTATUS jbd2_fc_get_block(
+		jbd2_handle_t *handle,
+		void **buf)
+{
+	LARGE_INTEGER tmp;
+
+	if (handle->jh_fc_bcb) {
+		CcSetDirtyPinnedData(handle->jh_fc_bcb, NULL);
+		CcUnpinData(handle->jh_fc_bcb);
+		handle->jh_fc_bcb = NULL;
+	}
+	if (handle->jh_fc_off >= handle->jh_fc_blockcnt)
+		return STATUS_LOG_FILE_FULL;
+
+	tmp.QuadPart = blocknr_to_offset(
+				handle->jh_fc_first + handle->jh_fc_off,
+				handle->jh_blocksize);
+	if (!CcPreparePinWrite(
+			handle->jh_log_file,
+			&tmp,
+			handle->jh_blocksize,
+			TRUE,
+			PIN_WAIT,
+			&handle->jh_fc_bcb,
+			buf)) {
+		handle->jh_fc_bcb = NULL;
+		return STATUS_UNEXPECTED_IO_ERROR;
+	}
+
+	handle->jh_fc_off++;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	End the fast commit in progress
+ * @remarks	If the fast commit is given up, or its blocks cannot be
+ *			written, the next one overwrites them and the client has to
+ *			fall back to a full commit.
+ * @param handle	Handle to journal file
+ * @param commit	Whether to write the blocks filled to disk
+ * @return	STATUS_SUCCESS indicating that the operation succeeds,
+ * 		otherwise the operation fails.
+ */
+NTSTATUS jbd2_fc_end(
+		jbd2_handle_t *handle,
+		__bool commit)
+{
+	jbd2_logblk_t nr_blocks = handle->jh_fc_off - handle->jh_fc_start;
+	NTSTATUS status = STATUS_SUCCESS;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER tmp;
+
+	if (handle->jh_fc_bcb) {
+		CcSetDirtyPinnedData(handle->jh_fc_bcb, NULL);
+		CcUnpinData(handle->jh_fc_bcb);
+		handle->jh_fc_bcb = NULL;
+	}
+
+	if (commit && nr_blocks) {
+		tmp.QuadPart = blocknr_to_offset(
+					handle->jh_fc_first + handle->jh_fc_start,
+					handle->jh_blocksize);
+		CcFlushCache(
+			handle->jh_log_file->SectionObjectPointer,
+			&tmp,
+			nr_blocks * handle->jh_blocksize,
+			&iosb);
+		status = iosb.Status;
+	}
+
+	if (commit && NT_SUCCESS(status)) {
+		drv_mutex_acquire(&handle->jh_lock, TRUE);
+		handle->jh_nr_fc_commits++;
+		handle->jh_nr_fc_blocks += nr_blocks;
+		drv_mutex_release(&handle->jh_lock);
+	} else {
+		handle->jh_fc_off = handle->jh_fc_start;
+	}
+
+	KeSetEvent(&handle->jh_fc_idle, IO_NO_INCREMENT, FALSE);
+	return status;
+}
+
+/**
+ * @brief	Join the running transaction unless it is locked
+ * @remarks	While a transaction handle is open the running transaction
+ *			cannot be locked, so jh_running_txn only changes from NULL
+ *			to a new transaction until jbd2_txn_leave().
+ * @param handle	Handle to journal file
+ * @return	TRUE if joined, FALSE if the running transaction is locked
+ */
+static __bool
+jbd2_txn_join(jbd2_handle_t *handle)
+{
+	int updates;
+
+	do {
+		updates = drv_atomic_read(&handle->jh_updates);
+		if (updates & JBD2_UPDATES_LOCKED)
+			return FALSE;
+	} while (drv_atomic_cmpxchg(
+				&handle->jh_updates,
+				updates,
+				updates + 1) != updates);
+
+	return TRUE;
+}
+
+/**
+ * @brief	Leave the running transaction joined by jbd2_txn_join()
+ * @param handle	Handle to journal file
+ */
+static void
+jbd2_txn_leave(jbd2_handle_t *handle)
+{
+	/* The commit waits for the last handle to leave */
+	if (drv_atomic_dec_return(&handle->jh_updates) == JBD2_UPDATES_LOCKED)
+		KeSetEvent(&handle->jh_updates_done, IO_NO_INCREMENT, FALSE);
+}
+
+/**
+ * @brief	Reserve @p nr_blocks blocks in the running transaction
+ * @remarks	The caller has joined @p txn.
+ * @param handle	Handle to journal file
+ * @param txn		The running transaction
+ * @param nr_blocks	Nr. of blocks to reserve
+ * @return	TRUE if reserved, FALSE if either the transaction or the
+ *			log has no room left
+ */
+static __bool
+jbd2_txn_reserve(
+	jbd2_handle_t *handle,
+	jbd2_txn_t *txn,
+	jbd2_logblk_t nr_blocks)
+{
+	int reserved_cnt;
+
+	do {
+		reserved_cnt = drv_atomic_read(&txn->jt_reserved_cnt);
+		if (!jbd2_txn_has_room(handle, reserved_cnt + nr_blocks))
+			return FALSE;
+	} while (drv_atomic_cmpxchg(
+				&txn->jt_reserved_cnt,
+				reserved_cnt,
+				reserved_cnt + nr_blocks) != reserved_cnt);
+
+	return TRUE;
+}
+
+/**
+ * @brief	Return the largest nr. of blocks a transaction handle may
+ *			reserve
+ * @param handle	Handle to journal file
+ */
+jbd2_logblk_t jbd2_txn_handle_max_blocks(jbd2_handle_t *handle)
+{
+	jbd2_logblk_t max_blocks = jbd2_txn_max_blocks(handle);
+	jbd2_logblk_t nr_blocks;
+
+	if (max_blocks < 3)
+		return 0;
+
+	/* Every jh_tags_per_descr blocks take a descriptor */
+	nr_blocks = (jbd2_logblk_t)((__u64)(max_blocks - 1) *
+			handle->jh_tags_per_descr / (handle->jh_tags_per_descr + 1));
+	while (nr_blocks && jbd2_txn_log_blocks(handle, nr_blocks) > max_blocks)
+		nr_blocks--;
+	return nr_blocks;
+}
+
+/**
+ * @brief	Open a transaction handle on the running transaction,
+ *			reserving log space for @p nr_blocks blocks
+ * @remarks	The reservation is taken with atomic operations alone,
+ *			unless a new running transaction has to be allocated.  If
+ *			the running transaction or the log is full, the caller
+ *			waits for the running transaction to be committed and the
+ *			log checkpointed.
+ *			The caller must not have another transaction handle open.
+ * @param handle		Handle to journal file
+ * @param nr_blocks		Nr. of blocks the caller may log
+ * @param txn_handle_ret	Transaction handle returned
+ * @return	STATUS_SUCCESS if the transaction handle is opened,
+ *			STATUS_LOG_FILE_FULL if @p nr_blocks never fits in a
+ *				transaction,
+ *			STATUS_INVALID_DEVICE_STATE if the log has to be replayed,
+ *			otherwise the operation fails.
+ */
+NTSTATUS jbd2_txn_handle_start(
+		jbd2_handle_t *handle,
+		jbd2_logblk_t nr_blocks,
+		jbd2_txn_handle_t **txn_handle_ret)
+{
+	jbd2_txn_handle_t *txn_handle;
+	jbd2_txn_t *txn;
+	NTSTATUS status;
+
+	if (handle->jh_needs_recovery)
+		return STATUS_INVALID_DEVICE_STATE;
+	if (jbd2_txn_log_blocks(handle, nr_blocks) > jbd2_txn_max_blocks(handle))
+		return STATUS_LOG_FILE_FULL;
+
+	txn_handle = ExAllocatePoolWithTag(
+				NonPagedPool,
+				sizeof(jbd2_txn_handle_t),
+				JBD2_TXN_TAG);
+	if (!txn_handle)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	for (;;) {
+		status = handle->jh_status;
+		if (!NT_SUCCESS(status))
+			break;
+
+		if (!jbd2_txn_join(handle)) {
+			KeWaitForSingleObject(
+				&handle->jh_txn_unlocked,
+				Executive,
+				KernelMode,
+				FALSE,
+				NULL);
+			continue;
+		}
+
+		txn = handle->jh_running_txn;
+		if (!txn) {
+			drv_mutex_acquire(&handle->jh_lock, TRUE);
+			if (!handle->jh_running_txn)
+				handle->jh_running_txn = jbd2_txn_alloc(handle);
+			txn = handle->jh_running_txn;
+			drv_mutex_release(&handle->jh_lock);
+			if (!txn) {
+				jbd2_txn_leave(handle);
+				status = STATUS_INSUFFICIENT_RESOURCES;
+				break;
+			}
+		}
+
+		if (jbd2_txn_reserve(handle, txn, nr_blocks)) {
+			if (handle->jh_commit_thread &&
+				jbd2_txn_nearly_full(handle, txn))
+				KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+			break;
+		}
+		jbd2_txn_leave(handle);
+
+		status = jbd2_log_wait_for_space(handle, nr_blocks);
+		if (!NT_SUCCESS(status))
+			break;
+	}
+
+	if (!NT_SUCCESS(status)) {
+		ExFreePoolWithTag(txn_handle, JBD2_TXN_TAG);
+		return status;
+	}
+
+	RtlCopyMemory(txn_handle->th_uuid, handle->jh_uuid, UUID_SIZE);
+	txn_handle->th_reserved_cnt = nr_blocks;
+	txn_handle->th_txn = txn;
+	*txn_handle_ret = txn_handle;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Reserve @p nr_blocks more blocks for @p txn_handle
+ * @remarks	Does not wait: the running transaction cannot be committed
+ *			to make room while the handle is open.
+ * @param txn_handle	Transaction handle
+ * @param nr_blocks		Nr. of blocks to add to the reservation
+ * @return	STATUS_SUCCESS if the blocks are reserved,
+ *			STATUS_LOG_FILE_FULL if the transaction or the log has no
+ *				room for them,
+ *			otherwise the error the journal was aborted with.
+ */
+NTSTATUS jbd2_txn_handle_extend(
+		jbd2_txn_handle_t *txn_handle,
+		jbd2_logblk_t nr_blocks)
+{
+	jbd2_txn_t *txn = txn_handle->th_txn;
+	jbd2_handle_t *handle = txn->jt_handle;
+	NTSTATUS status;
+
+	status = handle->jh_status;
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (!jbd2_txn_reserve(handle, txn, nr_blocks))
+		return STATUS_LOG_FILE_FULL;
+
+	if (handle->jh_commit_thread && jbd2_txn_nearly_full(handle, txn))
+		KeSetEvent(&handle->jh_commit_wakeup, IO_NO_INCREMENT, FALSE);
+
+	txn_handle->th_reserved_cnt += nr_blocks;
+	return STATUS_SUCCESS;
+}
+
+/**
+ * @brief	Log a block of the client file in the transaction of
+ *			@p txn_handle
+ * @remarks	Must be called before the block is modified.  The bcb is
+ *			repinned, so the caller still unpins its own pin.
+ * @param txn_handle	Transaction handle
+ * @param blocknr	Block nr. in client file
+ * @param bcb		Bcb pinning the block in client file
+ * @param data		Buffer of the block
+ * @return	STATUS_SUCCESS if the block is logged,
+ *			STATUS_LOG_FILE_FULL if the transaction handle ran out
+ *				of reserved blocks,
+ *			otherwise the operation fails.
+ */
+NTSTATUS jbd2_txn_handle_log(
+		jbd2_txn_handle_t *txn_handle,
+		jbd2_fsblk_t blocknr,
+		void *bcb,
+		void *data)
+{
+	jbd2_txn_t *txn = txn_handle->th_txn;
+	jbd2_handle_t *handle = txn->jt_handle;
+	jbd2_lbcb_shard_t *shard = jbd2_lbcb_shard(handle, blocknr);
+	NTSTATUS status = STATUS_SUCCESS;
+	jbd2_lbcb_t *lbcb;
+
+	drv_mutex_acquire(&shard->ls_lock, TRUE);
+	lbcb = jbc2_lbcb_get(handle, blocknr);
+	if (!lbcb) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto out;
+	}
+	if (lbcb->jl_is_new) {
+		lbcb->jl_writing = FALSE;
+		lbcb->jl_bcb = NULL;
+		lbcb->jl_data = NULL;
+		lbcb->jl_txn = NULL;
+		lbcb->jl_next_txn = NULL;
+		lbcb->jl_cp_txn = NULL;
+	}
+
+	/* The checkpoint holds its lock until the block is written back */
+	while (lbcb->jl_writing) {
+		drv_mutex_release(&shard->ls_lock);
+		drv_mutex_acquire(&handle->jh_checkpoint_lock, TRUE);
+		drv_mutex_release(&handle->jh_checkpoint_lock);
+		drv_mutex_acquire(&shard->ls_lock, TRUE);
+	}
+
+	if (lbcb->jl_txn == txn || lbcb->jl_next_txn == txn) {
+		jbd2_lbcb_put(handle, lbcb);
+		goto out;
+	}
+	if (!txn_handle->th_reserved_cnt) {
+		jbd2_lbcb_put(handle, lbcb);
+		status = STATUS_LOG_FILE_FULL;
+		goto out;
+	}
+
+	if (!lbcb->jl_bcb) {
+		CcRepinBcb(bcb);
+		lbcb->jl_bcb = bcb;
+		lbcb->jl_data = data;
+	}
+	NT_ASSERT(lbcb->jl_bcb == bcb);
+
+	/* The reference taken above is now held by the transaction */
+	if (!lbcb->jl_txn) {
+		lbcb->jl_txn = txn;
+		drv_mutex_acquire(&txn->jt_lock, TRUE);
+		InsertTailList(&txn->jt_lbcb_list, &lbcb->jl_txn_list_node);
+		drv_mutex_release(&txn->jt_lock);
+	} else {
+		NT_ASSERT(lbcb->jl_txn->jt_state == TXN_COMMITTING);
+		lbcb->jl_next_txn = txn;
+	}
+	drv_atomic_inc(&txn->jt_logged_cnt);
+	txn_handle->th_reserved_cnt--;
+
+out:
+	drv_mutex_release(&shard->ls_lock);
+	return status;
+}
+
+/**
+ * @brief	Close a transaction handle, giving back the blocks it
+ *			reserved but did not log
+ * @param txn_handle	Transaction handle
+ * @return	STATUS_SUCCESS, or the error the journal was aborted with
+ */
+NTSTATUS jbd2_txn_handle_stop(jbd2_txn_handle_t *txn_handle)
+{
+	jbd2_txn_t *txn = txn_handle->th_txn;
+	jbd2_handle_t *handle = txn->jt_handle;
+	NTSTATUS status;
+
+	drv_atomic_sub(&txn->jt_reserved_cnt, txn_handle->th_reserved_cnt);
+	status = handle->jh_status;
+	jbd2_txn_leave(handle);
+
+	ExFreePoolWithTag(txn_handle, JBD2_TXN_TAG);
+	return status;
+}
+
+/**
+ * @brief	Release the LBCBs and transactions left after the journal
+ *			was aborted
+ * @remarks	Only blocks whose last change was committed are left to be
+ *			written back.  The others hold changes that never reached
+ *			the log, so they are purged from the client file's cache
+ *			once unpinned rather than written in place.
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS, or STATUS_FILE_CORRUPT_ERROR if a block with
+ *			uncommitted changes could not be purged and may reach the
+ *			disk.
+ */
+static NTSTATUS
+jbd2_drop_all(jbd2_handle_t *handle)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	struct jbd2_node_hdr *hdr;
+	IO_STATUS_BLOCK iosb;
+	LARGE_INTEGER offset;
+	jbd2_txn_t *txn;
+	int i;
+
+	for (i = 0; i < JBD2_LBCB_SHARDS; i++) {
+		jbd2_generic_table_t *table = &handle->jh_lbcb_shards[i].ls_table;
+
+		while ((hdr = RB_MIN(jbd2_generic_table, table)) != NULL) {
+			jbd2_lbcb_t *lbcb = (jbd2_lbcb_t *)hdr;
+
+			RB_REMOVE(jbd2_generic_table, table, hdr);
+			if (!lbcb->jl_bcb) {
+				jbd2_lbcb_free(handle, lbcb);
+				continue;
+			}
+
+			CcUnpinRepinnedBcb(lbcb->jl_bcb, FALSE, &iosb);
+			if (lbcb->jl_cp_txn && !lbcb->jl_txn && !lbcb->jl_next_txn) {
+				jbd2_lbcb_free(handle, lbcb);
+				continue;
+			}
+
+			offset.QuadPart = blocknr_to_offset(
+						hdr->th_block,
+						handle->jh_blocksize);
+			if (!CcPurgeCacheSection(
+					handle->jh_client_file->SectionObjectPointer,
+					&offset,
+					handle->jh_blocksize,
+					FALSE))
+				status = STATUS_FILE_CORRUPT_ERROR;
+			jbd2_lbcb_free(handle, lbcb);
+		}
+	}
+
+	while (!IsListEmpty(&handle->jh_txn_queue)) {
+		txn = CONTAINING_RECORD(
+				RemoveHeadList(&handle->jh_txn_queue),
+				jbd2_txn_t,
+				jt_list_node);
+		jbd2_txn_free(txn);
+	}
+
+	if (handle->jh_running_txn) {
+		jbd2_txn_free(handle->jh_running_txn);
+		handle->jh_running_txn = NULL;
+	}
+	return status;
+}
+
+/**
+ * @brief	Commit and checkpoint everything logged, mark the log empty
+ *			and close the journal file
+ * @param handle	Handle to journal file
+ * @return	STATUS_SUCCESS if the log was emptied, otherwise the log
+ *			keeps what could not be checkpointed for recovery.
+ *			STATUS_FILE_CORRUPT_ERROR if uncommitted changes could not
+ *			be kept from the disk.
+ */
+NTSTATUS jbd2_close_handle(jbd2_handle_t *handle)
+{
+	NTSTATUS status;
+	int i;
+
+	jbd2_commit_thread_stop(handle);
+	status = jbd2_log_wait_for_space(handle, 0);
+	if (NT_SUCCESS(status) && !handle->jh_needs_recovery)
+		status = jbd2_write_superblock(handle, handle->jh_next_tid, 0);
+
+	/*
+	 * Uncommitted changes may be written in place, so leave an error
+	 * in the superblock for the file system checker to find.  The log
+	 * keeps its committed transactions for the next recovery.
+	 */
+	if (!NT_SUCCESS(jbd2_drop_all(handle))) {
+		handle->jh_sb->s_errno = cpu_to_be32(JBD2_ABORT_ERRNO);
+		jbd2_write_superblock(
+			handle,
+			be32_to_cpu(handle->jh_sb->s_sequence),
+			be32_to_cpu(handle->jh_sb->s_start));
+		if (NT_SUCCESS(status))
+			status = STATUS_FILE_CORRUPT_ERROR;
+	}
+	ExFreePoolWithTag(handle->jh_commit_lbcbs, JBD2_COMMIT_TAG);
+	ExFreePoolWithTag(handle->jh_commit_reqs, JBD2_COMMIT_TAG);
+	ExFreePoolWithTag(handle->jh_sb, JBD2_SUPERBLOCK_TAG);
+	drv_mutex_destroy(&handle->jh_lock);
+	drv_mutex_destroy(&handle->jh_checkpoint_lock);
+	for (i = 0; i < JBD2_LBCB_SHARDS; i++)
+		drv_mutex_destroy(&handle->jh_lbcb_shards[i].ls_lock);
+	ExDeleteNPagedLookasideList(&handle->jh_lbcb_cache);
+	jbd2_revoke_table_destroy(handle);
+	jbd2_cache_sync_uninit_map(handle->jh_log_file);
+	ExFreePoolWithTag(handle, JBD2_POOL_TAG);
+	return status;
+}
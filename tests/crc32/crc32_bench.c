@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+/*
+ * Throughput of the engines of drv_crc32.c over buffers of 1 KiB to
+ * 64 KiB, the block sizes the journal and the metadata checksums see.
+ */
+
+#include "drv_crc32.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_BYTES		(256 * 1024 * 1024)	/* Bytes run per engine and size */
+#define MAX_LEN			(64 * 1024)
+
+typedef __u32 (*crc_fn)(__u32 crc, const void *buf, size_t size);
+
+struct engine {
+	const char *	name;
+	crc_fn			fn;
+	size_t			bytes;		/* Bytes run per size, less for slow engines */
+};
+
+static __u8 buf[MAX_LEN];
+
+static __u32 crc32_bits_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_bits(crc, p, size, CRC32_POLY);
+}
+
+static __u32 crc32_bytes_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_bytes(crc, p, size, crc32_slice_tab[0]);
+}
+
+static __u32 crc32_be_bytes_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_be_bytes(crc, p, size);
+}
+
+static __u32 crc32_be_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_be_slice8(crc, p, size);
+}
+
+static __u32 crc32_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice8(crc, p, size, crc32_slice_tab);
+}
+
+static __u32 crc32_slice16_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice16(crc, p, size, crc32_slice_tab);
+}
+
+static __u32 crc32c_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice8(crc, p, size, crc32c_slice_tab);
+}
+
+static __u32 crc32c_slice16_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice16(crc, p, size, crc32c_slice_tab);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Keeps the compiler from dropping the calls */
+static volatile __u32 sink;
+
+static double bench(const struct engine *e, size_t len)
+{
+	size_t i, loops = e->bytes / len;
+	__u32 crc = ~0U;
+	double start;
+
+	start = now();
+	for (i = 0; i < loops; i++)
+		crc = e->fn(crc, buf, len);
+	sink = crc;
+
+	return (double)loops * len / (now() - start) / (1024 * 1024);
+}
+
+int main(void)
+{
+	struct engine engines[16];
+	size_t len;
+	int nr = 0, i;
+
+	srand(1);
+	for (len = 0; len < sizeof(buf); len++)
+		buf[len] = (__u8)rand();
+
+	drv_crc32_init();
+
+	engines[nr++] = (struct engine){ "crc32 bitwise", crc32_bits_fn, BENCH_BYTES / 64 };
+	engines[nr++] = (struct engine){ "crc32 table", crc32_bytes_fn, BENCH_BYTES / 4 };
+	engines[nr++] = (struct engine){ "crc32 slice-by-8", crc32_slice8_fn, BENCH_BYTES };
+	engines[nr++] = (struct engine){ "crc32 slice-by-16", crc32_slice16_fn, BENCH_BYTES };
+#ifdef CRC32_PCLMUL
+	if (crc32_pclmul_available)
+		engines[nr++] = (struct engine){ "crc32 pclmulqdq", crc32_pclmul, BENCH_BYTES * 4 };
+#endif
+	engines[nr++] = (struct engine){ "crc32c slice-by-8", crc32c_slice8_fn, BENCH_BYTES };
+	engines[nr++] = (struct engine){ "crc32c slice-by-16", crc32c_slice16_fn, BENCH_BYTES };
+#ifdef CRC32_X86
+	if (crc32c_hw_available)
+		engines[nr++] = (struct engine){ "crc32c sse4.2", crc32c_hw, BENCH_BYTES * 4 };
+#endif
+	engines[nr++] = (struct engine){ "crc32_be table", crc32_be_bytes_fn, BENCH_BYTES / 4 };
+	engines[nr++] = (struct engine){ "crc32_be slice-by-8", crc32_be_slice8_fn, BENCH_BYTES };
+#ifdef CRC32_PCLMUL
+	if (crc32_be_pclmul_available)
+		engines[nr++] = (struct engine){ "crc32_be pclmulqdq", crc32_be_pclmul, BENCH_BYTES * 4 };
+#endif
+
+	printf("%-20s", "MiB/s");
+	for (len = 1024; len <= MAX_LEN; len *= 4)
+		printf("%10zuK", len / 1024);
+	printf("\n");
+
+	for (i = 0; i < nr; i++) {
+		printf("%-20s", engines[i].name);
+		for (len = 1024; len <= MAX_LEN; len *= 4) {
+			printf("%11.0f", bench(&engines[i], len));
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+/*
+ * Checks every engine of drv_crc32.c bit for bit against a bitwise
+ * reference, over every length up to MAX_EXACT_LEN and a spread of
+ * longer ones, at every alignment within a 16-byte word.  The driver
+ * source is built in, so that the engines can be called one by one.
+ */
+
+#include "drv_crc32.c"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_EXACT_LEN	1024
+#define MAX_LEN			(64 * 1024)
+#define NR_OFFSETS		16
+
+typedef __u32 (*crc_fn)(__u32 crc, const void *buf, size_t size);
+
+struct engine {
+	const char *	name;
+	crc_fn			fn;
+	__u32			poly;		/* CRC32_BE_POLY for the MSB-first CRC */
+	size_t			min_len;	/* Shortest buffer the engine takes */
+};
+
+static __u8 buf[MAX_LEN + NR_OFFSETS];
+static int failures;
+
+static __u32 ref_crc(__u32 crc, const __u8 *p, size_t size, __u32 poly)
+{
+	int k;
+
+	while (size--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+	}
+	return crc;
+}
+
+static __u32 ref_crc_be(__u32 crc, const __u8 *p, size_t size)
+{
+	int k;
+
+	while (size--) {
+		crc ^= (__u32)*p++ << 24;
+		for (k = 0; k < 8; k++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ CRC32_BE_POLY : crc << 1;
+	}
+	return crc;
+}
+
+static __u32 crc32_be_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_be_slice8(crc, p, size);
+}
+
+static __u32 crc32_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice8(crc, p, size, crc32_slice_tab);
+}
+
+static __u32 crc32_slice16_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice16(crc, p, size, crc32_slice_tab);
+}
+
+static __u32 crc32c_slice8_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice8(crc, p, size, crc32c_slice_tab);
+}
+
+static __u32 crc32c_slice16_fn(__u32 crc, const void *p, size_t size)
+{
+	return crc32_slice16(crc, p, size, crc32c_slice_tab);
+}
+
+static void fail(const char *what, size_t off, size_t len, __u32 got, __u32 want)
+{
+	if (failures++ < 20)
+		printf("FAIL %s: off %zu len %zu: %08x, expected %08x\n",
+		       what, off, len, got, want);
+}
+
+static __bool next_len(size_t *len)
+{
+	*len += *len < MAX_EXACT_LEN ? 1 : 509 + (*len & 7);
+	return *len <= MAX_LEN;
+}
+
+/*
+ * The reference of each length is carried over from the previous one,
+ * so the seed stays the same for an offset.
+ */
+static void check_engine(const struct engine *e)
+{
+	size_t off, len, ref_len;
+	__u32 seed, ref;
+
+	for (off = 0; off < NR_OFFSETS; off++) {
+		seed = (__u32)off * 0x9E3779B9 + 1;
+		ref = seed;
+		ref_len = 0;
+		len = e->min_len;
+		do {
+			if (e->poly == CRC32_BE_POLY)
+				ref = ref_crc_be(ref, buf + off + ref_len, len - ref_len);
+			else
+				ref = ref_crc(ref, buf + off + ref_len, len - ref_len, e->poly);
+			ref_len = len;
+			if (e->fn(seed, buf + off, len) != ref)
+				fail(e->name, off, len, e->fn(seed, buf + off, len), ref);
+		} while (next_len(&len));
+	}
+}
+
+static void check_known_answers(void)
+{
+	static const char vec[] = "123456789";
+
+	if ((drv_crc32(~0U, vec, 9) ^ ~0U) != 0xCBF43926)
+		fail("drv_crc32 check value", 0, 9, drv_crc32(~0U, vec, 9) ^ ~0U, 0xCBF43926);
+	if ((drv_crc32c(~0U, vec, 9) ^ ~0U) != 0xE3069283)
+		fail("drv_crc32c check value", 0, 9, drv_crc32c(~0U, vec, 9) ^ ~0U, 0xE3069283);
+	if ((drv_crc32_be(~0U, vec, 9) ^ ~0U) != 0xFC891918)
+		fail("drv_crc32_be check value", 0, 9, drv_crc32_be(~0U, vec, 9) ^ ~0U, 0xFC891918);
+}
+
+static void check_multi(void)
+{
+	struct drv_crc32_req reqs[37];
+	int i;
+
+	for (i = 0; i < 37; i++) {
+		reqs[i].cr_seed = (__u32)i * 0x01000193;
+		reqs[i].cr_buf = buf + i;
+		reqs[i].cr_len = (size_t)i * i * 7;
+	}
+
+	drv_crc32_multi(reqs, 37);
+	for (i = 0; i < 37; i++) {
+		__u32 want = ref_crc(reqs[i].cr_seed, reqs[i].cr_buf, reqs[i].cr_len, CRC32_POLY);
+		if (reqs[i].cr_crc != want)
+			fail("drv_crc32_multi", i, reqs[i].cr_len, reqs[i].cr_crc, want);
+	}
+
+	drv_crc32c_multi(reqs, 37);
+	for (i = 0; i < 37; i++) {
+		__u32 want = ref_crc(reqs[i].cr_seed, reqs[i].cr_buf, reqs[i].cr_len, CRC32C_POLY);
+		if (reqs[i].cr_crc != want)
+			fail("drv_crc32c_multi", i, reqs[i].cr_len, reqs[i].cr_crc, want);
+	}
+}
+
+static void check_combine(void)
+{
+	size_t split, len = 4096;
+	__u32 whole, a, b;
+
+	whole = ref_crc(~0U, buf, len, CRC32C_POLY);
+	for (split = 0; split <= len; split += 97) {
+		a = drv_crc32c(~0U, buf, split);
+		b = drv_crc32c(0, buf + split, len - split);
+		if (drv_crc32c_combine(a, b, len - split) != whole)
+			fail("drv_crc32c_combine", 0, split,
+			     drv_crc32c_combine(a, b, len - split), whole);
+	}
+
+	whole = ref_crc(~0U, buf, len, CRC32_POLY);
+	for (split = 0; split <= len; split += 97) {
+		a = drv_crc32(~0U, buf, split);
+		b = drv_crc32(0, buf + split, len - split);
+		if (drv_crc32_combine(a, b, len - split) != whole)
+			fail("drv_crc32_combine", 0, split,
+			     drv_crc32_combine(a, b, len - split), whole);
+	}
+}
+
+/*
+ * Entries of the byte-wise tables published with the polynomials, so
+ * that a table generated wrong in the same way as the reference is
+ * still caught.
+ */
+static void check_tables(void)
+{
+	static const struct {
+		const char *	name;
+		__u32			(*tab)[256];
+		__u32			poly;
+		__u32			entry1;
+		__u32			entry255;
+	} tabs[] = {
+		{ "crc32_slice_tab", crc32_slice_tab, CRC32_POLY, 0x77073096, 0x2D02EF8D },
+		{ "crc32c_slice_tab", crc32c_slice_tab, CRC32C_POLY, 0xF26B8303, 0xAD7D5351 },
+	};
+	size_t t;
+	int k, i;
+
+	for (t = 0; t < sizeof(tabs) / sizeof(tabs[0]); t++) {
+		__u32 (*tab)[256] = tabs[t].tab;
+
+		if ((ULONG_PTR)tab & 63)
+			fail(tabs[t].name, (ULONG_PTR)tab & 63, 0, 0, 0);
+		if (tab[0][1] != tabs[t].entry1)
+			fail(tabs[t].name, 0, 1, tab[0][1], tabs[t].entry1);
+		if (tab[0][255] != tabs[t].entry255)
+			fail(tabs[t].name, 0, 255, tab[0][255], tabs[t].entry255);
+
+		for (i = 0; i < 256; i++) {
+			__u8 byte = (__u8)i;
+			__u32 want = ref_crc(0, &byte, 1, tabs[t].poly);
+
+			if (tab[0][i] != want)
+				fail(tabs[t].name, 0, i, tab[0][i], want);
+		}
+
+		/* Slice k is slice k - 1 followed by one more zero byte */
+		for (k = 1; k < CRC32_SLICES; k++) {
+			for (i = 0; i < 256; i++) {
+				__u32 want = (tab[k - 1][i] >> 8) ^
+							 tab[0][tab[k - 1][i] & 0xFF];
+
+				if (tab[k][i] != want)
+					fail(tabs[t].name, k, i, tab[k][i], want);
+			}
+		}
+	}
+}
+
+static void check_be_tables(void)
+{
+	__u32 (*tab)[256] = crc32_be_slice_tab;
+	int k, i;
+
+	if ((ULONG_PTR)tab & 63)
+		fail("crc32_be_slice_tab", (ULONG_PTR)tab & 63, 0, 0, 0);
+	if (tab[0][1] != 0x04C11DB7)
+		fail("crc32_be_slice_tab", 0, 1, tab[0][1], 0x04C11DB7);
+	if (tab[0][255] != 0xB1F740B4)
+		fail("crc32_be_slice_tab", 0, 255, tab[0][255], 0xB1F740B4);
+
+	for (i = 0; i < 256; i++) {
+		__u8 byte = (__u8)i;
+		__u32 want = ref_crc_be(0, &byte, 1);
+
+		if (tab[0][i] != want)
+			fail("crc32_be_slice_tab", 0, i, tab[0][i], want);
+	}
+
+	for (k = 1; k < CRC32_BE_SLICES; k++) {
+		for (i = 0; i < 256; i++) {
+			__u32 want = (tab[k - 1][i] << 8) ^ tab[0][tab[k - 1][i] >> 24];
+
+			if (tab[k][i] != want)
+				fail("crc32_be_slice_tab", k, i, tab[k][i], want);
+		}
+	}
+}
+
+/*
+ * Run the driver's own self-tests with each engine drv_crc32(),
+ * drv_crc32c() and drv_crc32_be() can dispatch to, the way
+ * drv_crc32_init() selects them.
+ */
+static void check_selftest(void)
+{
+	__bool pclmul = FALSE, be_pclmul = FALSE, hw = FALSE;
+
+#ifdef CRC32_PCLMUL
+	pclmul = crc32_pclmul_available;
+	crc32_pclmul_available = FALSE;
+	be_pclmul = crc32_be_pclmul_available;
+	crc32_be_pclmul_available = FALSE;
+#endif
+#ifdef CRC32_X86
+	hw = crc32c_hw_available;
+	crc32c_hw_available = FALSE;
+#endif
+
+	crc32_slice_inited = FALSE;
+	crc32_be_inited = FALSE;
+	if (!crc32_selftest(drv_crc32, CRC32_POLY, 0xCBF43926))
+		fail("crc32 bitwise self-test", 0, 0, 0, 0);
+	if (!crc32_selftest(drv_crc32c, CRC32C_POLY, 0xE3069283))
+		fail("crc32c bitwise self-test", 0, 0, 0, 0);
+	if (!crc32_be_selftest())
+		fail("crc32_be bitwise self-test", 0, 0, 0, 0);
+
+	crc32_slice_inited = TRUE;
+	if (!crc32_selftest(drv_crc32, CRC32_POLY, 0xCBF43926))
+		fail("crc32 slice self-test", 0, 0, 0, 0);
+	if (!crc32_selftest(drv_crc32c, CRC32C_POLY, 0xE3069283))
+		fail("crc32c slice self-test", 0, 0, 0, 0);
+
+	crc32_be_inited = TRUE;
+	if (!crc32_be_selftest())
+		fail("crc32_be slice self-test", 0, 0, 0, 0);
+
+#ifdef CRC32_PCLMUL
+	crc32_pclmul_available = pclmul;
+	if (pclmul && !crc32_selftest(drv_crc32, CRC32_POLY, 0xCBF43926))
+		fail("crc32 pclmulqdq self-test", 0, 0, 0, 0);
+	crc32_be_pclmul_available = be_pclmul;
+	if (be_pclmul && !crc32_be_selftest())
+		fail("crc32_be pclmulqdq self-test", 0, 0, 0, 0);
+#endif
+#ifdef CRC32_X86
+	crc32c_hw_available = hw;
+	if (hw && !crc32_selftest(drv_crc32c, CRC32C_POLY, 0xE3069283))
+		fail("crc32c sse4.2 self-test", 0, 0, 0, 0);
+#endif
+	(void)pclmul;
+	(void)be_pclmul;
+	(void)hw;
+}
+
+int main(void)
+{
+	struct engine engines[12];
+	int nr = 0, i;
+	size_t j;
+
+	srand(1);
+	for (j = 0; j < sizeof(buf); j++)
+		buf[j] = (__u8)rand();
+
+	drv_crc32_init();
+	printf("drv_crc32: %s, drv_crc32c: %s, drv_crc32_be: %s\n",
+	       drv_crc32_engine_name(drv_crc32_engine()),
+	       drv_crc32_engine_name(drv_crc32c_engine()),
+	       drv_crc32_engine_name(drv_crc32_be_engine()));
+
+	engines[nr++] = (struct engine){ "crc32 slice-by-8", crc32_slice8_fn, CRC32_POLY, 0 };
+	engines[nr++] = (struct engine){ "crc32 slice-by-16", crc32_slice16_fn, CRC32_POLY, 0 };
+	engines[nr++] = (struct engine){ "crc32c slice-by-8", crc32c_slice8_fn, CRC32C_POLY, 0 };
+	engines[nr++] = (struct engine){ "crc32c slice-by-16", crc32c_slice16_fn, CRC32C_POLY, 0 };
+#ifdef CRC32_PCLMUL
+	if (crc32_pclmul_available)
+		engines[nr++] = (struct engine){ "crc32 pclmulqdq", crc32_pclmul, CRC32_POLY,
+			CRC32_PCLMUL_THRESHOLD };
+#endif
+#ifdef CRC32_X86
+	if (crc32c_hw_available)
+		engines[nr++] = (struct engine){ "crc32c sse4.2", crc32c_hw, CRC32C_POLY, 0 };
+#endif
+	engines[nr++] = (struct engine){ "crc32_be slice-by-8", crc32_be_slice8_fn, CRC32_BE_POLY, 0 };
+#ifdef CRC32_PCLMUL
+	if (crc32_be_pclmul_available)
+		engines[nr++] = (struct engine){ "crc32_be pclmulqdq", crc32_be_pclmul, CRC32_BE_POLY,
+			CRC32_PCLMUL_THRESHOLD };
+#endif
+	engines[nr++] = (struct engine){ "drv_crc32", drv_crc32, CRC32_POLY, 0 };
+	engines[nr++] = (struct engine){ "drv_crc32c", drv_crc32c, CRC32C_POLY, 0 };
+	engines[nr++] = (struct engine){ "drv_crc32_be", drv_crc32_be, CRC32_BE_POLY, 0 };
+
+	for (i = 0; i < nr; i++) {
+		printf("%-20s ", engines[i].name);
+		fflush(stdout);
+		j = failures;
+		check_engine(&engines[i]);
+		printf("%s\n", failures == (int)j ? "ok" : "FAILED");
+	}
+
+	check_tables();
+	check_be_tables();
+	check_selftest();
+	check_known_answers();
+	check_multi();
+	check_combine();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+	printf("all passed\n");
+	return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * User-mode stand-in for include/helper.h
+ */
+
+#pragma once
+
+#include <ntifs.h>
+
+#include "drv_common/drv_types.h"
+#include "drv_common/drv_crc32.h"
+
+#define dbg_print(...)	fprintf(stderr, __VA_ARGS__)
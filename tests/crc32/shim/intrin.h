@@ -0,0 +1,14 @@
+/*
+ * User-mode stand-in for the MSVC <intrin.h>
+ */
+
+#pragma once
+
+#include <cpuid.h>
+#include <x86intrin.h>
+
+#undef __cpuid
+static inline void __cpuid(int info[4], int leaf)
+{
+	__cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+}
@@ -0,0 +1,39 @@
+/*
+ * User-mode stand-in for the kernel headers used by drv_crc32.c
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define __int8		char
+#define __int16		short
+#define __int32		int
+#define __int64		long long
+
+typedef unsigned char	BOOLEAN;
+typedef int32_t			LONG, *PLONG;
+typedef uint32_t		ULONG;
+typedef uintptr_t		ULONG_PTR;
+
+#define TRUE	1
+#define FALSE	0
+
+#define UNALIGNED
+
+#define RtlUshortByteSwap(x)	__builtin_bswap16(x)
+#define RtlUlongByteSwap(x)		__builtin_bswap32(x)
+#define RtlUlonglongByteSwap(x)	__builtin_bswap64(x)
+
+/* __declspec(align(n)) */
+#define __declspec(x)			__declspec_##x
+#define __declspec_align(n)		__attribute__((aligned(n)))
+
+/* drv_atomic.h */
+#define InterlockedExchange(p, v)			__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)		__atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement(p)				__atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)				__atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, c)	__sync_val_compare_and_swap(p, c, v)
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+/*
+ * Measures the LBCB table of jbd2.c under contention: N threads look
+ * up logged blocks the way jbd2_txn_handle_log() does, taking the lock
+ * of the block's shard around jbc2_lbcb_get() and jbd2_lbcb_put().  The
+ * same loop runs over the single RB tree under one lock that the table
+ * replaced, rebuilt here as it was.  The driver source is built in, so
+ * that the static routines of the table can be called directly.
+ *
+ * NR_LOGGED blocks stay logged through the run.  One lookup in
+ * NEW_RATIO is for a block that is not, which inserts an LBCB and
+ * removes it again.
+ *
+ *   lbcb_bench [nr. of threads ...]
+ */
+
+#include "jbd2.c"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NR_LOGGED	(1 << 16)
+#define NEW_RATIO	8
+#define RUN_MS		500
+
+static jbd2_handle_t handle;
+
+/* The LBCB table as it was: one tree under one lock */
+static drv_mutex_t single_lock;
+static jbd2_generic_table_t single_table;
+
+static jbd2_lbcb_t *
+single_lbcb_get(jbd2_fsblk_t blocknr)
+{
+	jbd2_lbcb_t *lbcb_tmp, *lbcb_ret;
+
+	lbcb_tmp = jbd2_lbcb_alloc(&handle);
+	if (!lbcb_tmp)
+		return NULL;
+
+	lbcb_tmp->jl_header.th_block = blocknr;
+	lbcb_tmp->jl_header.th_node_type = JBD2_NODE_LBCB;
+	drv_atomic_init(&lbcb_tmp->jl_header.th_refcount, 0);
+	lbcb_tmp->jl_is_new = TRUE;
+
+	lbcb_ret = (jbd2_lbcb_t *)RB_INSERT(
+							jbd2_generic_table,
+							&single_table,
+							&lbcb_tmp->jl_header);
+	if (lbcb_ret) {
+		jbd2_lbcb_free(&handle, lbcb_tmp);
+		lbcb_ret->jl_is_new = FALSE;
+	} else {
+		lbcb_ret = lbcb_tmp;
+	}
+	drv_atomic_inc(&lbcb_ret->jl_header.th_refcount);
+	return lbcb_ret;
+}
+
+static void
+single_lbcb_put(jbd2_lbcb_t *lbcb)
+{
+	if (drv_atomic_sub_and_test(&lbcb->jl_header.th_refcount, 1)) {
+		RB_REMOVE(jbd2_generic_table, &single_table, &lbcb->jl_header);
+		jbd2_lbcb_free(&handle, lbcb);
+	}
+}
+
+static __bool
+single_lookup(jbd2_fsblk_t blocknr)
+{
+	jbd2_lbcb_t *lbcb;
+
+	drv_mutex_acquire(&single_lock, TRUE);
+	lbcb = single_lbcb_get(blocknr);
+	if (lbcb)
+		single_lbcb_put(lbcb);
+	drv_mutex_release(&single_lock);
+	return lbcb != NULL;
+}
+
+static __bool
+sharded_lookup(jbd2_fsblk_t blocknr)
+{
+	jbd2_lbcb_shard_t *shard = jbd2_lbcb_shard(&handle, blocknr);
+	jbd2_lbcb_t *lbcb;
+
+	drv_mutex_acquire(&shard->ls_lock, TRUE);
+	lbcb = jbc2_lbcb_get(&handle, blocknr);
+	if (lbcb)
+		jbd2_lbcb_put(&handle, lbcb);
+	drv_mutex_release(&shard->ls_lock);
+	return lbcb != NULL;
+}
+
+struct table {
+	const char *	name;
+	__bool			(*lookup)(jbd2_fsblk_t blocknr);
+};
+
+static const struct table tables[] = {
+	{ "single",		single_lookup },
+	{ "sharded",	sharded_lookup },
+};
+
+#define NR_TABLES	(sizeof(tables) / sizeof(tables[0]))
+
+/* Logged blocks are even, the others odd */
+static jbd2_fsblk_t logged[NR_LOGGED];
+
+static volatile int stop;
+
+struct worker {
+	pthread_t				thread;
+	const struct table *	table;
+	__u64					rng;
+	__u64					nr_ops;
+	__bool					failed;
+};
+
+static __u64 rng(__u64 *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static void *worker_main(void *p)
+{
+	struct worker *w = p;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		__u64 r = rng(&w->rng);
+		jbd2_fsblk_t blocknr;
+
+		if (r % NEW_RATIO)
+			blocknr = logged[(r >> 8) % NR_LOGGED];
+		else
+			blocknr = ((r >> 8) & ((1ULL << 32) - 1)) | 1;
+		if (!w->table->lookup(blocknr)) {
+			w->failed = TRUE;
+			break;
+		}
+		w->nr_ops++;
+	}
+	return NULL;
+}
+
+/* Log the blocks, holding the reference a transaction would */
+static void log_blocks(void)
+{
+	__u64 state = 0x2545F4914F6CDD1DULL;
+	size_t i;
+
+	for (i = 0; i < NR_LOGGED; i++) {
+		jbd2_fsblk_t blocknr = (rng(&state) & ((1ULL << 32) - 1)) & ~1ULL;
+		jbd2_lbcb_t *lbcb;
+
+		logged[i] = blocknr;
+		lbcb = single_lbcb_get(blocknr);
+		if (lbcb && !lbcb->jl_is_new)
+			single_lbcb_put(lbcb);
+		lbcb = jbc2_lbcb_get(&handle, blocknr);
+		if (lbcb && !lbcb->jl_is_new)
+			jbd2_lbcb_put(&handle, lbcb);
+		if (!lbcb) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+}
+
+/* Run @p nr_threads threads over a table for RUN_MS, in lookups/s */
+static double run(const struct table *t, int nr_threads)
+{
+	struct worker *w = calloc(nr_threads, sizeof(*w));
+	struct timespec t0, t1;
+	__u64 nr_ops = 0;
+	int i;
+
+	if (!w)
+		exit(1);
+
+	stop = 0;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nr_threads; i++) {
+		w[i].table = t;
+		w[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+		if (pthread_create(&w[i].thread, NULL, worker_main, &w[i])) {
+			fprintf(stderr, "cannot create thread\n");
+			exit(1);
+		}
+	}
+	usleep(RUN_MS * 1000);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(w[i].thread, NULL);
+		if (w[i].failed) {
+			fprintf(stderr, "%s: out of memory\n", t->name);
+			exit(1);
+		}
+		nr_ops += w[i].nr_ops;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	free(w);
+	return nr_ops / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_threads[] = { 1, 2, 4, 8, 16 };
+	int nr_runs = argc > 1 ? argc - 1 : 5;
+	int i;
+	size_t j;
+
+	ExInitializeNPagedLookasideList(&handle.jh_lbcb_cache, NULL, NULL, 0,
+			sizeof(jbd2_lbcb_t), JBD2_LBCB_TABLE_TAG, 0);
+	drv_mutex_init(&single_lock);
+	RB_INIT(&single_table);
+	for (i = 0; i < JBD2_LBCB_SHARDS; i++) {
+		drv_mutex_init(&handle.jh_lbcb_shards[i].ls_lock);
+		RB_INIT(&handle.jh_lbcb_shards[i].ls_table);
+	}
+	log_blocks();
+
+	printf("%d logged blocks, 1 in %d lookups inserts, %ld CPUs\n\n",
+		NR_LOGGED, NEW_RATIO, sysconf(_SC_NPROCESSORS_ONLN));
+	printf("%-8s", "threads");
+	for (j = 0; j < NR_TABLES; j++)
+		printf(" %16s", tables[j].name);
+	printf("\n");
+
+	for (i = 0; i < nr_runs; i++) {
+		int nr_threads = argc > 1 ? atoi(argv[i + 1]) : default_threads[i];
+
+		if (nr_threads < 1) {
+			fprintf(stderr, "usage: %s [nr. of threads ...]\n", argv[0]);
+			return 2;
+		}
+		printf("%-8d", nr_threads);
+		for (j = 0; j < NR_TABLES; j++)
+			printf(" %9.2f Mops/s", run(&tables[j], nr_threads) / 1e6);
+		printf("\n");
+	}
+	return 0;
+}
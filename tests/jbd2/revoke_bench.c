@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+/*
+ * Times the revoke table of jbd2.c against the RB tree it replaced, on
+ * NR_REVOKES revoke records: inserting them, looking each of them up
+ * along with as many blocks that were never revoked, and clearing the
+ * table for the next replay.  The driver source is built in, so that
+ * the static routines of the table can be called directly.
+ *
+ * The RB tree is rebuilt here as it was: one lookaside-allocated node
+ * per block in jbd2_generic_table, which jbd2.c still generates for the
+ * LBCB shards.  Its reference counting is left out.
+ */
+
+#include "jbd2.c"
+
+#include <stdlib.h>
+#include <time.h>
+
+#define NR_REVOKES	(1 << 20)
+#define NR_ROUNDS	5
+
+/* Revoke entry of the RB tree, as jbd2.c had it */
+struct rb_revoke_entry {
+	struct jbd2_node_hdr	re_header;
+	__bool					re_is_new;
+	jbd2_tid_t				re_tid;
+};
+
+static NPAGED_LOOKASIDE_LIST rb_revoke_cache;
+static jbd2_generic_table_t rb_revoke_table;
+
+static NTSTATUS
+rb_revoke_insert(jbd2_fsblk_t blocknr, jbd2_tid_t tid)
+{
+	struct rb_revoke_entry *re_tmp, *re_ret;
+
+	re_tmp = ExAllocateFromNPagedLookasideList(&rb_revoke_cache);
+	if (!re_tmp)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	re_tmp->re_header.th_block = blocknr;
+	re_tmp->re_header.th_node_type = JBD2_NODE_LBCB;
+	re_tmp->re_is_new = TRUE;
+
+	re_ret = (struct rb_revoke_entry *)RB_INSERT(
+								jbd2_generic_table,
+								&rb_revoke_table,
+								&re_tmp->re_header);
+	if (re_ret) {
+		ExFreeToNPagedLookasideList(&rb_revoke_cache, re_tmp);
+		re_ret->re_is_new = FALSE;
+		if (jbd2_tid_cmp(tid, re_ret->re_tid) > 0)
+			re_ret->re_tid = tid;
+	} else {
+		re_tmp->re_tid = tid;
+	}
+	return STATUS_SUCCESS;
+}
+
+static __bool
+rb_revoke_lookup(jbd2_fsblk_t blocknr, jbd2_tid_t *tid)
+{
+	struct rb_revoke_entry re_tmp, *re_ret;
+
+	re_tmp.re_header.th_block = blocknr;
+	re_ret = (struct rb_revoke_entry *)RB_FIND(
+								jbd2_generic_table,
+								&rb_revoke_table,
+								&re_tmp.re_header);
+	if (!re_ret)
+		return FALSE;
+
+	*tid = re_ret->re_tid;
+	return TRUE;
+}
+
+static void
+rb_revoke_clear(void)
+{
+	struct jbd2_node_hdr *hdr, *tmp;
+
+	RB_FOREACH_SAFE(hdr, jbd2_generic_table, &rb_revoke_table, tmp) {
+		RB_REMOVE(jbd2_generic_table, &rb_revoke_table, hdr);
+		ExFreeToNPagedLookasideList(&rb_revoke_cache, hdr);
+	}
+}
+
+static jbd2_handle_t handle;
+
+static NTSTATUS
+hash_revoke_insert(jbd2_fsblk_t blocknr, jbd2_tid_t tid)
+{
+	return jbd2_revoke_table_insert(&handle, blocknr, tid);
+}
+
+static __bool
+hash_revoke_lookup(jbd2_fsblk_t blocknr, jbd2_tid_t *tid)
+{
+	return jbd2_revoke_table_lookup(&handle, blocknr, tid);
+}
+
+static void
+hash_revoke_clear(void)
+{
+	jbd2_revoke_table_clear(&handle);
+}
+
+/* Each round starts on an empty slot array, as the first replay does */
+static void
+hash_revoke_reset(void)
+{
+	jbd2_revoke_table_destroy(&handle);
+}
+
+struct table {
+	const char *	name;
+	NTSTATUS		(*insert)(jbd2_fsblk_t blocknr, jbd2_tid_t tid);
+	__bool			(*lookup)(jbd2_fsblk_t blocknr, jbd2_tid_t *tid);
+	void			(*clear)(void);
+	void			(*reset)(void);
+};
+
+static const struct table tables[] = {
+	{ "rb tree",	rb_revoke_insert,	rb_revoke_lookup,	rb_revoke_clear,	NULL },
+	{ "hash",		hash_revoke_insert,	hash_revoke_lookup,	hash_revoke_clear,	hash_revoke_reset },
+};
+
+#define NR_TABLES	(sizeof(tables) / sizeof(tables[0]))
+
+/*
+ * The revoked blocks, in the order their records are replayed, and
+ * the blocks looked up, half of them revoked and half never.
+ */
+static jbd2_fsblk_t revoked[NR_REVOKES];
+static jbd2_fsblk_t probes[2 * NR_REVOKES];
+
+static __u64 rng_state = 0x2545F4914F6CDD1DULL;
+
+static __u64 rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+/*
+ * Revoke records come from freed metadata, so they are mostly short
+ * runs of adjacent blocks scattered over a 16TiB volume of 4K blocks.
+ * Revoked block numbers are even and the blocks never revoked odd.
+ */
+static void make_blocks(void)
+{
+	size_t i = 0, j;
+
+	while (i < NR_REVOKES) {
+		jbd2_fsblk_t start = (rng() & ((1ULL << 32) - 1)) & ~1ULL;
+		size_t run = 1 + rng() % 16;
+
+		for (j = 0; j < run && i < NR_REVOKES; j++)
+			revoked[i++] = start + 2 * j;
+	}
+
+	for (i = 0; i < NR_REVOKES; i++) {
+		probes[2 * i] = revoked[rng() % NR_REVOKES];
+		probes[2 * i + 1] = (rng() & ((1ULL << 32) - 1)) | 1;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run a table through NR_ROUNDS replays and keep the best time of each
+ * phase.  Inserting includes growing the hash table from its first
+ * JBD2_REVOKE_TABLE_INIT_SLOTS slots.  Every fourth record is revoked again by a later transaction,
+ * like a block freed twice.  The sum of the transaction IDs found is
+ * returned so the tables can be checked against each other.
+ */
+static __u64 run(const struct table *t, double best[3])
+{
+	__u64 sum = 0;
+	int round;
+	size_t i;
+
+	best[0] = best[1] = best[2] = 1e9;
+	for (round = 0; round < NR_ROUNDS; round++) {
+		double t0, t1, t2, t3;
+		jbd2_tid_t tid;
+
+		sum = 0;
+		t0 = now();
+		for (i = 0; i < NR_REVOKES; i++) {
+			if (!NT_SUCCESS(t->insert(revoked[i], (jbd2_tid_t)(i >> 8)))) {
+				fprintf(stderr, "%s: insert failed\n", t->name);
+				exit(1);
+			}
+			if (!(i & 3) && i >= 4)
+				t->insert(revoked[i - 4], (jbd2_tid_t)(i >> 8));
+		}
+		t1 = now();
+		for (i = 0; i < 2 * NR_REVOKES; i++) {
+			if (t->lookup(probes[i], &tid))
+				sum += tid + 1;
+		}
+		t2 = now();
+		t->clear();
+		t3 = now();
+		if (t->reset)
+			t->reset();
+
+		if (t1 - t0 < best[0])
+			best[0] = t1 - t0;
+		if (t2 - t1 < best[1])
+			best[1] = t2 - t1;
+		if (t3 - t2 < best[2])
+			best[2] = t3 - t2;
+	}
+	return sum;
+}
+
+int main(void)
+{
+	__u64 sums[NR_TABLES];
+	size_t i;
+
+	ExInitializeNPagedLookasideList(&rb_revoke_cache, NULL, NULL, 0,
+			sizeof(struct rb_revoke_entry), 0, 0);
+	RB_INIT(&rb_revoke_table);
+	make_blocks();
+
+	printf("%d revokes, %d lookups, best of %d\n\n",
+		NR_REVOKES, 2 * NR_REVOKES, NR_ROUNDS);
+	printf("%-10s %12s %12s %12s\n", "table", "insert", "lookup", "clear");
+	for (i = 0; i < NR_TABLES; i++) {
+		double best[3];
+
+		sums[i] = run(&tables[i], best);
+		printf("%-10s %9.1f ns %9.1f ns %9.3f ms\n", tables[i].name,
+			best[0] * 1e9 / NR_REVOKES,
+			best[1] * 1e9 / (2 * NR_REVOKES),
+			best[2] * 1e3);
+	}
+
+	for (i = 1; i < NR_TABLES; i++) {
+		if (sums[i] != sums[0]) {
+			fprintf(stderr, "%s disagrees with %s\n",
+				tables[i].name, tables[0].name);
+			return 1;
+		}
+	}
+
+	ExDeleteNPagedLookasideList(&rb_revoke_cache);
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * User-mode stand-in for the kernel headers used by jbd2.c
+ *
+ * Only the types jbd2.c and its headers touch are declared.  The
+ * routines are in ntoskrnl.c; the ones the benchmarks cannot reach
+ * (the cache manager, system threads) abort when called.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define __int8		char
+#define __int16		short
+#define __int32		int
+#define __int64		long long
+
+#define UNALIGNED
+#define __inline	inline
+
+typedef void			VOID, *PVOID;
+typedef unsigned char	BOOLEAN, UCHAR;
+typedef unsigned short	USHORT;
+typedef int32_t			LONG, *PLONG;
+typedef uint32_t		ULONG;
+typedef int64_t			LONGLONG;
+typedef uint64_t		ULONGLONG;
+typedef uintptr_t		ULONG_PTR;
+typedef size_t			SIZE_T;
+typedef int32_t			NTSTATUS;
+typedef void *			HANDLE, *PKTHREAD;
+
+#define TRUE	1
+#define FALSE	0
+
+typedef union _LARGE_INTEGER {
+	struct {
+		ULONG	LowPart;
+		LONG	HighPart;
+	};
+	LONGLONG	QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _LIST_ENTRY {
+	struct _LIST_ENTRY *Flink;
+	struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _IO_STATUS_BLOCK {
+	NTSTATUS	Status;
+	ULONG_PTR	Information;
+} IO_STATUS_BLOCK;
+
+/* Dispatcher and executive objects, backed by pthreads in ntoskrnl.c */
+typedef struct _KEVENT {
+	int			Type;
+	int			Signaled;
+} KEVENT, *PKEVENT;
+
+typedef struct _FAST_MUTEX {
+	void *		Lock;
+} FAST_MUTEX;
+
+typedef struct _ERESOURCE {
+	void *		Lock;
+} ERESOURCE;
+
+typedef struct _NPAGED_LOOKASIDE_LIST {
+	SIZE_T		Size;
+} NPAGED_LOOKASIDE_LIST;
+
+/* Cache manager objects, opaque to jbd2.c */
+typedef struct _SECTION_OBJECT_POINTERS {
+	void *		SharedCacheMap;
+} SECTION_OBJECT_POINTERS;
+
+typedef struct _FILE_OBJECT {
+	SECTION_OBJECT_POINTERS *SectionObjectPointer;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _CC_FILE_SIZES {
+	LARGE_INTEGER	AllocationSize;
+	LARGE_INTEGER	FileSize;
+	LARGE_INTEGER	ValidDataLength;
+} CC_FILE_SIZES;
+
+typedef struct _CACHE_MANAGER_CALLBACKS {
+	void *		AcquireForLazyWrite;
+	void *		ReleaseFromLazyWrite;
+	void *		AcquireForReadAhead;
+	void *		ReleaseFromReadAhead;
+} CACHE_MANAGER_CALLBACKS;
+
+typedef struct _CACHE_UNINITIALIZE_EVENT {
+	KEVENT		Event;
+} CACHE_UNINITIALIZE_EVENT;
+
+typedef struct _PUBLIC_BCB {
+	LARGE_INTEGER	MappedFileOffset;
+} PUBLIC_BCB, *PPUBLIC_BCB;
+
+#define NT_SUCCESS(s)	((NTSTATUS)(s) >= 0)
+
+#define STATUS_SUCCESS					((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT					((NTSTATUS)0x00000102L)
+#define STATUS_PENDING					((NTSTATUS)0x00000103L)
+#define STATUS_DEVICE_BUSY				((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES			((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL				((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER		((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST	((NTSTATUS)0xC0000010L)
+#define STATUS_END_OF_FILE				((NTSTATUS)0xC0000011L)
+#define STATUS_ALREADY_COMMITTED		((NTSTATUS)0xC0000021L)
+#define STATUS_BUFFER_TOO_SMALL			((NTSTATUS)0xC0000023L)
+#define STATUS_DISK_CORRUPT_ERROR		((NTSTATUS)0xC0000032L)
+#define STATUS_CRC_ERROR				((NTSTATUS)0xC000003FL)
+#define STATUS_DISK_FULL				((NTSTATUS)0xC000007FL)
+#define STATUS_INSUFFICIENT_RESOURCES	((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED			((NTSTATUS)0xC00000BBL)
+#define STATUS_CANT_WAIT				((NTSTATUS)0xC00000D8L)
+#define STATUS_UNEXPECTED_IO_ERROR		((NTSTATUS)0xC00000E9L)
+#define STATUS_FILE_CORRUPT_ERROR		((NTSTATUS)0xC0000102L)
+#define STATUS_UNRECOGNIZED_VOLUME		((NTSTATUS)0xC000014FL)
+#define STATUS_INVALID_DEVICE_STATE		((NTSTATUS)0xC0000184L)
+#define STATUS_LOG_FILE_FULL			((NTSTATUS)0xC0000188L)
+#define STATUS_NOT_FOUND				((NTSTATUS)0xC0000225L)
+
+#define NonPagedPool			0
+#define PagedPool				1
+#define PIN_WAIT				1
+#define MAP_WAIT				1
+#define IO_NO_INCREMENT			0
+#define Executive				0
+#define KernelMode				0
+#define NotificationEvent		0
+#define SynchronizationEvent	1
+#define THREAD_ALL_ACCESS		0x1FFFFF
+#define VACB_MAPPING_GRANULARITY	0x40000
+
+#define UNREFERENCED_PARAMETER(x)	((void)(x))
+#define NT_ASSERT(x)				((void)0)
+#define FIELD_OFFSET(t, f)			offsetof(t, f)
+#define CONTAINING_RECORD(a, t, f)	((t *)((char *)(a) - offsetof(t, f)))
+
+/* __declspec(align(n)) */
+#define __declspec(x)			__declspec_##x
+#define __declspec_align(n)		__attribute__((aligned(n)))
+
+/* jbd2.c only ever leaves a __try block through __leave or its end */
+#define __try		for (int __try_once = 0; !__try_once; __try_once = 1)
+#define __finally	if (1)
+#define __leave		break
+
+#define RtlCopyMemory(d, s, n)	memcpy(d, s, n)
+#define RtlZeroMemory(p, n)		memset(p, 0, n)
+#define RtlFillMemory(p, n, v)	memset(p, v, n)
+
+#define RtlUshortByteSwap(x)	__builtin_bswap16(x)
+#define RtlUlongByteSwap(x)		__builtin_bswap32(x)
+#define RtlUlonglongByteSwap(x)	__builtin_bswap64(x)
+
+#define DbgPrint	printf
+
+#define InterlockedExchange(p, v)			__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(p, v)		__atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define InterlockedIncrement(p)				__atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(p)				__atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST)
+#define InterlockedCompareExchange(p, v, c)	__sync_val_compare_and_swap(p, c, v)
+
+static inline void InitializeListHead(PLIST_ENTRY head)
+{
+	head->Flink = head->Blink = head;
+}
+
+static inline BOOLEAN IsListEmpty(PLIST_ENTRY head)
+{
+	return head->Flink == head;
+}
+
+static inline BOOLEAN RemoveEntryList(PLIST_ENTRY entry)
+{
+	PLIST_ENTRY flink = entry->Flink, blink = entry->Blink;
+
+	blink->Flink = flink;
+	flink->Blink = blink;
+	return flink == blink;
+}
+
+static inline PLIST_ENTRY RemoveHeadList(PLIST_ENTRY head)
+{
+	PLIST_ENTRY entry = head->Flink;
+
+	RemoveEntryList(entry);
+	return entry;
+}
+
+static inline PLIST_ENTRY RemoveTailList(PLIST_ENTRY head)
+{
+	PLIST_ENTRY entry = head->Blink;
+
+	RemoveEntryList(entry);
+	return entry;
+}
+
+static inline void InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+	entry->Flink = head;
+	entry->Blink = head->Blink;
+	head->Blink->Flink = entry;
+	head->Blink = entry;
+}
+
+static inline void InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry)
+{
+	entry->Flink = head->Flink;
+	entry->Blink = head;
+	head->Flink->Blink = entry;
+	head->Flink = entry;
+}
+
+/* Pool */
+PVOID ExAllocatePoolWithTag(int pool_type, SIZE_T size, ULONG tag);
+void ExFreePoolWithTag(PVOID p, ULONG tag);
+void ExInitializeNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list,
+		PVOID allocate, PVOID free, ULONG flags, SIZE_T size,
+		ULONG tag, USHORT depth);
+void ExDeleteNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list);
+PVOID ExAllocateFromNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list);
+void ExFreeToNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list, PVOID p);
+
+/* Locks */
+void ExInitializeFastMutex(FAST_MUTEX *mutex);
+void ExAcquireFastMutex(FAST_MUTEX *mutex);
+void ExReleaseFastMutex(FAST_MUTEX *mutex);
+BOOLEAN ExTryToAcquireFastMutex(FAST_MUTEX *mutex);
+NTSTATUS ExInitializeResourceLite(ERESOURCE *resource);
+NTSTATUS ExDeleteResourceLite(ERESOURCE *resource);
+BOOLEAN ExAcquireResourceSharedLite(ERESOURCE *resource, BOOLEAN wait);
+BOOLEAN ExAcquireResourceExclusiveLite(ERESOURCE *resource, BOOLEAN wait);
+void ExReleaseResourceLite(ERESOURCE *resource);
+void ExConvertExclusiveToSharedLite(ERESOURCE *resource);
+ULONG ExIsResourceAcquiredLite(ERESOURCE *resource);
+BOOLEAN ExIsResourceAcquiredExclusiveLite(ERESOURCE *resource);
+
+/* Events and time */
+void KeInitializeEvent(PKEVENT event, int type, BOOLEAN state);
+LONG KeSetEvent(PKEVENT event, int increment, BOOLEAN wait);
+void KeClearEvent(PKEVENT event);
+NTSTATUS KeWaitForSingleObject(PVOID object, int reason, int mode,
+		BOOLEAN alertable, PLARGE_INTEGER timeout);
+ULONGLONG KeQueryInterruptTime(void);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency);
+void KeQuerySystemTime(PLARGE_INTEGER time);
+
+/* Not emulated */
+NTSTATUS PsCreateSystemThread(HANDLE *thread, ULONG access, PVOID attr,
+		HANDLE process, PVOID client_id, void (*start)(PVOID), PVOID context);
+NTSTATUS PsTerminateSystemThread(NTSTATUS status);
+NTSTATUS ObReferenceObjectByHandle(HANDLE handle, ULONG access, PVOID type,
+		int mode, PVOID *object, PVOID info);
+void ObDereferenceObject(PVOID object);
+NTSTATUS ZwClose(HANDLE handle);
+NTSTATUS ZwWaitForSingleObject(HANDLE handle, BOOLEAN alertable,
+		PLARGE_INTEGER timeout);
+BOOLEAN CcMapData(PFILE_OBJECT file, PLARGE_INTEGER offset, ULONG length,
+		ULONG flags, PVOID *bcb, PVOID buffer);
+BOOLEAN CcPinRead(PFILE_OBJECT file, PLARGE_INTEGER offset, ULONG length,
+		ULONG flags, PVOID *bcb, PVOID buffer);
+BOOLEAN CcPreparePinWrite(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		ULONG length, BOOLEAN zero, ULONG flags, PVOID *bcb, PVOID buffer);
+void CcSetDirtyPinnedData(PVOID bcb, PLARGE_INTEGER lsn);
+void CcUnpinData(PVOID bcb);
+void CcRepinBcb(PVOID bcb);
+void CcUnpinRepinnedBcb(PVOID bcb, BOOLEAN write_through,
+		IO_STATUS_BLOCK *iosb);
+BOOLEAN CcPurgeCacheSection(SECTION_OBJECT_POINTERS *section,
+		PLARGE_INTEGER offset, ULONG length, BOOLEAN uninitialize);
+void CcFlushCache(SECTION_OBJECT_POINTERS *section, PLARGE_INTEGER offset,
+		ULONG length, IO_STATUS_BLOCK *iosb);
+void CcScheduleReadAhead(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		ULONG length);
+void CcSetReadAheadGranularity(PFILE_OBJECT file, ULONG granularity);
+void CcInitializeCacheMap(PFILE_OBJECT file, CC_FILE_SIZES *sizes,
+		BOOLEAN pin_access, CACHE_MANAGER_CALLBACKS *callbacks,
+		PVOID context);
+BOOLEAN CcUninitializeCacheMap(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		CACHE_UNINITIALIZE_EVENT *event);
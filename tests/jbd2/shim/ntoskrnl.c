@@ -0,0 +1,335 @@
+/*
+ * User-mode stand-in for the kernel routines used by jbd2.c
+ *
+ * Pool, lookaside lists, locks, events and time are backed by libc and
+ * pthreads.  The cache manager and system threads are not emulated;
+ * the benchmarks never reach them and calling one aborts.
+ */
+
+#include <ntifs.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+static void not_emulated(const char *routine)
+{
+	fprintf(stderr, "%s is not emulated\n", routine);
+	abort();
+}
+
+PVOID ExAllocatePoolWithTag(int pool_type, SIZE_T size, ULONG tag)
+{
+	return malloc(size);
+}
+
+void ExFreePoolWithTag(PVOID p, ULONG tag)
+{
+	free(p);
+}
+
+void ExInitializeNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list,
+		PVOID allocate, PVOID free, ULONG flags, SIZE_T size,
+		ULONG tag, USHORT depth)
+{
+	list->Size = size;
+}
+
+void ExDeleteNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list)
+{
+}
+
+PVOID ExAllocateFromNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list)
+{
+	return malloc(list->Size);
+}
+
+void ExFreeToNPagedLookasideList(NPAGED_LOOKASIDE_LIST *list, PVOID p)
+{
+	free(p);
+}
+
+void ExInitializeFastMutex(FAST_MUTEX *mutex)
+{
+	mutex->Lock = malloc(sizeof(pthread_mutex_t));
+	if (!mutex->Lock)
+		abort();
+	pthread_mutex_init(mutex->Lock, NULL);
+}
+
+void ExAcquireFastMutex(FAST_MUTEX *mutex)
+{
+	pthread_mutex_lock(mutex->Lock);
+}
+
+void ExReleaseFastMutex(FAST_MUTEX *mutex)
+{
+	pthread_mutex_unlock(mutex->Lock);
+}
+
+BOOLEAN ExTryToAcquireFastMutex(FAST_MUTEX *mutex)
+{
+	return !pthread_mutex_trylock(mutex->Lock);
+}
+
+NTSTATUS ExInitializeResourceLite(ERESOURCE *resource)
+{
+	resource->Lock = malloc(sizeof(pthread_rwlock_t));
+	if (!resource->Lock)
+		return STATUS_INSUFFICIENT_RESOURCES;
+	pthread_rwlock_init(resource->Lock, NULL);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ExDeleteResourceLite(ERESOURCE *resource)
+{
+	pthread_rwlock_destroy(resource->Lock);
+	free(resource->Lock);
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN ExAcquireResourceSharedLite(ERESOURCE *resource, BOOLEAN wait)
+{
+	if (wait)
+		return !pthread_rwlock_rdlock(resource->Lock);
+	return !pthread_rwlock_tryrdlock(resource->Lock);
+}
+
+BOOLEAN ExAcquireResourceExclusiveLite(ERESOURCE *resource, BOOLEAN wait)
+{
+	if (wait)
+		return !pthread_rwlock_wrlock(resource->Lock);
+	return !pthread_rwlock_trywrlock(resource->Lock);
+}
+
+void ExReleaseResourceLite(ERESOURCE *resource)
+{
+	pthread_rwlock_unlock(resource->Lock);
+}
+
+void ExConvertExclusiveToSharedLite(ERESOURCE *resource)
+{
+	not_emulated(__func__);
+}
+
+ULONG ExIsResourceAcquiredLite(ERESOURCE *resource)
+{
+	not_emulated(__func__);
+	return 0;
+}
+
+BOOLEAN ExIsResourceAcquiredExclusiveLite(ERESOURCE *resource)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
+
+/* Every event shares one lock and condition variable */
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+
+void KeInitializeEvent(PKEVENT event, int type, BOOLEAN state)
+{
+	event->Type = type;
+	event->Signaled = state;
+}
+
+LONG KeSetEvent(PKEVENT event, int increment, BOOLEAN wait)
+{
+	LONG prev;
+
+	pthread_mutex_lock(&event_lock);
+	prev = event->Signaled;
+	event->Signaled = 1;
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_lock);
+	return prev;
+}
+
+void KeClearEvent(PKEVENT event)
+{
+	pthread_mutex_lock(&event_lock);
+	event->Signaled = 0;
+	pthread_mutex_unlock(&event_lock);
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID object, int reason, int mode,
+		BOOLEAN alertable, PLARGE_INTEGER timeout)
+{
+	PKEVENT event = object;
+	struct timespec deadline;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	/* Only relative timeouts, in units of 100ns */
+	if (timeout) {
+		long long ns;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		ns = deadline.tv_nsec - timeout->QuadPart * 100;
+		deadline.tv_sec += ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+	}
+
+	pthread_mutex_lock(&event_lock);
+	while (!event->Signaled) {
+		if (!timeout) {
+			pthread_cond_wait(&event_cond, &event_lock);
+		} else if (pthread_cond_timedwait(&event_cond, &event_lock,
+					&deadline) && !event->Signaled) {
+			status = STATUS_TIMEOUT;
+			break;
+		}
+	}
+	if (status == STATUS_SUCCESS && event->Type == SynchronizationEvent)
+		event->Signaled = 0;
+	pthread_mutex_unlock(&event_lock);
+	return status;
+}
+
+ULONGLONG KeQueryInterruptTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 10000000ULL + ts.tv_nsec / 100;
+}
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency)
+{
+	struct timespec ts;
+	LARGE_INTEGER now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (frequency)
+		frequency->QuadPart = 1000000000;
+	now.QuadPart = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+	return now;
+}
+
+void KeQuerySystemTime(PLARGE_INTEGER time)
+{
+	struct timespec ts;
+
+	/* 100ns units since 1601 */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time->QuadPart = 116444736000000000LL +
+		ts.tv_sec * 10000000LL + ts.tv_nsec / 100;
+}
+
+NTSTATUS PsCreateSystemThread(HANDLE *thread, ULONG access, PVOID attr,
+		HANDLE process, PVOID client_id, void (*start)(PVOID), PVOID context)
+{
+	not_emulated(__func__);
+	return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS status)
+{
+	not_emulated(__func__);
+	return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE handle, ULONG access, PVOID type,
+		int mode, PVOID *object, PVOID info)
+{
+	not_emulated(__func__);
+	return STATUS_NOT_SUPPORTED;
+}
+
+void ObDereferenceObject(PVOID object)
+{
+	not_emulated(__func__);
+}
+
+NTSTATUS ZwClose(HANDLE handle)
+{
+	not_emulated(__func__);
+	return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS ZwWaitForSingleObject(HANDLE handle, BOOLEAN alertable,
+		PLARGE_INTEGER timeout)
+{
+	not_emulated(__func__);
+	return STATUS_NOT_SUPPORTED;
+}
+
+BOOLEAN CcMapData(PFILE_OBJECT file, PLARGE_INTEGER offset, ULONG length,
+		ULONG flags, PVOID *bcb, PVOID buffer)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
+
+BOOLEAN CcPinRead(PFILE_OBJECT file, PLARGE_INTEGER offset, ULONG length,
+		ULONG flags, PVOID *bcb, PVOID buffer)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
+
+BOOLEAN CcPreparePinWrite(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		ULONG length, BOOLEAN zero, ULONG flags, PVOID *bcb, PVOID buffer)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
+
+void CcSetDirtyPinnedData(PVOID bcb, PLARGE_INTEGER lsn)
+{
+	not_emulated(__func__);
+}
+
+void CcUnpinData(PVOID bcb)
+{
+	not_emulated(__func__);
+}
+
+void CcRepinBcb(PVOID bcb)
+{
+	not_emulated(__func__);
+}
+
+void CcUnpinRepinnedBcb(PVOID bcb, BOOLEAN write_through,
+		IO_STATUS_BLOCK *iosb)
+{
+	not_emulated(__func__);
+}
+
+BOOLEAN CcPurgeCacheSection(SECTION_OBJECT_POINTERS *section,
+		PLARGE_INTEGER offset, ULONG length, BOOLEAN uninitialize)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
+
+void CcFlushCache(SECTION_OBJECT_POINTERS *section, PLARGE_INTEGER offset,
+		ULONG length, IO_STATUS_BLOCK *iosb)
+{
+	not_emulated(__func__);
+}
+
+void CcScheduleReadAhead(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		ULONG length)
+{
+	not_emulated(__func__);
+}
+
+void CcSetReadAheadGranularity(PFILE_OBJECT file, ULONG granularity)
+{
+	not_emulated(__func__);
+}
+
+void CcInitializeCacheMap(PFILE_OBJECT file, CC_FILE_SIZES *sizes,
+		BOOLEAN pin_access, CACHE_MANAGER_CALLBACKS *callbacks,
+		PVOID context)
+{
+	not_emulated(__func__);
+}
+
+BOOLEAN CcUninitializeCacheMap(PFILE_OBJECT file, PLARGE_INTEGER offset,
+		CACHE_UNINITIALIZE_EVENT *event)
+{
+	not_emulated(__func__);
+	return FALSE;
+}
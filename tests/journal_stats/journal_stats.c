@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2016 Kaho Ng (ngkaho1234@gmail.com)
+ */
+
+/*
+ * Prints a struct ext4_journal_stats record as FSCTL_EXT4_QUERY_JOURNAL_STATS
+ * returns it.  The record is read from the file named on the command line,
+ * or from stdin.  On Windows a volume may be named instead (\\.\X:), in
+ * which case the FSCTL is issued to it.
+ *
+ * The record is little-endian, so each field is decoded byte by byte at
+ * its offset in the structure and the printer runs on any host.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#endif
+
+typedef uint32_t	__u32;
+typedef int32_t		__s32;
+typedef uint64_t	__u64;
+
+#include "ext4_fsctl.h"
+
+/*
+ * The layout is what the driver and its users agree on, it must not
+ * depend on the compiler or the host.
+ */
+_Static_assert(sizeof(struct ext4_journal_stats) == 128,
+	"struct ext4_journal_stats changed size");
+_Static_assert(offsetof(struct ext4_journal_stats, js_replay_bytes_read) == 40,
+	"struct ext4_journal_stats is padded");
+_Static_assert(offsetof(struct ext4_journal_stats, js_commit_log_blocks) == 120,
+	"struct ext4_journal_stats is padded");
+
+#define FIELD32(rec, f) \
+	get_le32((rec) + offsetof(struct ext4_journal_stats, f))
+#define FIELD64(rec, f) \
+	get_le64((rec) + offsetof(struct ext4_journal_stats, f))
+
+static __u32 get_le32(const unsigned char *p)
+{
+	return (__u32)p[0] | (__u32)p[1] << 8 | (__u32)p[2] << 16 |
+		(__u32)p[3] << 24;
+}
+
+static __u64 get_le64(const unsigned char *p)
+{
+	return (__u64)get_le32(p) | (__u64)get_le32(p + 4) << 32;
+}
+
+static void print_us(const char *name, __u64 us)
+{
+	printf("  %-22s %llu.%06llu s\n", name,
+		(unsigned long long)(us / 1000000),
+		(unsigned long long)(us % 1000000));
+}
+
+static void print_u64(const char *name, __u64 v)
+{
+	printf("  %-22s %llu\n", name, (unsigned long long)v);
+}
+
+static int print_stats(const unsigned char *rec, size_t len)
+{
+	__u32 version, size;
+
+	if (len < 2 * sizeof(__u32)) {
+		fprintf(stderr, "record too short (%zu bytes)\n", len);
+		return 1;
+	}
+	version = FIELD32(rec, js_version);
+	size = FIELD32(rec, js_size);
+	if (version != EXT4_JOURNAL_STATS_VERSION) {
+		fprintf(stderr, "unknown record version %u\n", version);
+		return 1;
+	}
+	if (size != sizeof(struct ext4_journal_stats) || len < size) {
+		fprintf(stderr, "bad record size %u (read %zu bytes)\n", size, len);
+		return 1;
+	}
+
+	printf("recovery:\n");
+	printf("  %-22s 0x%08x\n", "status",
+		FIELD32(rec, js_replay_status));
+	print_u64("transactions", FIELD32(rec, js_replay_nr_txns));
+	print_u64("log blocks", FIELD32(rec, js_replay_nr_log_blocks));
+	print_u64("logged blocks", FIELD32(rec, js_replay_nr_recs));
+	print_u64("replayed", FIELD32(rec, js_replay_nr_replayed));
+	print_u64("superseded", FIELD32(rec, js_replay_nr_superseded));
+	print_u64("revoked", FIELD32(rec, js_replay_nr_revoked));
+	print_u64("fast commit blocks", FIELD32(rec, js_replay_nr_fc_blocks));
+	print_u64("bytes read", FIELD64(rec, js_replay_bytes_read));
+	print_us("scan", FIELD64(rec, js_replay_scan_us));
+	print_us("dedup", FIELD64(rec, js_replay_dedup_us));
+	print_us("write", FIELD64(rec, js_replay_write_us));
+	print_us("fast commit", FIELD64(rec, js_replay_fc_us));
+
+	printf("commits:\n");
+	print_u64("transactions", FIELD64(rec, js_commit_nr_commits));
+	print_u64("logged blocks", FIELD64(rec, js_commit_nr_blocks));
+	print_us("commit time", FIELD64(rec, js_commit_us));
+	print_u64("fast commits", FIELD64(rec, js_commit_nr_fc_commits));
+	print_u64("log wraps", FIELD64(rec, js_commit_nr_log_wraps));
+	printf("  %-22s %u of %u blocks\n", "log in use",
+		FIELD32(rec, js_commit_log_used),
+		FIELD32(rec, js_commit_log_blocks));
+	return 0;
+}
+
+#ifdef _WIN32
+static int query_volume(const char *path, unsigned char *rec, size_t *len)
+{
+	HANDLE volume;
+	DWORD ret;
+	BOOL ok;
+
+	volume = CreateFileA(path, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (volume == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "%s: cannot open (error %lu)\n", path,
+			GetLastError());
+		return 1;
+	}
+	ok = DeviceIoControl(volume, FSCTL_EXT4_QUERY_JOURNAL_STATS, NULL, 0,
+		rec, (DWORD)*len, &ret, NULL);
+	if (!ok)
+		fprintf(stderr, "%s: FSCTL_EXT4_QUERY_JOURNAL_STATS failed "
+			"(error %lu)\n", path, GetLastError());
+	CloseHandle(volume);
+	*len = ret;
+	return !ok;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	unsigned char rec[2 * sizeof(struct ext4_journal_stats)];
+	size_t len;
+	FILE *f = stdin;
+
+	if (argc > 2) {
+		fprintf(stderr, "usage: %s [record file]\n", argv[0]);
+		return 2;
+	}
+
+#ifdef _WIN32
+	if (argc == 2 && !strncmp(argv[1], "\\\\.\\", 4)) {
+		len = sizeof(rec);
+		if (query_volume(argv[1], rec, &len))
+			return 1;
+		return print_stats(rec, len);
+	}
+#endif
+
+	if (argc == 2 && strcmp(argv[1], "-")) {
+		f = fopen(argv[1], "rb");
+		if (!f) {
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	len = fread(rec, 1, sizeof(rec), f);
+	if (f != stdin)
+		fclose(f);
+	return print_stats(rec, len);
+}